@@ -0,0 +1,151 @@
+/*
+ * filename: bitpack_bench.c
+ *
+ * Compares packed storage with padded uint32_t words on synthetic FIFO
+ * batches: storage per sample, CPU time per sample and output rate.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <bitpack.h>
+
+#define BENCH_BATCH_SAMPLES (32)        /* one full FIFO drain */
+#define BENCH_SAMPLES       (1 << 22)
+
+struct bench_case {
+    const char *name;
+    uint32_t    channels;
+    uint8_t     slots[MAX_SIGNALS_ALLOWED];
+};
+
+static const struct bench_case cases[] = {
+    { "ppg1",            1, { PPG_LED1 } },
+    { "ppg1+ecg",        2, { PPG_LED1, ECG } },
+    { "ppg+ecg",         3, { PPG_LED1, PPG_LED2, ECG } },
+    { "ppg+pilot",       4, { PPG_LED1, PPG_LED2, PILOT_LED1, PILOT_LED2 } },
+};
+
+static uint64_t cpu_ns(void);
+static void fill_samples(uint32_t *words, uint32_t count);
+static void run_case(const struct bench_case *bc, const uint32_t *words);
+
+static volatile uint32_t sink;
+
+
+int main() {
+    uint32_t *words;
+    size_t i;
+
+    words = malloc((size_t)BENCH_SAMPLES * MAX_SIGNALS_ALLOWED * sizeof(uint32_t));
+    if (!words) {
+        printf("%s: cannot allocate input\n", __func__);
+        return -1;
+    }
+    fill_samples(words, BENCH_SAMPLES * MAX_SIGNALS_ALLOWED);
+
+    printf("%-10s %-7s %8s %12s %12s %12s\n",
+           "channels", "layout", "B/sample", "pack ns/smp", "unpack ns/smp", "out MB/s");
+    for (i = 0; i < sizeof(cases) / sizeof(cases[0]); i++) {
+        run_case(&cases[i], words);
+    }
+
+    free(words);
+    return 0;
+}
+
+
+static void run_case(const struct bench_case *bc, const uint32_t *words) {
+    struct bitpack_layout layout;
+    uint8_t bits[MAX_SIGNALS_ALLOWED];
+    size_t u32_bytes = (size_t)BENCH_SAMPLES * bc->channels * sizeof(uint32_t);
+    size_t packed_bytes;
+    uint8_t *out;
+    uint32_t *back;
+    uint64_t bit_pos;
+    uint64_t t0, t_pack, t_unpack;
+    uint32_t i;
+
+    for (i = 0; i < bc->channels; i++) bits[i] = bitpack_slot_bits(bc->slots[i]);
+    bitpack_layout_init(&layout, bits, bc->channels);
+    packed_bytes = ((uint64_t)BENCH_SAMPLES * layout.sample_bits + 7) / 8;
+
+    out  = calloc(1, u32_bytes + BITPACK_SLACK_BYTES);
+    back = malloc(u32_bytes);
+    if (!out || !back) {
+        printf("%s: cannot allocate buffers\n", __func__);
+        free(out);
+        free(back);
+        return;
+    }
+
+    /* Page faults are kept out of measurements */
+    memset(out, 0, u32_bytes + BITPACK_SLACK_BYTES);
+    memset(back, 0, u32_bytes);
+
+    /* Current layout: words are copied as they are */
+    t0 = cpu_ns();
+    for (i = 0; i < BENCH_SAMPLES; i += BENCH_BATCH_SAMPLES) {
+        memcpy(out + (size_t)i * bc->channels * sizeof(uint32_t), &words[(size_t)i * bc->channels],
+               BENCH_BATCH_SAMPLES * bc->channels * sizeof(uint32_t));
+    }
+    t_pack = cpu_ns() - t0;
+    t0 = cpu_ns();
+    memcpy(back, out, u32_bytes);
+    t_unpack = cpu_ns() - t0;
+    sink = back[BENCH_SAMPLES - 1];
+
+    printf("%-10s %-7s %8.2f %12.2f %12.2f %12.1f\n", bc->name, "u32",
+           (double)u32_bytes / BENCH_SAMPLES,
+           (double)t_pack / BENCH_SAMPLES, (double)t_unpack / BENCH_SAMPLES,
+           (double)u32_bytes * 1000 / (t_pack ? t_pack : 1));
+
+    /* Packed layout, batch by batch as capture writer does */
+    memset(out, 0, u32_bytes + BITPACK_SLACK_BYTES);
+    bit_pos = 0;
+    t0 = cpu_ns();
+    for (i = 0; i < BENCH_SAMPLES; i += BENCH_BATCH_SAMPLES) {
+        bit_pos = bitpack_pack(&words[(size_t)i * bc->channels], BENCH_BATCH_SAMPLES, &layout, out, bit_pos);
+    }
+    t_pack = cpu_ns() - t0;
+    t0 = cpu_ns();
+    bitpack_unpack(out, 0, BENCH_SAMPLES, &layout, back);
+    t_unpack = cpu_ns() - t0;
+
+    for (i = 0; i < BENCH_SAMPLES * bc->channels; i++) {
+        if (back[i] != (words[i] & layout.mask[i % bc->channels])) {
+            printf("%s: %s mismatch at word %u\n", __func__, bc->name, i);
+            break;
+        }
+    }
+
+    printf("%-10s %-7s %8.2f %12.2f %12.2f %12.1f   %.1f%% smaller\n", bc->name, "packed",
+           (double)packed_bytes / BENCH_SAMPLES,
+           (double)t_pack / BENCH_SAMPLES, (double)t_unpack / BENCH_SAMPLES,
+           (double)packed_bytes * 1000 / (t_pack ? t_pack : 1),
+           100.0 - (double)packed_bytes * 100 / u32_bytes);
+
+    free(out);
+    free(back);
+}
+
+/* FIFO like words: random data with tag bits above ADC width */
+static void fill_samples(uint32_t *words, uint32_t count) {
+    uint32_t x = 0x12345678;
+    uint32_t i;
+
+    for (i = 0; i < count; i++) {
+        x ^= x << 13;
+        x ^= x >> 17;
+        x ^= x << 5;
+        words[i] = x & 0xFFFFFF;
+    }
+}
+
+static uint64_t cpu_ns() {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
@@ -0,0 +1,267 @@
+/*
+ * filename: codec_bench.c
+ *
+ * Compression ratio and speed of capture codec. Runs on samples of a
+ * recorded capture file when given, otherwise on synthetic PPG/ECG at
+ * 3200 Hz. Chunks are cut the way capture writer does it.
+ *
+ *   codec_bench [capture_file]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include <capture_format.h>
+#include <codec.h>
+
+#define BENCH_RATE       (3200)
+#define BENCH_SECONDS    (120)
+#define BENCH_CHUNK_SIZE (CAPTURE_CHUNK_SIZE_DEFAULT)
+#define BENCH_PASSES     (5)
+
+static uint32_t *load_capture(const char *name, uint8_t *slots, uint32_t *channels, uint32_t *samples);
+static uint32_t *synthesize(uint8_t *slots, uint32_t *channels, uint32_t *samples);
+static uint64_t cpu_ns(void);
+
+
+int main(int argc, char **argv) {
+    uint8_t slots[MAX_SIGNALS_ALLOWED];
+    uint8_t bits[MAX_SIGNALS_ALLOWED];
+    struct bitpack_layout layout;
+    struct codec_state codec;
+    uint32_t *words;
+    uint32_t *back;
+    uint8_t *chunks;
+    uint32_t *chunk_samples;
+    uint32_t channels;
+    uint32_t samples;
+    uint32_t chunk_count = 0;
+    uint32_t max_chunks;
+    uint64_t limit_bits = (BENCH_CHUNK_SIZE - sizeof(struct capture_chunk_header) - BITPACK_SLACK_BYTES) * 8;
+    uint64_t payload_bytes = 0;
+    uint64_t u32_bytes, packed_bytes, rice_bytes;
+    uint64_t t0, t_enc = 0, t_dec = 0;
+    uint32_t i, pass;
+
+    words = (argc > 1) ? load_capture(argv[1], slots, &channels, &samples) :
+                         synthesize(slots, &channels, &samples);
+    if (!words) return -1;
+
+    for (i = 0; i < channels; i++) bits[i] = bitpack_slot_bits(slots[i]);
+    if (bitpack_layout_init(&layout, bits, channels) || codec_init(&codec, slots, channels)) {
+        printf("%s: unsupported channel layout\n", __func__);
+        return -1;
+    }
+
+    /* Chunk takes at least as many samples as fit in worst case */
+    max_chunks    = samples / (limit_bits / codec.max_sample_bits) + 1;
+    chunks        = calloc(max_chunks, BENCH_CHUNK_SIZE);
+    chunk_samples = calloc(max_chunks, sizeof(uint32_t));
+    back          = malloc((size_t)samples * channels * sizeof(uint32_t) + BITPACK_SLACK_BYTES);
+    if (!chunks || !chunk_samples || !back) {
+        printf("%s: cannot allocate buffers\n", __func__);
+        return -1;
+    }
+
+    for (pass = 0; pass < BENCH_PASSES; pass++) {
+        uint32_t done = 0;
+
+        memset(chunks, 0, (size_t)(chunk_count + 1) * BENCH_CHUNK_SIZE);
+        chunk_count   = 0;
+        payload_bytes = 0;
+
+        t0 = cpu_ns();
+        while (done < samples) {
+            uint8_t *payload = chunks + (size_t)chunk_count * BENCH_CHUNK_SIZE;
+            uint64_t bit_pos = 0;
+            uint32_t n = 0;
+
+            codec_reset(&codec);
+            while (done + n < samples) {
+                uint32_t fit = (limit_bits - bit_pos) / codec.max_sample_bits;
+
+                if (!fit) break;
+                if (fit > samples - done - n) fit = samples - done - n;
+                bit_pos = codec_encode(&codec, &words[(size_t)(done + n) * channels], fit, payload, bit_pos);
+                n += fit;
+            }
+            chunk_samples[chunk_count++] = n;
+            payload_bytes += (bit_pos + 7) / 8;
+            done += n;
+        }
+        t_enc += cpu_ns() - t0;
+
+        t0 = cpu_ns();
+        for (i = 0, done = 0; i < chunk_count; i++) {
+            codec_reset(&codec);
+            codec_decode(&codec, chunks + (size_t)i * BENCH_CHUNK_SIZE, 0, chunk_samples[i],
+                         &back[(size_t)done * channels]);
+            done += chunk_samples[i];
+        }
+        t_dec += cpu_ns() - t0;
+    }
+
+    for (i = 0; i < samples * channels; i++) {
+        if (back[i] != (words[i] & layout.mask[i % channels])) {
+            printf("%s: decoded data mismatch at word %u\n", __func__, i);
+            return -1;
+        }
+    }
+
+    /* On disk sizes, chunk headers and padding included */
+    u32_bytes = (uint64_t)(samples / ((BENCH_CHUNK_SIZE - sizeof(struct capture_chunk_header)) /
+                                      (channels * sizeof(uint32_t))) + 1) * BENCH_CHUNK_SIZE;
+    packed_bytes = (uint64_t)(samples / (limit_bits / layout.sample_bits) + 1) * BENCH_CHUNK_SIZE;
+    rice_bytes   = (uint64_t)chunk_count * BENCH_CHUNK_SIZE;
+
+    printf("samples %u, channels %u, %s\n", samples, channels, (argc > 1) ? argv[1] : "synthetic 3200 Hz");
+    printf("u32     %10llu bytes\n", (unsigned long long)u32_bytes);
+    printf("packed  %10llu bytes, ratio %.2f\n", (unsigned long long)packed_bytes,
+           (double)u32_bytes / packed_bytes);
+    printf("rice    %10llu bytes, ratio %.2f (%.2f vs packed), %.2f bits/value\n",
+           (unsigned long long)rice_bytes, (double)u32_bytes / rice_bytes, (double)packed_bytes / rice_bytes,
+           (double)payload_bytes * 8 / ((uint64_t)samples * channels));
+    printf("encode  %8.1f ns/sample, %8.1f MB/s of u32 input, %.3f%% CPU at %d Hz\n",
+           (double)t_enc / BENCH_PASSES / samples,
+           (double)samples * channels * sizeof(uint32_t) * BENCH_PASSES * 1000 / t_enc,
+           (double)t_enc / BENCH_PASSES / samples * BENCH_RATE / 1e7, BENCH_RATE);
+    printf("decode  %8.1f ns/sample, %8.1f MB/s of u32 output\n",
+           (double)t_dec / BENCH_PASSES / samples,
+           (double)samples * channels * sizeof(uint32_t) * BENCH_PASSES * 1000 / t_dec);
+
+    free(words);
+    free(back);
+    free(chunks);
+    free(chunk_samples);
+    return 0;
+}
+
+
+static uint32_t *load_capture(const char *name, uint8_t *slots, uint32_t *channels, uint32_t *samples) {
+    struct capture_file_header header;
+    struct bitpack_layout layout;
+    struct codec_state codec;
+    uint32_t *words = NULL;
+    uint8_t *chunk = NULL;
+    size_t allocated = 0;
+    FILE *f;
+
+    *samples = 0;
+    f = fopen(name, "rb");
+    if (!f) {
+        printf("%s: cannot open %s\n", __func__, name);
+        return NULL;
+    }
+
+    if ((fread(&header, sizeof(header), 1, f) != 1) ||
+        memcmp(header.magic, CAPTURE_MAGIC, sizeof(header.magic)) ||
+        (header.header_size != sizeof(header)) || !header.channels ||
+        (header.channels > MAX_SIGNALS_ALLOWED) || (header.chunk_size < CAPTURE_CHUNK_SIZE_MIN)) {
+        printf("%s: %s is not a capture file\n", __func__, name);
+        goto fail;
+    }
+    memcpy(slots, header.slots, header.channels);
+    *channels = header.channels;
+
+    if (header.encoding != CAPTURE_ENCODING_U32) {
+        if (bitpack_layout_init(&layout, header.bits, header.channels)) goto fail;
+    }
+    if ((header.encoding == CAPTURE_ENCODING_RICE) && codec_init(&codec, slots, header.channels)) goto fail;
+
+    chunk = malloc(header.chunk_size + BITPACK_SLACK_BYTES);
+    if (!chunk) goto fail;
+
+    while (fread(chunk, header.chunk_size, 1, f) == 1) {
+        struct capture_chunk_header *ch = (struct capture_chunk_header *)chunk;
+        uint32_t *dst;
+
+        if ((ch->magic != CAPTURE_CHUNK_MAGIC) || !ch->sample_count) continue;
+
+        if ((size_t)(*samples + ch->sample_count) * header.channels > allocated) {
+            size_t size = allocated ? allocated * 2 : 1 << 20;
+            uint32_t *tmp;
+
+            while (size < (size_t)(*samples + ch->sample_count) * header.channels) size *= 2;
+            tmp = realloc(words, size * sizeof(uint32_t));
+            if (!tmp) goto fail;
+            words = tmp;
+            allocated = size;
+        }
+        dst = &words[(size_t)*samples * header.channels];
+
+        if (header.encoding == CAPTURE_ENCODING_RICE) {
+            codec_reset(&codec);
+            codec_decode(&codec, chunk + sizeof(*ch), 0, ch->sample_count, dst);
+        } else if (header.encoding == CAPTURE_ENCODING_PACKED) {
+            bitpack_unpack(chunk + sizeof(*ch), 0, ch->sample_count, &layout, dst);
+        } else {
+            memcpy(dst, chunk + sizeof(*ch), ch->sample_count * header.channels * sizeof(uint32_t));
+        }
+        *samples += ch->sample_count;
+    }
+
+    if (!*samples) {
+        printf("%s: no samples in %s\n", __func__, name);
+        goto fail;
+    }
+
+    free(chunk);
+    fclose(f);
+    return words;
+
+fail:
+    free(words);
+    free(chunk);
+    fclose(f);
+    return NULL;
+}
+
+/* PPG1, PPG2 and ECG resembling signals with some noise */
+static uint32_t *synthesize(uint8_t *slots, uint32_t *channels, uint32_t *samples) {
+    uint32_t n = BENCH_RATE * BENCH_SECONDS;
+    uint32_t *words;
+    uint32_t noise = 0x2545F491;
+    uint32_t i;
+
+    words = malloc((size_t)n * 3 * sizeof(uint32_t));
+    if (!words) return NULL;
+
+    slots[0] = PPG_LED1;
+    slots[1] = PPG_LED2;
+    slots[2] = ECG;
+    *channels = 3;
+    *samples  = n;
+
+    for (i = 0; i < n; i++) {
+        double t = (double)i / BENCH_RATE;
+        double beat = fmod(t, 0.8) - 0.3;
+        int32_t ppg, ecg;
+        int j;
+
+        for (j = 0; j < 2; j++) {
+            noise ^= noise << 13;
+            noise ^= noise >> 17;
+            noise ^= noise << 5;
+            ppg = 120000 + 40000 * j + (3000 - 1000 * j) * sin(2 * M_PI * 1.25 * t) +
+                  600 * sin(2 * M_PI * 2.5 * t + 1) + 400 * sin(2 * M_PI * 0.2 * t) + (int32_t)(noise % 33) - 16;
+            words[i * 3 + j] = (uint32_t)ppg & 0x7FFFF;
+        }
+        noise ^= noise << 13;
+        noise ^= noise >> 17;
+        noise ^= noise << 5;
+        ecg = 20000 * exp(-beat * beat / 0.00015) - 3000 * exp(-(beat - 0.25) * (beat - 0.25) / 0.003) +
+              1500 * sin(2 * M_PI * 0.3 * t) + (int32_t)(noise % 41) - 20;
+        words[i * 3 + 2] = (uint32_t)ecg & 0x3FFFF;
+    }
+
+    return words;
+}
+
+static uint64_t cpu_ns() {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
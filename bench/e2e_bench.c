@@ -0,0 +1,305 @@
+/*
+ * filename: e2e_bench.c
+ *
+ * End-to-end throughput of the whole program. Every sampling rate MAX86150
+ * has is run with every signal combination program accepts, for a fixed
+ * wall time, and the --stats line of each run is turned into one CSV row
+ * on stdout. Against the simulated device (make sim) slow rates are run
+ * up to -s times faster than real time, never past the top device rate,
+ * and signals may be replayed from a recording (-r, see --sim-replay).
+ * Combinations program rejects (I2C bandwidth, ECG rates) are listed as
+ * such. Syscalls are those the program counts on acquisition and writer
+ * paths: I2C transfers, epoll waits and timer/signal reads, file writes.
+ *
+ *   e2e_bench [-b binary] [-d seconds] [-s max_speed] [-r replay_prefix]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include <max86150_defs.h>
+
+#define BENCH_BINARY_DEFAULT  "./build/start_max86150_sim"
+#define BENCH_SECONDS_DEFAULT (2)
+#define BENCH_RATE_MAX        (3200)
+#define BENCH_ARGS_MAX        (24)
+
+struct bench_signals {
+    const char *name;
+    uint8_t     allowed;
+};
+
+/* Fields of one --stats line */
+struct run_stats {
+    double rate_hz;
+    double speed;
+    double wall_s;
+    double cpu_user_s;
+    double cpu_sys_s;
+    double samples;
+    double lost;
+    double overflows;
+    double ring_full;
+    double drains;
+    double i2c_transfers;
+    double bus_bytes;
+    double writer_syscalls;
+    double loop_syscalls;
+    double bytes_written;
+};
+
+static const uint32_t rates[] = { 10, 20, 50, 84, 100, 200, 400, 800, 1000, 1600, 3200 };
+
+/* Pilot signals are not supported by the program */
+static const struct bench_signals signal_sets[] = {
+    { "ppg1",          ppg1 },
+    { "ppg2",          ppg2 },
+    { "ppg1+ppg2",     ppg1 | ppg2 },
+    { "ecg",           ecg },
+    { "ppg1+ecg",      ppg1 | ecg },
+    { "ppg2+ecg",      ppg2 | ecg },
+    { "ppg1+ppg2+ecg", ppg1 | ppg2 | ecg },
+};
+
+static int run_program(char **args, double seconds, int *status);
+static int read_stats(const char *path, struct run_stats *stats);
+static void print_row(uint32_t rate, const char *signals, int speed, const char *status,
+                      const struct run_stats *stats);
+static void sleep_ms(int ms);
+static uint64_t now_ns(void);
+static void print_usage(char **argv);
+
+
+int main(int argc, char **argv) {
+    const char *binary = BENCH_BINARY_DEFAULT;
+    const char *replay = NULL;
+    double seconds = BENCH_SECONDS_DEFAULT;
+    int max_speed = 1;
+    char capture_path[64];
+    char stats_path[64];
+    size_t r, s;
+    int a;
+
+    for (a = 1; a < argc; a++) {
+        if ((0 == strcmp(argv[a], "-b")) && (a + 1 < argc)) {
+            binary = argv[++a];
+            continue;
+        }
+        if ((0 == strcmp(argv[a], "-d")) && (a + 1 < argc)) {
+            seconds = atof(argv[++a]);
+            continue;
+        }
+        if ((0 == strcmp(argv[a], "-s")) && (a + 1 < argc)) {
+            max_speed = atoi(argv[++a]);
+            continue;
+        }
+        if ((0 == strcmp(argv[a], "-r")) && (a + 1 < argc)) {
+            replay = argv[++a];
+            continue;
+        }
+        print_usage(argv);
+        return -1;
+    }
+    if ((seconds <= 0) || (max_speed < 1)) {
+        print_usage(argv);
+        return -1;
+    }
+
+    snprintf(capture_path, sizeof(capture_path), "/tmp/e2e_bench_%d", (int)getpid());
+    snprintf(stats_path, sizeof(stats_path), "/tmp/e2e_bench_%d.stats", (int)getpid());
+
+    printf("rate_hz,signals,speed,status,wall_s,samples,lost,samples_per_s,cpu_pct,cpu_pct_realtime,"
+           "syscalls_per_sample,i2c_transfers_per_sample,bus_bytes,bytes_written,overflows,ring_full\n");
+    fflush(stdout);
+
+    for (r = 0; r < sizeof(rates) / sizeof(rates[0]); r++) {
+        for (s = 0; s < sizeof(signal_sets) / sizeof(signal_sets[0]); s++) {
+            const struct bench_signals *bs = &signal_sets[s];
+            struct run_stats stats;
+            char *args[BENCH_ARGS_MAX];
+            char rate_arg[16], speed_arg[16];
+            int speed = BENCH_RATE_MAX / rates[r];
+            int n = 0;
+            int status;
+
+            if (speed > max_speed) speed = max_speed;
+            if (speed < 1) speed = 1;
+
+            snprintf(rate_arg, sizeof(rate_arg), "%u", rates[r]);
+            snprintf(speed_arg, sizeof(speed_arg), "%d", speed);
+
+            args[n++] = (char *)binary;
+            if (bs->allowed & ppg1) args[n++] = "--ppg1";
+            if (bs->allowed & ppg2) args[n++] = "--ppg2";
+            if (bs->allowed & ecg)  args[n++] = "--ecg";
+            args[n++] = "-f";
+            args[n++] = rate_arg;
+            args[n++] = "--capture_file_name";
+            args[n++] = capture_path;
+            args[n++] = "--stats";
+            args[n++] = stats_path;
+            /* Real device build has no --sim options */
+            if (speed > 1) {
+                args[n++] = "--sim-speed";
+                args[n++] = speed_arg;
+            }
+            if (replay) {
+                args[n++] = "--sim-replay";
+                args[n++] = (char *)replay;
+            }
+            args[n] = NULL;
+
+            unlink(capture_path);
+            unlink(stats_path);
+
+            if (run_program(args, seconds, &status)) return -1;
+
+            if (read_stats(stats_path, &stats)) {
+                print_row(rates[r], bs->name, speed, "rejected", NULL);
+            } else {
+                print_row(rates[r], bs->name, speed,
+                          (WIFEXITED(status) && !WEXITSTATUS(status)) ? "ok" : "error", &stats);
+            }
+            fflush(stdout);
+        }
+    }
+
+    unlink(capture_path);
+    unlink(stats_path);
+
+    return 0;
+}
+
+/* Runs for given wall time, then stops program with SIGINT as a user would */
+static int run_program(char **args, double seconds, int *status) {
+    uint64_t deadline_ns = now_ns() + (uint64_t)(seconds * 1e9);
+    pid_t pid;
+    int fd;
+
+    pid = fork();
+    if (pid < 0) {
+        perror("fork");
+        return -1;
+    }
+    if (!pid) {
+        fd = open("/dev/null", O_WRONLY);
+        if (fd >= 0) {
+            dup2(fd, STDOUT_FILENO);
+            dup2(fd, STDERR_FILENO);
+        }
+        execv(args[0], args);
+        _exit(127);
+    }
+
+    while (now_ns() < deadline_ns) {
+        if (waitpid(pid, status, WNOHANG) == pid) return 0;
+        sleep_ms(10);
+    }
+    kill(pid, SIGINT);
+    if (waitpid(pid, status, 0) != pid) {
+        perror("waitpid");
+        return -1;
+    }
+    if (WIFEXITED(*status) && (WEXITSTATUS(*status) == 127)) {
+        printf("%s: cannot run %s\n", __func__, args[0]);
+        return -1;
+    }
+    return 0;
+}
+
+static int read_stats(const char *path, struct run_stats *stats) {
+    const struct {
+        const char *key;
+        double     *value;
+    } fields[] = {
+        { "rate_hz",         &stats->rate_hz },
+        { "speed",           &stats->speed },
+        { "wall_s",          &stats->wall_s },
+        { "cpu_user_s",      &stats->cpu_user_s },
+        { "cpu_sys_s",       &stats->cpu_sys_s },
+        { "samples",         &stats->samples },
+        { "lost",            &stats->lost },
+        { "overflows",       &stats->overflows },
+        { "ring_full",       &stats->ring_full },
+        { "drains",          &stats->drains },
+        { "i2c_transfers",   &stats->i2c_transfers },
+        { "bus_bytes",       &stats->bus_bytes },
+        { "writer_syscalls", &stats->writer_syscalls },
+        { "loop_syscalls",   &stats->loop_syscalls },
+        { "bytes_written",   &stats->bytes_written },
+    };
+    char line[1024];
+    char *token, *save;
+    FILE *file;
+    size_t f;
+
+    memset(stats, 0, sizeof(*stats));
+    file = fopen(path, "r");
+    if (!file) return -1;
+    if (!fgets(line, sizeof(line), file)) {
+        fclose(file);
+        return -1;
+    }
+    fclose(file);
+
+    for (token = strtok_r(line, " \n", &save); token; token = strtok_r(NULL, " \n", &save)) {
+        char *eq = strchr(token, '=');
+
+        if (!eq) continue;
+        *eq = 0;
+        for (f = 0; f < sizeof(fields) / sizeof(fields[0]); f++) {
+            if (0 == strcmp(token, fields[f].key)) *fields[f].value = strtod(eq + 1, NULL);
+        }
+    }
+    return (stats->wall_s > 0) ? 0 : -1;
+}
+
+/* Samples include lost ones, as they are numbered in capture file.
+ * cpu_pct_realtime is CPU load the same rate would take in real time */
+static void print_row(uint32_t rate, const char *signals, int speed, const char *status,
+                      const struct run_stats *stats) {
+    double cpu_pct, recorded, syscalls;
+
+    if (!stats) {
+        printf("%u,%s,%d,%s,,,,,,,,,,,,\n", rate, signals, speed, status);
+        return;
+    }
+
+    cpu_pct  = (stats->cpu_user_s + stats->cpu_sys_s) * 100 / stats->wall_s;
+    recorded = stats->samples - stats->lost;
+    syscalls = stats->i2c_transfers + stats->loop_syscalls + stats->writer_syscalls;
+
+    printf("%u,%s,%d,%s,%.3f,%.0f,%.0f,%.1f,%.2f,%.3f,%.3f,%.3f,%.0f,%.0f,%.0f,%.0f\n",
+           rate, signals, speed, status, stats->wall_s, stats->samples, stats->lost,
+           recorded / stats->wall_s, cpu_pct, cpu_pct / speed,
+           recorded ? syscalls / recorded : 0, recorded ? stats->i2c_transfers / recorded : 0,
+           stats->bus_bytes, stats->bytes_written, stats->overflows, stats->ring_full);
+}
+
+static void sleep_ms(int ms) {
+    struct timespec ts = { ms / 1000, (ms % 1000) * 1000000 };
+
+    nanosleep(&ts, NULL);
+}
+
+static uint64_t now_ns() {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void print_usage(char **argv) {
+    printf("%s usage:\n", argv[0]);
+    printf("\t%s [-b binary] [-d seconds] [-s max_speed] [-r replay_prefix]\n", argv[0]);
+    printf("\t-b\t-\tprogram to run. Default %s\n", BENCH_BINARY_DEFAULT);
+    printf("\t-d\t-\twall time of every run in s. Default %d\n", BENCH_SECONDS_DEFAULT);
+    printf("\t-s\t-\thighest simulation speed, rates below %d Hz run up to that many times faster. Default 1\n",
+           BENCH_RATE_MAX);
+    printf("\t-r\t-\treplay recorded signals, see --sim-replay\n");
+}
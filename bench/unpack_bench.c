@@ -0,0 +1,146 @@
+/*
+ * filename: unpack_bench.c
+ *
+ * Cycles per sample of every FIFO unpack path this CPU supports, on full
+ * FIFO bursts (32 samples). Output of every path is checked against the
+ * scalar one. Cycles come from TSC on x86, elsewhere only ns are shown.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unpack.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define BENCH_HAVE_TSC
+#endif
+
+#define BENCH_BURSTS (1 << 16)
+#define BENCH_PASSES (20)
+
+struct bench_case {
+    const char *name;
+    uint32_t    channels;
+    uint8_t     slots[MAX_SIGNALS_ALLOWED];
+};
+
+static const struct bench_case cases[] = {
+    { "ppg1",      1, { PPG_LED1 } },
+    { "ppg1+ecg",  2, { PPG_LED1, ECG } },
+    { "ppg+ecg",   3, { PPG_LED1, PPG_LED2, ECG } },
+    { "ppg+pilot", 4, { PPG_LED1, PPG_LED2, PILOT_LED1, PILOT_LED2 } },
+};
+
+static uint64_t now_ns(void);
+static uint64_t cycles(void);
+
+static volatile int32_t sink;
+
+
+int main() {
+    size_t burst_bytes = MAX86150_FIFO_DEPTH * MAX_SIGNALS_ALLOWED * BYTES_PER_FIFO_READ;
+    int32_t reference[MAX86150_FIFO_DEPTH * MAX_SIGNALS_ALLOWED];
+    int32_t out[MAX86150_FIFO_DEPTH * MAX_SIGNALS_ALLOWED];
+    int32_t planes[MAX_SIGNALS_ALLOWED][MAX86150_FIFO_DEPTH];
+    int32_t *plane_ptrs[MAX_SIGNALS_ALLOWED] = { planes[0], planes[1], planes[2], planes[3] };
+    uint8_t *raw;
+    uint32_t x = 0x9E3779B9;
+    size_t i;
+    int path;
+
+    /* Many different bursts, so branch predictor cannot learn the data */
+    raw = malloc(burst_bytes * BENCH_BURSTS + UNPACK_SLACK_BYTES);
+    if (!raw) {
+        printf("%s: cannot allocate input\n", __func__);
+        return -1;
+    }
+    for (i = 0; i < burst_bytes * BENCH_BURSTS + UNPACK_SLACK_BYTES; i++) {
+        x ^= x << 13;
+        x ^= x >> 17;
+        x ^= x << 5;
+        raw[i] = x;
+    }
+
+    unpack_init();
+    printf("default path: %s\n", unpack_path_name(unpack_selected()));
+    printf("%-10s %-8s %12s %12s %14s\n", "channels", "path", "ns/sample", "cycles/smp", "deinterleaved");
+
+    for (i = 0; i < sizeof(cases) / sizeof(cases[0]); i++) {
+        const struct bench_case *bc = &cases[i];
+        struct unpack_layout layout;
+        uint32_t words = MAX86150_FIFO_DEPTH * bc->channels;
+
+        unpack_layout_init(&layout, bc->slots, bc->channels);
+
+        for (path = 0; path < UNPACK_PATHS_NUM; path++) {
+            uint64_t t0, c0, t_il, c_il, t_de;
+            uint32_t b, k, c;
+            int pass;
+
+            if (unpack_select(path)) continue;
+
+            for (b = 0; b < 64; b++) {
+                const uint8_t *src = raw + b * burst_bytes;
+
+                unpack_select(UNPACK_SCALAR);
+                unpack_fifo(src, MAX86150_FIFO_DEPTH, &layout, reference);
+                unpack_select(path);
+                unpack_fifo(src, MAX86150_FIFO_DEPTH, &layout, out);
+                unpack_fifo_channels(src, MAX86150_FIFO_DEPTH, &layout, plane_ptrs);
+                for (k = 0; k < words; k++) {
+                    if ((out[k] != reference[k]) ||
+                        (planes[k % bc->channels][k / bc->channels] != reference[k])) {
+                        printf("%s: %s %s mismatch at word %u\n", __func__, bc->name, unpack_path_name(path), k);
+                        return -1;
+                    }
+                }
+            }
+
+            t0 = now_ns();
+            c0 = cycles();
+            for (pass = 0; pass < BENCH_PASSES; pass++) {
+                for (b = 0; b < BENCH_BURSTS; b++) {
+                    unpack_fifo(raw + b * burst_bytes, MAX86150_FIFO_DEPTH, &layout, out);
+                    sink = out[0];
+                }
+            }
+            c_il = cycles() - c0;
+            t_il = now_ns() - t0;
+
+            t0 = now_ns();
+            for (pass = 0; pass < BENCH_PASSES; pass++) {
+                for (b = 0; b < BENCH_BURSTS; b++) {
+                    unpack_fifo_channels(raw + b * burst_bytes, MAX86150_FIFO_DEPTH, &layout, plane_ptrs);
+                    for (c = 0; c < bc->channels; c++) sink = planes[c][0];
+                }
+            }
+            t_de = now_ns() - t0;
+
+            printf("%-10s %-8s %12.2f %12.2f %11.2f ns\n", bc->name, unpack_path_name(path),
+                   (double)t_il / BENCH_PASSES / BENCH_BURSTS / MAX86150_FIFO_DEPTH,
+                   (double)c_il / BENCH_PASSES / BENCH_BURSTS / MAX86150_FIFO_DEPTH,
+                   (double)t_de / BENCH_PASSES / BENCH_BURSTS / MAX86150_FIFO_DEPTH);
+        }
+    }
+
+    free(raw);
+    return 0;
+}
+
+
+static uint64_t now_ns() {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static uint64_t cycles() {
+#ifdef BENCH_HAVE_TSC
+    return __rdtsc();
+#else
+    return 0;
+#endif
+}
@@ -0,0 +1,56 @@
+/*
+ * filename: bitpack.h
+ *
+ * Dense storage of FIFO samples: every channel takes only its native ADC
+ * width (19 bits for PPG and pilots, 18 bits for ECG), samples follow each
+ * other without padding. Bitstream is LSB first, little-endian.
+ */
+
+#ifndef INCLUDE_BITPACK_H_
+#define INCLUDE_BITPACK_H_
+
+#include <stdint.h>
+#include <string.h>
+#include <peripheral.h>
+
+#define BITPACK_PPG_BITS (19)
+#define BITPACK_ECG_BITS (18)
+
+/* Packer stores whole 64-bit words, so output buffer needs this slack */
+#define BITPACK_SLACK_BYTES (8)
+
+struct bitpack_layout {
+    uint32_t channels;
+    uint32_t sample_bits;
+    uint8_t  bits[MAX_SIGNALS_ALLOWED];
+    uint8_t  shift[MAX_SIGNALS_ALLOWED]; /* channel position inside a sample */
+    uint32_t mask[MAX_SIGNALS_ALLOWED];
+    int      variant; /* see pipeline.h, PIPELINE_VARIANT_ANY for other widths */
+};
+
+/* Unaligned little-endian 64-bit access to bitstream */
+static inline uint64_t bitpack_load64(const uint8_t *p) {
+    uint64_t v;
+
+    memcpy(&v, p, sizeof(v));
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    v = __builtin_bswap64(v);
+#endif
+    return v;
+}
+
+static inline void bitpack_store64(uint8_t *p, uint64_t v) {
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    v = __builtin_bswap64(v);
+#endif
+    memcpy(p, &v, sizeof(v));
+}
+
+int bitpack_slot_bits(uint8_t slot);
+int bitpack_layout_init(struct bitpack_layout *layout, const uint8_t *bits, uint32_t channels);
+uint64_t bitpack_pack(const uint32_t *src, uint32_t samples, const struct bitpack_layout *layout,
+                      uint8_t *dst, uint64_t bit_pos);
+void bitpack_unpack(const uint8_t *src, uint64_t bit_pos, uint32_t samples,
+                    const struct bitpack_layout *layout, uint32_t *dst);
+
+#endif /* INCLUDE_BITPACK_H_ */
@@ -0,0 +1,47 @@
+/*
+ * filename: capture.h
+ */
+
+#ifndef INCLUDE_CAPTURE_H_
+#define INCLUDE_CAPTURE_H_
+
+#include <stdint.h>
+#include <max86150_defs.h>
+#include <peripheral.h>
+#include <ringbuffer.h>
+#include <capture_format.h>
+
+#define CAPTURE_BATCH_MAX_WORDS    (MAX86150_FIFO_DEPTH * MAX_SIGNALS_ALLOWED)
+#define CAPTURE_RING_SLOTS_DEFAULT (1024)
+
+#define CAPTURE_BATCH_OVERFLOW (1 << 0) /* FIFO overflowed before this drain */
+#define CAPTURE_BATCH_CONFIG   (1 << 1) /* settings changed before this drain, see config */
+
+/* One FIFO drain, as passed from acquisition loop to capture writer */
+struct capture_batch {
+    uint64_t timestamp_ns; /* CLOCK_MONOTONIC_RAW right before FIFO pointers are read */
+    uint64_t first_sample; /* sensor sample index, lost samples included */
+    uint64_t lost;         /* samples lost right before first_sample */
+    uint32_t lost_flags;   /* CAPTURE_GAP_* causes of the loss */
+    uint32_t flags;        /* CAPTURE_BATCH_* */
+    uint32_t fifo_level;   /* samples in FIFO at timestamp_ns, leftovers included */
+    uint32_t samples;
+    uint32_t words;
+    struct capture_config_record config;    /* with CAPTURE_BATCH_CONFIG */
+    uint32_t data[CAPTURE_BATCH_MAX_WORDS]; /* int32 values, see unpack_fifo() */
+};
+
+struct capture_writer_stats; /* filework.h */
+
+uint32_t capture_channel_slots(uint8_t allowed_signals, uint8_t *slots);
+void capture_fill_header(struct capture_file_header *header, struct max86150_configuration *max86150,
+                         uint32_t chunk_size);
+void capture_fill_config(struct capture_config_record *config, const struct max86150_configuration *max86150);
+
+int start_capture_writer(int fd, struct spsc_ring *ring, struct max86150_configuration *max86150);
+void capture_set_stop(uint32_t signal, uint64_t stop_monotonic_ns);
+int stop_capture_writer(void);
+int capture_writer_failed(void);
+void capture_get_writer_stats(struct capture_writer_stats *stats);
+
+#endif /* INCLUDE_CAPTURE_H_ */
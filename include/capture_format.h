@@ -0,0 +1,209 @@
+/*
+ * filename: capture_format.h
+ *
+ * Capture file layout (all fields little-endian):
+ *
+ *   struct capture_file_header              - header_size bytes
+ *   chunk 0                                 - chunk_size bytes
+ *   chunk 1
+ *   ...
+ *
+ * Every chunk is struct capture_chunk_header followed by payload_bytes of
+ * samples and zero padding up to chunk_size, so chunk N always starts at
+ * header_size + N * chunk_size. Samples are never split between chunks.
+ *
+ * Sample i of a chunk was taken at
+ *   sample_time_ns + (i - first_sample) * sample_period_fs / 1000000
+ * on CLOCK_MONOTONIC_RAW, header start times map it to wall clock.
+ *
+ * Chunk with CAPTURE_CHUNK_FLAG_GAP holds no samples, its payload is
+ * struct capture_gap_record: lost_samples samples starting at first_sample
+ * were never captured.
+ *
+ * Chunk with CAPTURE_CHUNK_FLAG_CONFIG holds no samples, its payload is
+ * struct capture_config_record: live settings in effect from first_sample
+ * on, header keeps the ones recording started with. Samples taken with
+ * different settings never share a chunk.
+ *
+ * Recording closed by the program (not cut by power loss or crash) ends
+ * with a chunk flagged
+ * CAPTURE_CHUNK_FLAG_TRAILER | CAPTURE_CHUNK_FLAG_LAST, its payload is
+ * struct capture_trailer_record.
+ *
+ * With CAPTURE_ENCODING_PACKED payload is a bitstream from bitpack.h, every
+ * channel takes bits[] bits, payload_bytes is rounded up to whole bytes.
+ * With CAPTURE_ENCODING_RICE payload is codec.h bitstream of sample_count
+ * samples, codec state starts over in every chunk.
+ */
+
+#ifndef INCLUDE_CAPTURE_FORMAT_H_
+#define INCLUDE_CAPTURE_FORMAT_H_
+
+#include <stdint.h>
+#include <stddef.h>
+#include <max86150_defs.h>
+#include <peripheral.h>
+#include <bitpack.h>
+#include <codec.h>
+
+#define CAPTURE_MAGIC              "MAX86150"
+#define CAPTURE_VERSION            (2)
+#define CAPTURE_CHUNK_MAGIC        (0x4B4E4843) /* "CHNK" */
+#define CAPTURE_CHUNK_SIZE_DEFAULT (4096)
+#define CAPTURE_CHUNK_SIZE_MIN     (256)
+
+typedef enum {
+    CAPTURE_ENCODING_U32    = 0, /* one int32_t per FIFO word, masked, ECG sign extended */
+    CAPTURE_ENCODING_PACKED = 1, /* native ADC width per channel, no padding */
+    CAPTURE_ENCODING_RICE   = 2  /* predicted, Rice coded residuals, see codec.h */
+}capture_encoding;
+
+struct capture_file_header {
+    char     magic[8];
+    uint16_t version;
+    uint16_t header_size;
+    uint32_t chunk_size;
+    uint32_t encoding;
+    uint32_t allowed_signals;
+    uint8_t  channels;
+    uint8_t  slots[MAX_SIGNALS_ALLOWED];  /* dcr_slot of every FIFO word in a sample */
+    uint8_t  fifo_a_full_samples;
+    uint8_t  fifo_rollover;
+    uint8_t  reserved0;
+
+    /* User parameters */
+    int32_t  sampling_frequency;
+    int32_t  ppg_sampling_freq;
+    int32_t  ecg_sampling_freq;
+    int32_t  ppg_adc_scale;
+    int32_t  ppg_led_pw;
+    int32_t  ppg_pulses;
+    int32_t  ppg_sample_average;
+    int32_t  ppg_led1_amplitude;
+    int32_t  ppg_led2_amplitude;
+    int32_t  ecg_adc_clk_osr;
+    int32_t  ecg_pga_gain;
+    int32_t  ecg_ia_gain;
+
+    /* Register values */
+    uint8_t  ppg_range_reg;
+    uint8_t  ppg_sampling_reg;
+    uint8_t  ppg_width_reg;
+    uint8_t  ppg_smp_avg_reg;
+    uint8_t  ppg_led1_amplitude_reg;
+    uint8_t  ppg_led2_amplitude_reg;
+    uint8_t  ppg_led1_amplitude_range;
+    uint8_t  ppg_led2_amplitude_range;
+    uint8_t  ecg_adc_clk_osr_reg;
+    uint8_t  ecg_pga_gain_reg;
+    uint8_t  ecg_ia_gain_reg;
+    uint8_t  bits[MAX_SIGNALS_ALLOWED];   /* width of every channel, 0 for u32 encoding */
+    uint8_t  reserved1[1];
+
+    uint64_t start_realtime_ns;
+    uint64_t start_monotonic_ns;          /* CLOCK_MONOTONIC_RAW, same moment */
+    uint32_t reserved2[7];
+    uint32_t crc32;                       /* over header with crc32 = 0 */
+};
+
+#define CAPTURE_CHUNK_FLAG_LAST (1 << 0)
+#define CAPTURE_CHUNK_FLAG_GAP  (1 << 1)
+#define CAPTURE_CHUNK_FLAG_TRAILER (1 << 2)
+#define CAPTURE_CHUNK_FLAG_CONFIG  (1 << 3)
+
+#define CAPTURE_GAP_FIFO_OVERFLOW (1 << 0) /* sensor FIFO was full, counted by OVF_COUNTER */
+#define CAPTURE_GAP_RING_FULL     (1 << 1) /* writer did not keep up */
+#define CAPTURE_GAP_AT_LEAST      (1 << 2) /* OVF_COUNTER saturated, more may be lost */
+#define CAPTURE_GAP_ESTIMATED     (1 << 3) /* saturated count extended from sample clock */
+
+struct capture_gap_record {
+    uint64_t lost_samples;
+    uint32_t flags;
+    uint32_t reserved;
+};
+
+#define CAPTURE_CONFIG_ESTIMATED (1 << 0) /* first_sample from sample clock, else first one drained after change */
+
+struct capture_config_record {
+    uint64_t change_ns;         /* CLOCK_MONOTONIC_RAW when registers were written */
+    int32_t  ppg_adc_scale;
+    int32_t  ppg_sample_average;
+    int32_t  ppg_led1_amplitude;
+    int32_t  ppg_led2_amplitude;
+    int32_t  ecg_pga_gain;
+    int32_t  ecg_ia_gain;
+    uint8_t  ppg_range_reg;
+    uint8_t  ppg_smp_avg_reg;
+    uint8_t  ppg_led1_amplitude_reg;
+    uint8_t  ppg_led2_amplitude_reg;
+    uint8_t  ppg_led1_amplitude_range;
+    uint8_t  ppg_led2_amplitude_range;
+    uint8_t  ecg_pga_gain_reg;
+    uint8_t  ecg_ia_gain_reg;
+    uint32_t flags;             /* CAPTURE_CONFIG_* */
+    uint32_t reserved;
+};
+
+struct capture_trailer_record {
+    uint64_t samples;           /* sample numbers used, lost samples included */
+    uint64_t lost_samples;
+    uint64_t gaps;
+    uint64_t stop_realtime_ns;
+    uint64_t stop_monotonic_ns; /* CLOCK_MONOTONIC_RAW when stop was requested */
+    uint64_t sample_period_fs;  /* final estimate, 0 if unknown */
+    uint32_t stop_signal;       /* 0 - stopped on error */
+    uint32_t reserved;
+};
+
+struct capture_chunk_header {
+    uint32_t magic;
+    uint32_t sequence;
+    uint32_t sample_count;
+    uint32_t payload_bytes;
+    uint64_t first_sample;  /* index of first sample since recording start */
+    uint64_t timestamp_ns;  /* CLOCK_MONOTONIC_RAW of FIFO drain with first sample */
+    uint64_t sample_time_ns;   /* estimated CLOCK_MONOTONIC_RAW of first sample, see timebase.h */
+    uint64_t sample_period_fs; /* estimated sample period, 0 if unknown */
+    uint32_t flags;
+    uint32_t crc32;         /* over chunk header with crc32 = 0 and payload */
+};
+
+/* Builds chunks out of FIFO batches on writer side */
+struct capture_chunker {
+    uint8_t  *buf;
+    uint32_t  chunk_size;
+    uint32_t  encoding;
+    uint32_t  sample_bytes; /* u32 encoding */
+    struct bitpack_layout layout; /* packed and compressed encodings */
+    struct codec_state codec;     /* compressed encoding */
+    uint64_t  bit_pos;      /* payload length in bits */
+    uint64_t  limit_bits;   /* payload bits available in a chunk */
+    uint32_t  capacity;     /* samples per chunk */
+    uint32_t  sequence;
+    uint64_t  next_sample;
+    uint64_t  opened_ns;    /* when first sample got in, 0 - chunk is empty */
+    uint64_t  clock_sample; /* sample clock reference, see capture_chunker_set_clock() */
+    uint64_t  clock_ns;
+    uint64_t  clock_period_fs;
+};
+
+uint32_t capture_crc32(uint32_t crc, const void *data, size_t len);
+
+int capture_check_header(const struct capture_file_header *header);
+
+int capture_chunker_init(struct capture_chunker *chunker, uint32_t chunk_size, uint32_t encoding,
+                         const uint8_t *slots, uint32_t channels);
+void capture_chunker_free(struct capture_chunker *chunker);
+uint32_t capture_chunker_put(struct capture_chunker *chunker, const void *samples, uint32_t count,
+                             uint64_t timestamp_ns, uint64_t now_ns);
+int capture_chunker_full(struct capture_chunker *chunker);
+void capture_chunker_set_clock(struct capture_chunker *chunker, uint64_t sample, uint64_t sample_ns,
+                               uint64_t period_fs);
+const void *capture_chunker_seal(struct capture_chunker *chunker, uint32_t flags);
+const void *capture_chunker_gap(struct capture_chunker *chunker, uint64_t lost, uint32_t flags);
+const void *capture_chunker_config(struct capture_chunker *chunker, const struct capture_config_record *config);
+const void *capture_chunker_trailer(struct capture_chunker *chunker, const struct capture_trailer_record *trailer);
+
+int capture_check_chunk(const void *chunk, uint32_t chunk_size);
+
+#endif /* INCLUDE_CAPTURE_FORMAT_H_ */
@@ -0,0 +1,53 @@
+/*
+ * filename: codec.h
+ *
+ * Lossless streaming codec for capture chunks. Every channel is predicted
+ * from its two previous values (second order fixed predictor, as in FLAC)
+ * and residuals are Rice coded with parameter adapted from running mean of
+ * previous residuals, so no side information is stored. Predictor state is
+ * reset at chunk start, so every chunk decodes on its own.
+ *
+ * Rice code of zigzag mapped residual u with parameter k, LSB first:
+ *   q = u >> k zero bits, one 1 bit, k low bits of u
+ * if q >= CODEC_ESCAPE_Q: CODEC_ESCAPE_Q zero bits, 1 bit, CODEC_RAW_BITS of u
+ */
+
+#ifndef INCLUDE_CODEC_H_
+#define INCLUDE_CODEC_H_
+
+#include <stdint.h>
+#include <peripheral.h>
+#include <bitpack.h>
+
+#define CODEC_ESCAPE_Q  (24)
+#define CODEC_RAW_BITS  (24)
+#define CODEC_MAX_K     (22)
+#define CODEC_MEAN_SHIFT (4)  /* running mean over ~16 residuals */
+
+/* Longest code of a single channel value */
+#define CODEC_MAX_CHANNEL_BITS (CODEC_ESCAPE_Q + 1 + CODEC_RAW_BITS)
+
+struct codec_channel {
+    int32_t  x1;    /* previous value */
+    int32_t  x2;    /* value before previous */
+    uint32_t mean;  /* residual mean << CODEC_MEAN_SHIFT */
+};
+
+struct codec_state {
+    uint32_t channels;
+    int      variant;                     /* see pipeline.h */
+    uint32_t history;                     /* samples since reset, saturates at 2 */
+    uint32_t max_sample_bits;
+    uint32_t mask[MAX_SIGNALS_ALLOWED];
+    uint8_t  sign_shift[MAX_SIGNALS_ALLOWED]; /* 32 - bits for two's complement channels */
+    struct codec_channel ch[MAX_SIGNALS_ALLOWED];
+};
+
+int codec_init(struct codec_state *codec, const uint8_t *slots, uint32_t channels);
+void codec_reset(struct codec_state *codec);
+uint64_t codec_encode(struct codec_state *codec, const uint32_t *src, uint32_t samples,
+                      uint8_t *dst, uint64_t bit_pos);
+uint64_t codec_decode(struct codec_state *codec, const uint8_t *src, uint64_t bit_pos,
+                      uint32_t samples, uint32_t *dst);
+
+#endif /* INCLUDE_CODEC_H_ */
@@ -0,0 +1,19 @@
+/*
+ * filename: control.h
+ *
+ * Live reconfiguration through a named pipe. Every line is a list of
+ * "setting value" pairs (names of command line options without "--"),
+ * applied as one change between FIFO drains.
+ */
+
+#ifndef INCLUDE_CONTROL_H_
+#define INCLUDE_CONTROL_H_
+
+#include <max86150_defs.h>
+
+#define CONTROL_LINE_MAX (256)
+
+int open_max86150_control(struct max86150_configuration *max86150);
+void close_max86150_control(void);
+
+#endif /* INCLUDE_CONTROL_H_ */
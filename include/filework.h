@@ -5,16 +5,44 @@
 #ifndef INCLUDE_FILEWORK_H_
 #define INCLUDE_FILEWORK_H_
 
+#include <stdint.h>
+#include <logger.h>
+
 #define DEFAULT_BINARY_NAME "/tmp/ecg_ppg_binary"
 #define MAX_FILENAME_LENGTH 128
 
 #define DEBUG_FNAME "/tmp/max86150_logs.txt"
 
+#define CAPTURE_FLUSH_BYTES_DEFAULT   (64 * 1024)
+#define CAPTURE_FLUSH_LATENCY_DEFAULT (1000) /* ms */
+#define CAPTURE_MMAP_WINDOW           (4 * 1024 * 1024)
+#define CAPTURE_DURATION_DEFAULT      (3600) /* s, used to preallocate mmap capture file */
+
+typedef enum {
+    CAPTURE_BACKEND_AUTO     = 0, /* io_uring if kernel has it, writev otherwise */
+    CAPTURE_BACKEND_WRITEV   = 1,
+    CAPTURE_BACKEND_IO_URING = 2,
+    CAPTURE_BACKEND_MMAP     = 3  /* preallocated file, appended through mmap window */
+}capture_backend;
+
+struct capture_writer_stats {
+    uint64_t bytes;
+    uint32_t flushes;
+    uint32_t syscalls;
+    uint32_t waits;    /* times appending had to wait for previous flush */
+};
+
 void init_debug(void);
 int open_capture_file(char *name);
 int close_capture_file();
 void close_debug();
-void d_print(const char *__format, ...);
+
+int capture_writer_open(int fd, capture_backend backend, uint32_t flush_bytes, uint32_t flush_latency_ms,
+                        uint64_t reserve_bytes);
+int capture_writer_append(const void *data, uint32_t bytes);
+int capture_writer_flush_due(void);
+int capture_writer_flush(void);
+int capture_writer_close(struct capture_writer_stats *stats);
 
 
 #endif /* INCLUDE_FILEWORK_H_ */
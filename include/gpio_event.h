@@ -0,0 +1,12 @@
+/*
+ * filename: gpio_event.h
+ */
+
+#ifndef INCLUDE_GPIO_EVENT_H_
+#define INCLUDE_GPIO_EVENT_H_
+
+#include <signalwork.h>
+
+extern const struct max86150_event_source gpio_event_source;
+
+#endif /* INCLUDE_GPIO_EVENT_H_ */
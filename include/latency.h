@@ -0,0 +1,34 @@
+/*
+ * filename: latency.h
+ *
+ * Per stage latency histograms of acquisition loop and capture writer.
+ * Buckets are log-linear like in HdrHistogram: every power of two range is
+ * split into 2^LATENCY_SUB_BITS equal buckets, so any value is kept within
+ * 1/16 (6%) of itself, from nanoseconds to minutes, in fixed memory.
+ * Every stage has a single writer thread, any thread may read a report.
+ */
+
+#ifndef INCLUDE_LATENCY_H_
+#define INCLUDE_LATENCY_H_
+
+#include <stdint.h>
+
+#define LATENCY_SUB_BITS (4)
+#define LATENCY_MAX_BITS (40) /* ~18 minutes in ns, longer values are clamped */
+#define LATENCY_BUCKETS  ((LATENCY_MAX_BITS - LATENCY_SUB_BITS + 1) << LATENCY_SUB_BITS)
+
+typedef enum {
+    LATENCY_WAKEUP    = 0, /* timer wakeup past its deadline         */
+    LATENCY_POINTERS  = 1, /* WP/OVC/RP (and IS1/IS2) read            */
+    LATENCY_FIFO_READ = 2, /* one FIFO data I2C transaction           */
+    LATENCY_DRAIN     = 3, /* pointers read to batch handed to writer */
+    LATENCY_WRITE     = 4, /* capture file write or wait for it       */
+    LATENCY_STAGES
+}latency_stage;
+
+/* CLOCK_MONOTONIC_RAW, every host timestamp of the program is taken on it */
+uint64_t latency_now_ns(void);
+void latency_record(latency_stage stage, uint64_t ns);
+void latency_report(const char *title);
+
+#endif /* INCLUDE_LATENCY_H_ */
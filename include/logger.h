@@ -0,0 +1,51 @@
+/*
+ * filename: logger.h
+ *
+ * Asynchronous log. Caller only copies format pointer and arguments (strings
+ * by value) into a lock-free ring, logger thread formats them and writes
+ * the debug file, so no file I/O happens on acquisition thread. Levels above
+ * LOG_LEVEL are compiled out, arguments included. They are still type
+ * checked, so no variable becomes unused.
+ */
+
+#ifndef INCLUDE_LOGGER_H_
+#define INCLUDE_LOGGER_H_
+
+#include <stdio.h>
+
+#define LOG_LEVEL_ERROR (0)
+#define LOG_LEVEL_INFO  (1)
+#define LOG_LEVEL_DEBUG (2)
+
+#ifndef LOG_LEVEL
+#define LOG_LEVEL LOG_LEVEL_INFO
+#endif
+
+#define LOG_RING_SLOTS        (256)
+#define LOG_RECORD_ARGS       (12)  /* conversions past it are dropped        */
+#define LOG_RECORD_TEXT       (128) /* %s arguments, longer ones are truncated */
+#define LOG_FLUSH_INTERVAL_MS (50)
+
+int logger_start(FILE *file);
+void logger_stop(void);
+void logger_print(const char *format, ...) __attribute__((format(printf, 1, 2)));
+
+#if LOG_LEVEL >= LOG_LEVEL_ERROR
+#define log_error(...) logger_print(__VA_ARGS__)
+#else
+#define log_error(...) do { if (0) logger_print(__VA_ARGS__); } while (0)
+#endif
+
+#if LOG_LEVEL >= LOG_LEVEL_INFO
+#define log_info(...) logger_print(__VA_ARGS__)
+#else
+#define log_info(...) do { if (0) logger_print(__VA_ARGS__); } while (0)
+#endif
+
+#if LOG_LEVEL >= LOG_LEVEL_DEBUG
+#define log_debug(...) logger_print(__VA_ARGS__)
+#else
+#define log_debug(...) do { if (0) logger_print(__VA_ARGS__); } while (0)
+#endif
+
+#endif /* INCLUDE_LOGGER_H_ */
@@ -10,7 +10,12 @@
 
 #define BYTES_PER_FIFO_READ     (3)
 #define BITS_PER_FIFO_READ      (BYTES_PER_FIFO_READ * 8)
-#define SAMPLES_PER_SINGLE_READ (8)
+#define SAMPLES_PER_SINGLE_READ (8)  /* Smallest batch read from FIFO */
+#define MAX86150_FIFO_DEPTH     (32)
+
+/* A_FULL register field holds free FIFO space left when interrupt fires */
+#define MAX86150_FIFO_A_FULL_MIN (MAX86150_FIFO_DEPTH - MAX86150_BIT_FIFO_A_FULL)
+#define MAX86150_FIFO_A_FULL_MAX (MAX86150_FIFO_DEPTH)
 
 #define MAX86150_DEV_ID (0x5e)
 
@@ -276,6 +281,21 @@ typedef enum {
     ECG_IA_GAIN_50  = 3
 }ecg_ia_gain_enum;
 
+typedef enum {
+    FIFO_READ_PER_SAMPLE = 0, /* one I2C_RDWR ioctl per FIFO sample      */
+    FIFO_READ_BURST      = 1, /* whole batch in a single I2C_RDWR ioctl */
+    FIFO_READ_COMBINED   = 2  /* WP/OVC/RP and batch in one I2C_RDWR    */
+}fifo_read_mode;
+
+typedef enum {
+    EVENT_SOURCE_TIMER = 0, /* blind periodic timer                 */
+    EVENT_SOURCE_GPIO  = 1, /* INT pin edges from GPIO char device  */
+    EVENT_SOURCES_NUM
+}event_source_type;
+
+#define MAX86150_GPIO_CHIP_DEFAULT "/dev/gpiochip0"
+#define MAX86150_GPIO_LINE_DEFAULT (203) /* GPIOG11 */
+
 struct max86150_configuration {
     /* These parameters are entered by user */
     int                       sampling_frequency;
@@ -293,6 +313,32 @@ struct max86150_configuration {
     int                       ecg_adc_clk_osr;
     int                       ecg_pga_gain;
     int                       ecg_ia_gain;
+    fifo_read_mode            fifo_read_mode;
+    event_source_type         event_source;
+    int                       adaptive_poll;       /* timer interval follows FIFO fill */
+    int                       realtime;
+    int                       rt_priority;         /* SCHED_FIFO priority with realtime */
+    int                       rt_cpu;              /* -1 - last online CPU */
+    int                       interrupt_data_ready;
+    char                      gpio_chip_name[MAX_FILENAME_LENGTH];
+    int                       gpio_line;
+    char                      control_path[MAX_FILENAME_LENGTH]; /* empty - no live changes */
+    char                      stats_path[MAX_FILENAME_LENGTH];   /* empty - no run summary */
+    int                       sim_bus_latency_us;   /* simulated device only */
+    int                       sim_bus_error_ppm;
+    double                    sim_clock_ppm;
+    int                       sim_speed;            /* times faster than real time */
+    char                      sim_replay[MAX_FILENAME_LENGTH]; /* empty - synthetic signals */
+    int                       fifo_a_full_samples; /* 0 - derive from rate and channels */
+    int                       fifo_rollover;
+    int                       fifo_read_unit;      /* derived, FIFO is read in multiples of it */
+    int                       ring_slots;
+    capture_backend           capture_backend;
+    uint32_t                  capture_flush_bytes;
+    uint32_t                  capture_flush_latency_ms;
+    uint32_t                  capture_duration_s;
+    uint32_t                  capture_chunk_size;
+    uint32_t                  capture_encoding;
 
     /* These values are writen into registers */
     ppg_adc_rge               ppg_range_reg;
@@ -307,6 +353,9 @@ struct max86150_configuration {
     ecg_adc_clk_adc_osr_enum  ecg_adc_clk_osr_reg;
     ecg_pga_gain_enum         ecg_pga_gain_reg;
     ecg_ia_gain_enum          ecg_ia_gain_reg;
+
+    /* Set by reconfigure_max86150() */
+    uint64_t                  config_changed_ns;   /* CLOCK_MONOTONIC_RAW of live change not in capture yet, 0 - none */
 };
 
 #endif /* __MAX86150_defs__ */
@@ -10,18 +10,52 @@
 
 #define I2C0_BAUD_RATE (210000)
 
+/* Time host may take to react on A_FULL, used to derive FIFO threshold */
+#define FIFO_WAKEUP_LATENCY_US (10000)
+
 #define TOTAL_SIGNALS       (5)
 #define MAX_SIGNALS_ALLOWED (4)
 
-int init_gpio();
+/* Bus cost of a single FIFO drain */
+struct max86150_i2c_stats {
+    uint32_t syscalls;
+    uint32_t bytes;
+};
+
+/* Values of configured registers by address, see image_runs in peripheral.c */
+struct max86150_register_image {
+    uint8_t value[MAX86150_REG_ECG_CFG3 + 1];
+};
+
+/* Settings that may be changed while recording, 0 keeps current value */
+struct max86150_live_settings {
+    int ppg_adc_scale;
+    int ppg_sample_average;
+    int ppg_led1_amplitude;
+    int ppg_led2_amplitude;
+    int ecg_pga_gain;
+    int ecg_ia_gain;
+};
+
+int init_gpio(struct max86150_configuration *max86150);
 void deinit_gpio();
 int init_max86150(struct max86150_configuration *max86150);
+int reconfigure_max86150(struct max86150_configuration *max86150, const struct max86150_live_settings *settings);
 int reset_device();
 int start_recording(struct max86150_configuration *max86150);
+int stop_conversions();
 int stop_recording();
+int enable_max86150_interrupts(struct max86150_configuration *max86150);
 int write_max86150_register(int reg, int data);
 int read_max86150_register(int reg, uint8_t *data, int num);
 int read_max86150_FIFO_multiple(int count, uint8_t *data);
+int read_max86150_FIFO_burst(int samples, int bytes_per_sample, uint8_t *data,
+                             struct max86150_i2c_stats *stats);
+int read_max86150_FIFO_combined(int speculative_samples, int bytes_per_sample,
+                                uint8_t *status, uint8_t *pointers, uint8_t *data, int *valid_samples,
+                                struct max86150_i2c_stats *stats);
+dcr_slot max86150_signal_to_slot(uint16_t sig);
+int max86150_fifo_level(uint8_t write_pointer, uint8_t ovc, uint8_t read_pointer);
 
 
 #endif /* INCLUDE_PERIPHERAL_H_ */
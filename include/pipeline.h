@@ -0,0 +1,40 @@
+/*
+ * filename: pipeline.h
+ *
+ * Channel layout variants for specialized sample pipelines. FIFO slots are
+ * filled in signal bit order (ppg1, ppg2, pilot1, pilot2, ecg), so ECG, the
+ * only 18-bit signed channel, is always the last one and PPG and pilots
+ * share 19-bit unsigned format. Any valid combination of signals is thus
+ * one of 8 variants: 1..4 channels, with or without ECG.
+ *
+ * Stages (unpack, pack, codec) instantiate their kernels for every variant
+ * with channel count and widths as compile-time constants and pick one
+ * through a dispatch table when layout is set up at startup.
+ */
+
+#ifndef INCLUDE_PIPELINE_H_
+#define INCLUDE_PIPELINE_H_
+
+#include <stdint.h>
+#include <peripheral.h>
+
+#define PIPELINE_VARIANTS    (2 * MAX_SIGNALS_ALLOWED)
+#define PIPELINE_VARIANT_ANY (-1) /* not a FIFO layout, generic kernels */
+
+#define PIPELINE_VARIANT(channels, ecg) (((channels) - 1) * 2 + (ecg))
+
+/* X(variant, channels, ecg) for every variant */
+#define PIPELINE_FOR_EACH_VARIANT(X) \
+    X(0, 1, 0) X(1, 1, 1) X(2, 2, 0) X(3, 2, 1) \
+    X(4, 3, 0) X(5, 3, 1) X(6, 4, 0) X(7, 4, 1)
+
+/* Channel c of a variant, as constant expressions for specialized kernels */
+#define PIPELINE_IS_ECG(c, channels, ecg) ((ecg) && ((c) == (channels) - 1))
+#define PIPELINE_BITS(c, channels, ecg)   (PIPELINE_IS_ECG(c, channels, ecg) ? 18 : 19)
+#define PIPELINE_MASK(c, channels, ecg)   ((1u << PIPELINE_BITS(c, channels, ecg)) - 1)
+
+int pipeline_variant(const uint8_t *slots, uint32_t channels);
+int pipeline_variant_of_bits(const uint8_t *bits, uint32_t channels);
+const char *pipeline_variant_name(int variant);
+
+#endif /* INCLUDE_PIPELINE_H_ */
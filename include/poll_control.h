@@ -0,0 +1,39 @@
+/*
+ * filename: poll_control.h
+ *
+ * Timer wakeup interval controller. FIFO level seen on every poll is fed
+ * back, and the interval is stretched until the fill level sits a safety
+ * margin below the limit (FIFO depth, where samples start to be lost).
+ * Every poll must drain the whole FIFO, otherwise leftovers eat into the
+ * margin. Less wakeups mean less I2C transactions and CPU time per second.
+ */
+
+#ifndef INCLUDE_POLL_CONTROL_H_
+#define INCLUDE_POLL_CONTROL_H_
+
+#include <stdint.h>
+#include <max86150_defs.h>
+
+#define POLL_CONTROL_MARGIN_DEVS (4.0) /* margin below limit, in mean deviations of fill */
+
+struct poll_control {
+    double   sample_period_ns;
+    double   period_ns;     /* current wakeup interval */
+    double   min_period_ns; /* one read unit, shorter wakeups find nothing to read */
+    double   max_period_ns;
+    int      limit;         /* fill level not to be reached, FIFO overflows past it */
+    double   level_mean;    /* running mean and mean deviation of fill */
+    double   level_dev;
+    double   level_peak;    /* fill above mean, slowly decaying */
+    uint64_t polls;
+    uint32_t changes;
+    uint32_t limit_hits;
+    uint32_t histogram[MAX86150_FIFO_DEPTH + 1];
+};
+
+void poll_control_init(struct poll_control *pc, uint32_t sampling_frequency, int read_unit, int limit);
+int poll_control_update(struct poll_control *pc, int fifo_level);
+uint64_t poll_control_period_ns(const struct poll_control *pc);
+void poll_control_report(const struct poll_control *pc);
+
+#endif /* INCLUDE_POLL_CONTROL_H_ */
@@ -0,0 +1,22 @@
+/*
+ * filename: realtime.h
+ *
+ * --realtime mode of acquisition thread: SCHED_FIFO priority, pinning to
+ * one CPU and locked memory. Every step is tried on its own, so without
+ * privileges (or RLIMIT_RTPRIO/RLIMIT_MEMLOCK) the mode degrades to what
+ * is allowed rather than failing.
+ */
+
+#ifndef INCLUDE_REALTIME_H_
+#define INCLUDE_REALTIME_H_
+
+#include <stddef.h>
+#include <max86150_defs.h>
+
+#define REALTIME_PRIORITY_DEFAULT (80)
+#define REALTIME_STACK_PREFAULT   (256 * 1024)
+
+int enter_realtime(struct max86150_configuration *max86150);
+void prefault_buffer(void *buf, size_t size);
+
+#endif /* INCLUDE_REALTIME_H_ */
@@ -0,0 +1,57 @@
+/*
+ * filename: ringbuffer.h
+ *
+ * Single producer / single consumer ring of fixed size slots.
+ * Producer never blocks, consumer may sleep until a slot is committed.
+ */
+
+#ifndef INCLUDE_RINGBUFFER_H_
+#define INCLUDE_RINGBUFFER_H_
+
+#include <stdint.h>
+#include <stdatomic.h>
+#include <semaphore.h>
+
+#define CACHE_LINE_SIZE (64)
+
+struct spsc_ring_stats {
+    uint32_t capacity;    /* slots                               */
+    uint32_t high_water;  /* max slots in use seen by producer   */
+    uint32_t full_events; /* reserve() calls failed on full ring */
+    uint64_t committed;   /* slots passed to consumer            */
+};
+
+struct spsc_ring {
+    /* Producer side */
+    _Alignas(CACHE_LINE_SIZE) atomic_uint head;
+    uint32_t high_water;
+    uint32_t full_events;
+    uint64_t committed;
+
+    /* Consumer side */
+    _Alignas(CACHE_LINE_SIZE) atomic_uint tail;
+
+    /* Shared, read only after init */
+    _Alignas(CACHE_LINE_SIZE) uint8_t *slots;
+    uint32_t mask;
+    uint32_t slot_size;
+    atomic_int closed;
+    sem_t items;
+};
+
+int spsc_ring_init(struct spsc_ring *ring, uint32_t slots, uint32_t slot_size);
+void spsc_ring_destroy(struct spsc_ring *ring);
+
+/* Producer */
+void *spsc_ring_reserve(struct spsc_ring *ring);
+void spsc_ring_commit(struct spsc_ring *ring);
+void spsc_ring_close(struct spsc_ring *ring);
+
+/* Consumer */
+void *spsc_ring_wait(struct spsc_ring *ring);
+void *spsc_ring_timedwait(struct spsc_ring *ring, uint32_t timeout_ms, int *timed_out);
+void spsc_ring_release(struct spsc_ring *ring);
+
+void spsc_ring_get_stats(struct spsc_ring *ring, struct spsc_ring_stats *stats);
+
+#endif /* INCLUDE_RINGBUFFER_H_ */
@@ -5,9 +5,38 @@
 #ifndef INCLUDE_SIGNALWORK_H_
 #define INCLUDE_SIGNALWORK_H_
 
-int start_max86150_timer(uint32_t samp_freq);
+#include <stdint.h>
+#include <max86150_defs.h>
+
+/* Return values of fd handlers, -1 is error */
+#define MAX86150_EVENT_NONE (0)
+#define MAX86150_EVENT_POLL (1) /* FIFO should be polled */
+#define MAX86150_EVENT_STOP (2)
+
+typedef int (*max86150_fd_handler)(int fd, uint32_t events, void *arg);
+
+/* Wakeup source of the acquisition loop. start() adds its fds to the loop
+ * with add_max86150_event_fd(), stop() removes them */
+struct max86150_event_source {
+    const char *name;
+    int (*start)(struct max86150_configuration *max86150);
+    int (*stop)(void);
+};
+
+int start_max86150_timer(uint32_t samp_freq, uint32_t samples_per_wakeup);
+int set_max86150_timer_period(uint64_t period_ns);
 int stop_max86150_timer(void);
 int register_term_signal(void);
 int get_sigint_status(void);
+void register_snapshot_handler(void (*handler)(void));
+
+int add_max86150_event_fd(int fd, uint32_t events, max86150_fd_handler handler, void *arg);
+int remove_max86150_event_fd(int fd);
+
+int register_max86150_event_source(event_source_type type, const struct max86150_event_source *source);
+int start_max86150_events(struct max86150_configuration *max86150);
+int wait_max86150_event(void);
+uint64_t get_event_loop_syscalls(void);
+int stop_max86150_events(void);
 
 #endif /* INCLUDE_SIGNALWORK_H_ */
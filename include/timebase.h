@@ -0,0 +1,53 @@
+/*
+ * filename: timebase.h
+ *
+ * Online estimate of MAX86150 sample clock against host CLOCK_MONOTONIC_RAW.
+ * Every FIFO drain gives a point (samples produced so far, host time). They
+ * are fitted with least squares for the first TIMEBASE_FIT_S, which
+ * gives the best estimate the points allow while there are few of them.
+ * After that a second order delay locked loop (as used by JACK for audio
+ * clocks), seeded with the fit, filters out scheduling and I2C jitter and
+ * follows slow oscillator drift. See README for measured accuracy.
+ */
+
+#ifndef INCLUDE_TIMEBASE_H_
+#define INCLUDE_TIMEBASE_H_
+
+#include <stdint.h>
+
+#define TIMEBASE_FIT_S        (60.0)
+#define TIMEBASE_FIT_MAX_PPM  (100.0) /* fitted period is used once its standard error is below */
+#define TIMEBASE_BANDWIDTH_HZ (0.005)
+
+struct timebase {
+    double   nominal_period_ns;
+    double   period_ns;      /* estimated sample period */
+    double   bandwidth_hz;
+    uint64_t base_ns;        /* host time of first update, times below are relative to it */
+    uint64_t base_sample;    /* sample count of first update */
+    uint64_t ref_sample;     /* sample index of ref_ns */
+    double   ref_ns;         /* filtered host time of ref_sample */
+    double   jitter_ns;      /* running RMS of loop error */
+    uint64_t updates;
+    /* Least-squares fit of time against samples since base. A gap or a
+     * step in sample count starts a new run: runs share the slope, each
+     * has own offset. Means are of current run, sums of products of
+     * deviations from them are pooled over all runs */
+    int      fit_gap;        /* next point starts a new run */
+    uint64_t fit_points;
+    uint64_t fit_run_points;
+    uint32_t fit_runs;
+    double   fit_mean_n, fit_mean_t;
+    double   fit_nn, fit_nt, fit_tt;
+};
+
+void timebase_init(struct timebase *tb, uint32_t nominal_hz);
+void timebase_update(struct timebase *tb, uint64_t samples, uint64_t now_ns);
+void timebase_gap(struct timebase *tb);
+uint64_t timebase_sample_ns(const struct timebase *tb, uint64_t sample);
+double timebase_samples_at(const struct timebase *tb, uint64_t now_ns);
+uint64_t timebase_period_fs(const struct timebase *tb);
+double timebase_rate_hz(const struct timebase *tb);
+double timebase_drift_ppm(const struct timebase *tb);
+
+#endif /* INCLUDE_TIMEBASE_H_ */
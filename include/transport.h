@@ -0,0 +1,37 @@
+/*
+ * filename: transport.h
+ *
+ * MAX86150 bus access. A transfer is a list of I2C messages done as one bus
+ * transaction (repeated start between messages), as I2C_RDWR does. Regular
+ * build talks to the sensor on /dev/i2c-0, MAX86150_SIM build to a
+ * simulated device, so the whole program runs on any Linux host.
+ */
+
+#ifndef INCLUDE_TRANSPORT_H_
+#define INCLUDE_TRANSPORT_H_
+
+#include <linux/i2c.h>
+#include <max86150_defs.h>
+
+#define I2C_BUS_NAME "/dev/i2c-0"
+
+struct max86150_transport {
+    const char *name;
+    int (*open)(struct max86150_configuration *max86150);
+    int (*transfer)(struct i2c_msg *msgs, int count); /* 0 or -1 with errno */
+    void (*close)(void);
+};
+
+#ifdef MAX86150_SIM
+extern const struct max86150_transport sim_transport;
+
+/* wiringPi locks, same semantics */
+void piLock(int key);
+void piUnlock(int key);
+#else
+extern const struct max86150_transport i2c_transport;
+
+#include <wiringPi.h>
+#endif
+
+#endif /* INCLUDE_TRANSPORT_H_ */
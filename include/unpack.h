@@ -0,0 +1,46 @@
+/*
+ * filename: unpack.h
+ *
+ * Conversion of raw FIFO bursts (3 bytes per word, MSB first) into int32
+ * values: every word is masked to its channel ADC width and ECG is sign
+ * extended from 18-bit two's complement. SIMD path is picked at init.
+ */
+
+#ifndef INCLUDE_UNPACK_H_
+#define INCLUDE_UNPACK_H_
+
+#include <stdint.h>
+#include <peripheral.h>
+
+/* SIMD loads may read this many bytes past the last FIFO word */
+#define UNPACK_SLACK_BYTES (4)
+
+typedef enum {
+    UNPACK_SCALAR = 0,
+    UNPACK_SSSE3  = 1,
+    UNPACK_AVX2   = 2,
+    UNPACK_NEON   = 3,
+    UNPACK_PATHS_NUM
+}unpack_path;
+
+struct unpack_layout {
+    uint32_t channels;
+    int      variant;  /* see pipeline.h */
+};
+
+int unpack_layout_init(struct unpack_layout *layout, const uint8_t *slots, uint32_t channels);
+
+void unpack_init(void);
+int unpack_path_supported(unpack_path path);
+int unpack_select(unpack_path path);
+unpack_path unpack_selected(void);
+const char *unpack_path_name(unpack_path path);
+
+/* Interleaved output, samples * channels words. Source needs
+ * UNPACK_SLACK_BYTES readable bytes past the burst */
+void unpack_fifo(const uint8_t *src, uint32_t samples, const struct unpack_layout *layout, int32_t *dst);
+/* One output array per channel */
+void unpack_fifo_channels(const uint8_t *src, uint32_t samples, const struct unpack_layout *layout,
+                          int32_t *const *dst);
+
+#endif /* INCLUDE_UNPACK_H_ */
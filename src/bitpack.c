@@ -0,0 +1,261 @@
+/*
+ * filename: bitpack.c
+ *
+ * Samples up to 57 bits (any 3 channels) are packed through a 64-bit
+ * accumulator and unpacked with one unaligned 64-bit load per sample, no
+ * per-bit loop. Wider samples (4 channels) are accumulated and extracted
+ * channel by channel.
+ *
+ * FIFO layouts (see pipeline.h) get their own instances with constant
+ * shifts and masks; 4 channel samples are handled as two 2 channel halves.
+ */
+
+#include <string.h>
+#include <pipeline.h>
+#include <bitpack.h>
+
+#define BITPACK_FAST_SAMPLE_BITS (57)
+
+#define BITPACK_INLINE static inline __attribute__((always_inline))
+
+/* Channels first..last of a variant sample, ECG is last so every channel
+ * before it starts at a multiple of 19 */
+#define BITPACK_GROUP_BITS(first, last, channels, ecg) \
+    (((last) - (first) + 1) * BITPACK_PPG_BITS - (PIPELINE_IS_ECG(last, channels, ecg) ? 1 : 0))
+
+typedef uint64_t (*bitpack_pack_fn)(const uint32_t *src, uint32_t samples, uint8_t *dst, uint64_t bit_pos);
+typedef void (*bitpack_unpack_fn)(const uint8_t *src, uint64_t bit_pos, uint32_t samples, uint32_t *dst);
+
+
+/* Channels first..last of one sample, at most 57 bits */
+BITPACK_INLINE uint64_t bitpack_group(const uint32_t *src, const uint32_t first, const uint32_t last,
+                                      const uint32_t channels, const int ecg) {
+    uint64_t v = 0;
+    uint32_t c;
+
+#pragma GCC unroll 4
+    for (c = first; c <= last; c++) {
+        v |= (uint64_t)(src[c] & PIPELINE_MASK(c, channels, ecg)) << ((c - first) * BITPACK_PPG_BITS);
+    }
+    return v;
+}
+
+BITPACK_INLINE void bitpack_ungroup(uint64_t v, uint32_t *dst, const uint32_t first, const uint32_t last,
+                                    const uint32_t channels, const int ecg) {
+    uint32_t c;
+
+#pragma GCC unroll 4
+    for (c = first; c <= last; c++) {
+        dst[c] = (v >> ((c - first) * BITPACK_PPG_BITS)) & PIPELINE_MASK(c, channels, ecg);
+    }
+}
+
+BITPACK_INLINE uint64_t bitpack_pack_tmpl(const uint32_t *src, uint32_t samples, uint8_t *dst, uint64_t bit_pos,
+                                          const uint32_t channels, const int ecg) {
+    /* 3 channels at most in one accumulator step */
+    const uint32_t split = (channels == 4) ? 2 : channels;
+    const uint32_t lo_bits = BITPACK_GROUP_BITS(0, split - 1, channels, ecg);
+    const uint32_t hi_bits = BITPACK_GROUP_BITS(split, channels - 1, channels, ecg);
+    uint8_t *p    = dst + (bit_pos >> 3);
+    uint32_t fill = bit_pos & 7;
+    uint64_t acc  = *p & ((1u << fill) - 1);
+    uint32_t i;
+
+    for (i = 0; i < samples; i++) {
+        uint64_t v = bitpack_group(src, 0, split - 1, channels, ecg);
+
+        acc  |= v << fill;
+        fill += lo_bits;
+        if (fill >= 64) {
+            bitpack_store64(p, acc);
+            p    += 8;
+            fill -= 64;
+            acc   = v >> (lo_bits - fill);
+        }
+
+        if (split < channels) {
+            v = bitpack_group(src, split, channels - 1, channels, ecg);
+
+            acc  |= v << fill;
+            fill += hi_bits;
+            if (fill >= 64) {
+                bitpack_store64(p, acc);
+                p    += 8;
+                fill -= 64;
+                acc   = v >> (hi_bits - fill);
+            }
+        }
+        src += channels;
+    }
+    bitpack_store64(p, acc);
+
+    return bit_pos + (uint64_t)samples * BITPACK_GROUP_BITS(0, channels - 1, channels, ecg);
+}
+
+BITPACK_INLINE void bitpack_unpack_tmpl(const uint8_t *src, uint64_t bit_pos, uint32_t samples, uint32_t *dst,
+                                        const uint32_t channels, const int ecg) {
+    const uint32_t split = (channels == 4) ? 2 : channels;
+    const uint32_t lo_bits = BITPACK_GROUP_BITS(0, split - 1, channels, ecg);
+    const uint32_t hi_bits = BITPACK_GROUP_BITS(split, channels - 1, channels, ecg);
+    uint32_t i;
+
+    for (i = 0; i < samples; i++) {
+        bitpack_ungroup(bitpack_load64(src + (bit_pos >> 3)) >> (bit_pos & 7), dst, 0, split - 1, channels, ecg);
+        bit_pos += lo_bits;
+
+        if (split < channels) {
+            bitpack_ungroup(bitpack_load64(src + (bit_pos >> 3)) >> (bit_pos & 7), dst, split, channels - 1,
+                            channels, ecg);
+            bit_pos += hi_bits;
+        }
+        dst += channels;
+    }
+}
+
+#define BITPACK_VARIANT(id, channels, ecg) \
+    static uint64_t bitpack_pack_##id(const uint32_t *src, uint32_t samples, uint8_t *dst, uint64_t bit_pos) { \
+        return bitpack_pack_tmpl(src, samples, dst, bit_pos, channels, ecg); \
+    } \
+    static void bitpack_unpack_##id(const uint8_t *src, uint64_t bit_pos, uint32_t samples, uint32_t *dst) { \
+        bitpack_unpack_tmpl(src, bit_pos, samples, dst, channels, ecg); \
+    }
+#define BITPACK_PACK_ENTRY(id, channels, ecg)   bitpack_pack_##id,
+#define BITPACK_UNPACK_ENTRY(id, channels, ecg) bitpack_unpack_##id,
+
+PIPELINE_FOR_EACH_VARIANT(BITPACK_VARIANT)
+static const bitpack_pack_fn pack_variants[PIPELINE_VARIANTS] = {
+    PIPELINE_FOR_EACH_VARIANT(BITPACK_PACK_ENTRY)
+};
+static const bitpack_unpack_fn unpack_variants[PIPELINE_VARIANTS] = {
+    PIPELINE_FOR_EACH_VARIANT(BITPACK_UNPACK_ENTRY)
+};
+
+
+/* Native width of a FIFO slot */
+int bitpack_slot_bits(uint8_t slot) {
+    switch (slot) {
+        case PPG_LED1:
+        case PPG_LED2:
+        case PILOT_LED1:
+        case PILOT_LED2:
+            return BITPACK_PPG_BITS;
+        case ECG:
+            return BITPACK_ECG_BITS;
+        default:
+            return 0;
+    }
+}
+
+int bitpack_layout_init(struct bitpack_layout *layout, const uint8_t *bits, uint32_t channels) {
+    uint32_t i;
+
+    memset(layout, 0, sizeof(*layout));
+    if (!channels || (channels > MAX_SIGNALS_ALLOWED)) return -1;
+
+    for (i = 0; i < channels; i++) {
+        if (!bits[i] || (bits[i] > 32)) return -1;
+        layout->bits[i]  = bits[i];
+        layout->shift[i] = layout->sample_bits;
+        layout->mask[i]  = (bits[i] == 32) ? 0xFFFFFFFF : ((1u << bits[i]) - 1);
+        layout->sample_bits += bits[i];
+    }
+    layout->channels = channels;
+    layout->variant  = pipeline_variant_of_bits(bits, channels);
+
+    return 0;
+}
+
+/* Appends "samples" samples (layout->channels words each) to bitstream at
+ * bit_pos. Bits past bit_pos must be zero. Returns new bit position */
+uint64_t bitpack_pack(const uint32_t *src, uint32_t samples, const struct bitpack_layout *layout,
+                      uint8_t *dst, uint64_t bit_pos) {
+    uint32_t channels    = layout->channels;
+    uint32_t sample_bits = layout->sample_bits;
+    uint8_t *p           = dst + (bit_pos >> 3);
+    uint32_t fill        = bit_pos & 7;
+    uint64_t acc         = *p & ((1u << fill) - 1);
+    uint32_t i;
+    uint32_t c;
+
+    if (layout->variant != PIPELINE_VARIANT_ANY) {
+        return pack_variants[layout->variant](src, samples, dst, bit_pos);
+    }
+
+    /* Bits are collected in a register and stored a word at a time */
+    if (sample_bits <= BITPACK_FAST_SAMPLE_BITS) {
+        for (i = 0; i < samples; i++) {
+            uint64_t v = 0;
+
+            for (c = 0; c < channels; c++) {
+                v |= (uint64_t)(src[c] & layout->mask[c]) << layout->shift[c];
+            }
+            src += channels;
+
+            acc  |= v << fill;
+            fill += sample_bits;
+            if (fill >= 64) {
+                bitpack_store64(p, acc);
+                p    += 8;
+                fill -= 64;
+                acc   = v >> (sample_bits - fill);
+            }
+        }
+    } else {
+        for (i = 0; i < samples; i++) {
+            for (c = 0; c < channels; c++) {
+                uint64_t v = src[c] & layout->mask[c];
+
+                acc  |= v << fill;
+                fill += layout->bits[c];
+                if (fill >= 64) {
+                    bitpack_store64(p, acc);
+                    p    += 8;
+                    fill -= 64;
+                    acc   = v >> (layout->bits[c] - fill);
+                }
+            }
+            src += channels;
+        }
+    }
+    bitpack_store64(p, acc);
+
+    return bit_pos + (uint64_t)samples * sample_bits;
+}
+
+/* Reverse of bitpack_pack(). Source needs BITPACK_SLACK_BYTES readable
+ * bytes past the last sample */
+void bitpack_unpack(const uint8_t *src, uint64_t bit_pos, uint32_t samples,
+                    const struct bitpack_layout *layout, uint32_t *dst) {
+    uint32_t channels = layout->channels;
+    uint32_t i;
+    uint32_t c;
+
+    if (layout->variant != PIPELINE_VARIANT_ANY) {
+        unpack_variants[layout->variant](src, bit_pos, samples, dst);
+        return;
+    }
+
+    if (layout->sample_bits <= BITPACK_FAST_SAMPLE_BITS) {
+        for (i = 0; i < samples; i++) {
+            uint64_t v = bitpack_load64(src + (bit_pos >> 3)) >> (bit_pos & 7);
+
+            for (c = 0; c < channels; c++) {
+                dst[c] = (v >> layout->shift[c]) & layout->mask[c];
+            }
+
+            dst     += channels;
+            bit_pos += layout->sample_bits;
+        }
+        return;
+    }
+
+    for (i = 0; i < samples; i++) {
+        for (c = 0; c < channels; c++) {
+            dst[c] = (bitpack_load64(src + (bit_pos >> 3)) >> (bit_pos & 7)) & layout->mask[c];
+            bit_pos += layout->bits[c];
+        }
+        dst += channels;
+    }
+}
+
+
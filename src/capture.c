@@ -0,0 +1,404 @@
+/*
+ * filename: capture.c
+ *
+ * Capture writer thread. It takes FIFO batches out of SPSC ring and passes
+ * them to batched capture writer, so slow storage never stalls FIFO draining.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <time.h>
+#include <math.h>
+#include <filework.h>
+#include <capture.h>
+#include <capture_format.h>
+#include <timebase.h>
+#include <latency.h>
+
+static void *capture_writer_thread(void *arg);
+static int capture_put_batch(struct capture_batch *batch);
+static int capture_put_samples(struct capture_batch *batch, uint32_t from, uint32_t to, uint64_t now);
+static uint32_t capture_config_split(struct capture_batch *batch);
+static int capture_emit_chunk(uint32_t flags);
+static int capture_emit_gap(struct capture_batch *batch);
+static int capture_emit_config(const struct capture_config_record *config);
+static int capture_emit_trailer(void);
+
+static pthread_t writer_thread;
+static int writer_started;
+static uint32_t flush_latency_ms;
+static atomic_int writer_failed;
+static struct capture_chunker chunker;
+static struct timebase timebase;
+static uint64_t sample_offset;   /* lost samples found on sample clock only */
+static uint64_t gaps_total;
+static uint64_t lost_total;
+static uint64_t lost_estimated;
+static uint32_t stop_signal;
+static uint64_t stop_ns;
+static struct capture_writer_stats writer_stats;
+
+
+/* FIFO slots are filled in signal bit order, see init_max86150().
+ * Returns number of channels */
+uint32_t capture_channel_slots(uint8_t allowed_signals, uint8_t *slots) {
+    uint32_t channels = 0;
+    int i;
+
+    for (i = 0; i < TOTAL_SIGNALS; i++) {
+        if (allowed_signals & (1 << i)) {
+            if (channels >= MAX_SIGNALS_ALLOWED) break;
+            slots[channels++] = max86150_signal_to_slot(1 << i);
+        }
+    }
+    return channels;
+}
+
+void capture_fill_header(struct capture_file_header *header, struct max86150_configuration *max86150,
+                         uint32_t chunk_size) {
+    struct timespec ts;
+    uint32_t i;
+
+    memset(header, 0, sizeof(*header));
+    memcpy(header->magic, CAPTURE_MAGIC, sizeof(header->magic));
+    header->version         = CAPTURE_VERSION;
+    header->header_size     = sizeof(*header);
+    header->chunk_size      = chunk_size;
+    header->encoding        = max86150->capture_encoding;
+    header->allowed_signals = max86150->allowed_signals;
+    header->channels        = capture_channel_slots(max86150->allowed_signals, header->slots);
+
+    if (header->encoding != CAPTURE_ENCODING_U32) {
+        for (i = 0; i < header->channels; i++) {
+            header->bits[i] = bitpack_slot_bits(header->slots[i]);
+        }
+    }
+    header->fifo_a_full_samples = max86150->fifo_a_full_samples;
+    header->fifo_rollover       = max86150->fifo_rollover;
+
+    header->sampling_frequency = max86150->sampling_frequency;
+    header->ppg_sampling_freq  = max86150->ppg_sampling_freq;
+    header->ecg_sampling_freq  = max86150->ecg_sampling_freq;
+    header->ppg_adc_scale      = max86150->ppg_adc_scale;
+    header->ppg_led_pw         = max86150->ppg_led_pw;
+    header->ppg_pulses         = max86150->ppg_pulses_reg;
+    header->ppg_sample_average = max86150->ppg_sample_average;
+    header->ppg_led1_amplitude = max86150->ppg_led1_amplitude;
+    header->ppg_led2_amplitude = max86150->ppg_led2_amplitude;
+    header->ecg_adc_clk_osr    = max86150->ecg_adc_clk_osr;
+    header->ecg_pga_gain       = max86150->ecg_pga_gain;
+    header->ecg_ia_gain        = max86150->ecg_ia_gain;
+
+    header->ppg_range_reg            = max86150->ppg_range_reg;
+    header->ppg_sampling_reg         = max86150->ppg_sampling_reg;
+    header->ppg_width_reg            = max86150->ppg_width_reg;
+    header->ppg_smp_avg_reg          = max86150->ppg_smp_avg_reg;
+    header->ppg_led1_amplitude_reg   = max86150->ppg_led1_amplitude_reg;
+    header->ppg_led2_amplitude_reg   = max86150->ppg_led2_amplitude_reg;
+    header->ppg_led1_amplitude_range = max86150->ppg_led1_amplitude_range;
+    header->ppg_led2_amplitude_range = max86150->ppg_led2_amplitude_range;
+    header->ecg_adc_clk_osr_reg      = max86150->ecg_adc_clk_osr_reg;
+    header->ecg_pga_gain_reg         = max86150->ecg_pga_gain_reg;
+    header->ecg_ia_gain_reg          = max86150->ecg_ia_gain_reg;
+
+    clock_gettime(CLOCK_REALTIME, &ts);
+    header->start_realtime_ns  = (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+    header->start_monotonic_ns = latency_now_ns();
+
+    header->crc32 = capture_crc32(0, header, sizeof(*header));
+}
+
+/* Live settings after reconfigure_max86150(), for a config record */
+void capture_fill_config(struct capture_config_record *config, const struct max86150_configuration *max86150) {
+    memset(config, 0, sizeof(*config));
+    config->change_ns          = max86150->config_changed_ns;
+    config->ppg_adc_scale      = max86150->ppg_adc_scale;
+    config->ppg_sample_average = max86150->ppg_sample_average;
+    config->ppg_led1_amplitude = max86150->ppg_led1_amplitude;
+    config->ppg_led2_amplitude = max86150->ppg_led2_amplitude;
+    config->ecg_pga_gain       = max86150->ecg_pga_gain;
+    config->ecg_ia_gain        = max86150->ecg_ia_gain;
+
+    config->ppg_range_reg            = max86150->ppg_range_reg;
+    config->ppg_smp_avg_reg          = max86150->ppg_smp_avg_reg;
+    config->ppg_led1_amplitude_reg   = max86150->ppg_led1_amplitude_reg;
+    config->ppg_led2_amplitude_reg   = max86150->ppg_led2_amplitude_reg;
+    config->ppg_led1_amplitude_range = max86150->ppg_led1_amplitude_range;
+    config->ppg_led2_amplitude_range = max86150->ppg_led2_amplitude_range;
+    config->ecg_pga_gain_reg         = max86150->ecg_pga_gain_reg;
+    config->ecg_ia_gain_reg          = max86150->ecg_ia_gain_reg;
+}
+
+int start_capture_writer(int fd, struct spsc_ring *ring, struct max86150_configuration *max86150) {
+    sigset_t all_signals;
+    sigset_t old_signals;
+    uint8_t slots[MAX_SIGNALS_ALLOWED];
+    uint32_t channels;
+    uint32_t samples_per_chunk;
+    uint64_t reserve_bytes;
+    int ret;
+
+    channels = capture_channel_slots(max86150->allowed_signals, slots);
+    if (capture_chunker_init(&chunker, max86150->capture_chunk_size, max86150->capture_encoding,
+                             slots, channels)) {
+        return -1;
+    }
+
+    /* Expected size of the whole recording, for preallocated capture file.
+     * Compressed chunks hold varying number of samples, packed size is taken
+     * as upper estimate */
+    samples_per_chunk = chunker.capacity;
+    if (max86150->capture_encoding == CAPTURE_ENCODING_RICE) {
+        samples_per_chunk = chunker.limit_bits / chunker.layout.sample_bits;
+    }
+    reserve_bytes = (uint64_t)max86150->capture_duration_s * max86150->sampling_frequency /
+                    samples_per_chunk * chunker.chunk_size + chunker.chunk_size;
+
+    if (capture_writer_open(fd, max86150->capture_backend,
+                            max86150->capture_flush_bytes, max86150->capture_flush_latency_ms,
+                            reserve_bytes)) {
+        log_error("%s: cannot open capture writer\n", __func__);
+        capture_chunker_free(&chunker);
+        return -1;
+    }
+    flush_latency_ms = max86150->capture_flush_latency_ms;
+    atomic_store(&writer_failed, 0);
+    timebase_init(&timebase, max86150->sampling_frequency);
+    sample_offset  = 0;
+    gaps_total     = 0;
+    lost_total     = 0;
+    lost_estimated = 0;
+    stop_signal    = 0;
+    stop_ns        = 0;
+
+    /* Timer and SIGINT must reach acquisition loop only, so writer is
+     * started with every signal blocked */
+    sigfillset(&all_signals);
+    pthread_sigmask(SIG_BLOCK, &all_signals, &old_signals);
+    ret = pthread_create(&writer_thread, NULL, capture_writer_thread, ring);
+    pthread_sigmask(SIG_SETMASK, &old_signals, NULL);
+
+    if (ret) {
+        log_error("%s: cannot create writer thread - %s\n", __func__, strerror(ret));
+        capture_chunker_free(&chunker);
+        capture_writer_close(NULL);
+        return -1;
+    }
+    writer_started = 1;
+
+    return 0;
+}
+
+/* Goes to trailer record. Must be called before ring is closed, closing
+ * publishes it to writer */
+void capture_set_stop(uint32_t signal, uint64_t stop_monotonic_ns) {
+    stop_signal = signal;
+    stop_ns     = stop_monotonic_ns;
+}
+
+/* Ring must be closed by producer before, so writer drains it and exits */
+int stop_capture_writer() {
+    if (!writer_started) return 0;
+
+    pthread_join(writer_thread, NULL);
+    writer_started = 0;
+
+    if (capture_writer_close(&writer_stats)) atomic_store(&writer_failed, 1);
+    capture_chunker_free(&chunker);
+
+    if (timebase.updates > 1) {
+        log_info("%s: sensor sample rate %.3f Hz (%+.1f ppm from nominal), drain timestamp jitter %.0f us\n",
+                 __func__, timebase_rate_hz(&timebase), timebase_drift_ppm(&timebase), timebase.jitter_ns / 1000);
+    }
+    if (gaps_total) {
+        log_info("%s: %llu gaps, %llu of %llu samples lost (%.3f%%), %llu of them estimated from sample clock\n",
+                 __func__, (unsigned long long)gaps_total, (unsigned long long)lost_total,
+                 (unsigned long long)chunker.next_sample, lost_total * 100.0 / chunker.next_sample,
+                 (unsigned long long)lost_estimated);
+    }
+
+    return atomic_load(&writer_failed) ? -1 : 0;
+}
+
+int capture_writer_failed() {
+    return atomic_load_explicit(&writer_failed, memory_order_relaxed);
+}
+
+/* Valid after stop_capture_writer() */
+void capture_get_writer_stats(struct capture_writer_stats *stats) {
+    *stats = writer_stats;
+}
+
+
+static void *capture_writer_thread(void *arg) {
+    struct spsc_ring *ring = arg;
+    struct capture_batch *batch;
+    int timed_out;
+
+    while (1) {
+        batch = spsc_ring_timedwait(ring, flush_latency_ms, &timed_out);
+        if (!batch && !timed_out) break;
+
+        if (batch) {
+            if (!atomic_load_explicit(&writer_failed, memory_order_relaxed)) {
+                if (capture_put_batch(batch)) atomic_store(&writer_failed, 1);
+            }
+            spsc_ring_release(ring);
+        }
+
+        if (atomic_load_explicit(&writer_failed, memory_order_relaxed)) continue;
+
+        /* Half filled chunk is closed early rather than held past latency */
+        if (chunker.opened_ns &&
+            ((latency_now_ns() - chunker.opened_ns) >= (uint64_t)flush_latency_ms * 1000000)) {
+            if (capture_emit_chunk(0)) atomic_store(&writer_failed, 1);
+        }
+        if (capture_writer_flush_due()) atomic_store(&writer_failed, 1);
+    }
+
+    /* Trailer is the last chunk, so readers know recording was not cut */
+    if (!atomic_load_explicit(&writer_failed, memory_order_relaxed)) {
+        if (capture_emit_chunk(0) || capture_emit_trailer()) atomic_store(&writer_failed, 1);
+    }
+
+    return NULL;
+}
+
+static int capture_put_batch(struct capture_batch *batch) {
+    uint32_t split = 0;
+    uint64_t now = latency_now_ns();
+
+    if (batch->lost && capture_emit_gap(batch)) return -1;
+    batch->first_sample += sample_offset;
+
+    /* Samples lost after overflowed drain are not counted yet */
+    if (!(batch->flags & CAPTURE_BATCH_OVERFLOW)) {
+        timebase_update(&timebase, batch->first_sample + batch->fifo_level, batch->timestamp_ns);
+    }
+    capture_chunker_set_clock(&chunker, batch->first_sample, timebase_sample_ns(&timebase, batch->first_sample),
+                              timebase_period_fs(&timebase));
+
+    if (batch->first_sample != chunker.next_sample) {
+        log_error("%s: sample %llu expected, got %llu\n", __func__,
+                  (unsigned long long)chunker.next_sample, (unsigned long long)batch->first_sample);
+        if (capture_emit_chunk(0)) return -1;
+        chunker.next_sample = batch->first_sample;
+    }
+
+    if (batch->flags & CAPTURE_BATCH_CONFIG) {
+        split = capture_config_split(batch);
+        if (capture_put_samples(batch, 0, split, now) || capture_emit_config(&batch->config)) return -1;
+    }
+
+    return capture_put_samples(batch, split, batch->samples, now);
+}
+
+static int capture_put_samples(struct capture_batch *batch, uint32_t from, uint32_t to, uint64_t now) {
+    uint32_t sample_words = batch->words / batch->samples;
+    uint32_t done = from;
+
+    while (done < to) {
+        done += capture_chunker_put(&chunker, &batch->data[done * sample_words],
+                                    to - done, batch->timestamp_ns, now);
+        if (capture_chunker_full(&chunker)) {
+            if (capture_emit_chunk(0)) return -1;
+        }
+    }
+
+    return 0;
+}
+
+/* Samples of the batch taken before settings changed. Once sample clock
+ * is known it tells, otherwise change is put at first sample drained after
+ * it, though samples waiting in FIFO then were taken with old settings */
+static uint32_t capture_config_split(struct capture_batch *batch) {
+    double first_new;
+
+    if (timebase.updates <= 1) return 0;
+
+    batch->config.flags |= CAPTURE_CONFIG_ESTIMATED;
+    first_new = ceil(timebase_samples_at(&timebase, batch->config.change_ns)) - (double)batch->first_sample;
+    if (first_new <= 0) return 0;
+    if (first_new >= batch->samples) return batch->samples;
+    return (uint32_t)first_new;
+}
+
+static int capture_emit_chunk(uint32_t flags) {
+    const void *chunk;
+
+    if (!chunker.opened_ns && !flags) return 0;
+
+    chunk = capture_chunker_seal(&chunker, flags);
+    return capture_writer_append(chunk, chunker.chunk_size);
+}
+
+/* A chunk holds only contiguous samples, so the one being filled is closed
+ * and gap record follows. OVF_COUNTER saturates at 31, longer loss is
+ * taken from sample clock: samples produced by drain time less known ones */
+static int capture_emit_gap(struct capture_batch *batch) {
+    uint64_t lost  = batch->lost;
+    uint32_t flags = batch->lost_flags;
+    const void *chunk;
+
+    if ((flags & CAPTURE_GAP_AT_LEAST) && (timebase.updates > 1)) {
+        double missing = timebase_samples_at(&timebase, batch->timestamp_ns) -
+                         (double)(batch->first_sample + sample_offset + batch->fifo_level);
+
+        if (missing >= 1) {
+            uint64_t extra = (uint64_t)llround(missing);
+
+            sample_offset  += extra;
+            lost           += extra;
+            lost_estimated += extra;
+            flags |= CAPTURE_GAP_ESTIMATED;
+        }
+    }
+
+    /* Count may still be short: OVF_COUNTER is cleared by every sample
+     * read, so samples dropped between pointers and data read are lost
+     * without being counted. Sample clock fit starts over from here */
+    timebase_gap(&timebase);
+
+    if (capture_emit_chunk(0)) return -1;
+    chunker.next_sample = batch->first_sample + sample_offset - lost;
+
+    gaps_total++;
+    lost_total += lost;
+
+    chunk = capture_chunker_gap(&chunker, lost, flags);
+    return capture_writer_append(chunk, chunker.chunk_size);
+}
+
+/* Like gap record, it starts a new chunk */
+static int capture_emit_config(const struct capture_config_record *config) {
+    const void *chunk;
+
+    if (capture_emit_chunk(0)) return -1;
+
+    chunk = capture_chunker_config(&chunker, config);
+    return capture_writer_append(chunk, chunker.chunk_size);
+}
+
+static int capture_emit_trailer() {
+    struct capture_trailer_record trailer = {0};
+    struct timespec real;
+    uint64_t raw_ns;
+
+    clock_gettime(CLOCK_REALTIME, &real);
+    raw_ns = latency_now_ns();
+    if (!stop_ns || (stop_ns > raw_ns)) stop_ns = raw_ns;
+
+    trailer.samples           = chunker.next_sample;
+    trailer.lost_samples      = lost_total;
+    trailer.gaps              = gaps_total;
+    trailer.stop_realtime_ns  = (uint64_t)real.tv_sec * 1000000000 + real.tv_nsec - (raw_ns - stop_ns);
+    trailer.stop_monotonic_ns = stop_ns;
+    trailer.sample_period_fs  = (timebase.updates > 1) ? timebase_period_fs(&timebase) : 0;
+    trailer.stop_signal       = stop_signal;
+
+    return capture_writer_append(capture_chunker_trailer(&chunker, &trailer), chunker.chunk_size);
+}
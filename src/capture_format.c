@@ -0,0 +1,285 @@
+/*
+ * filename: capture_format.c
+ *
+ * Self describing capture file: header with full device configuration and
+ * fixed size chunks protected by CRC32.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <filework.h>
+#include <capture_format.h>
+
+_Static_assert(sizeof(struct capture_file_header) == 144, "capture file header layout changed");
+_Static_assert(sizeof(struct capture_chunk_header) == 56, "capture chunk header layout changed");
+_Static_assert(sizeof(struct capture_config_record) == 48, "capture config record layout changed");
+
+static uint32_t crc32_table[256];
+static int crc32_table_ready;
+
+static void crc32_init_table(void);
+static void chunker_reopen(struct capture_chunker *chunker);
+static const void *chunker_seal_record(struct capture_chunker *chunker, const void *record, uint32_t size,
+                                       uint32_t flags);
+
+
+/* CRC-32 (IEEE 802.3), same as zlib crc32(). Start with crc = 0 */
+uint32_t capture_crc32(uint32_t crc, const void *data, size_t len) {
+    const uint8_t *p = data;
+
+    if (!crc32_table_ready) crc32_init_table();
+
+    crc = ~crc;
+    while (len--) {
+        crc = crc32_table[(crc ^ *p++) & 0xff] ^ (crc >> 8);
+    }
+    return ~crc;
+}
+
+int capture_check_header(const struct capture_file_header *header) {
+    struct capture_file_header copy;
+
+    if (memcmp(header->magic, CAPTURE_MAGIC, sizeof(header->magic))) return -1;
+    if (header->version != CAPTURE_VERSION) return -1;
+    if (header->header_size != sizeof(*header)) return -1;
+    if (header->chunk_size < CAPTURE_CHUNK_SIZE_MIN) return -1;
+    if (!header->channels || (header->channels > MAX_SIGNALS_ALLOWED)) return -1;
+    if (header->encoding > CAPTURE_ENCODING_RICE) return -1;
+
+    copy = *header;
+    copy.crc32 = 0;
+    return (capture_crc32(0, &copy, sizeof(copy)) == header->crc32) ? 0 : -1;
+}
+
+
+int capture_chunker_init(struct capture_chunker *chunker, uint32_t chunk_size, uint32_t encoding,
+                         const uint8_t *slots, uint32_t channels) {
+    uint8_t bits[MAX_SIGNALS_ALLOWED];
+    uint32_t i;
+
+    memset(chunker, 0, sizeof(*chunker));
+
+    if (chunk_size < CAPTURE_CHUNK_SIZE_MIN) {
+        log_error("%s: chunk of %u bytes is too small\n", __func__, chunk_size);
+        return -1;
+    }
+    if (!channels || (channels > MAX_SIGNALS_ALLOWED)) {
+        log_error("%s: invalid number of channels %u\n", __func__, channels);
+        return -1;
+    }
+
+    if ((encoding == CAPTURE_ENCODING_PACKED) || (encoding == CAPTURE_ENCODING_RICE)) {
+        for (i = 0; i < channels; i++) bits[i] = bitpack_slot_bits(slots[i]);
+        if (bitpack_layout_init(&chunker->layout, bits, channels)) {
+            log_error("%s: cannot pack %u channels\n", __func__, channels);
+            return -1;
+        }
+        /* Packer touches whole 64-bit words, so chunk tail is kept free for it */
+        chunker->limit_bits = (chunk_size - sizeof(struct capture_chunk_header) - BITPACK_SLACK_BYTES) * 8;
+        chunker->capacity   = chunker->limit_bits / chunker->layout.sample_bits;
+    } else {
+        chunker->sample_bytes = channels * sizeof(uint32_t);
+        chunker->capacity     = (chunk_size - sizeof(struct capture_chunk_header)) / chunker->sample_bytes;
+    }
+
+    if (encoding == CAPTURE_ENCODING_RICE) {
+        if (codec_init(&chunker->codec, slots, channels)) {
+            log_error("%s: cannot compress %u channels\n", __func__, channels);
+            return -1;
+        }
+        /* Every channel takes at least one bit */
+        chunker->capacity = chunker->limit_bits / channels;
+    }
+
+    chunker->buf = calloc(1, chunk_size);
+    if (!chunker->buf) {
+        log_error("%s: cannot allocate %u bytes chunk\n", __func__, chunk_size);
+        return -1;
+    }
+    chunker->chunk_size = chunk_size;
+    chunker->encoding   = encoding;
+
+    return 0;
+}
+
+void capture_chunker_free(struct capture_chunker *chunker) {
+    free(chunker->buf);
+    chunker->buf = NULL;
+}
+
+/* Copies as many of "count" samples as current chunk can take.
+ * Returns number of samples taken */
+uint32_t capture_chunker_put(struct capture_chunker *chunker, const void *samples, uint32_t count,
+                             uint64_t timestamp_ns, uint64_t now_ns) {
+    struct capture_chunk_header *header = (struct capture_chunk_header *)chunker->buf;
+    uint32_t space;
+
+    chunker_reopen(chunker);
+
+    space = chunker->capacity - header->sample_count;
+    if (count > space) count = space;
+    if (!count) return 0;
+
+    if (!header->sample_count) {
+        header->first_sample = chunker->next_sample;
+        header->timestamp_ns = timestamp_ns;
+        chunker->opened_ns   = now_ns;
+        if (chunker->encoding == CAPTURE_ENCODING_RICE) codec_reset(&chunker->codec);
+    }
+
+    if (chunker->encoding == CAPTURE_ENCODING_RICE) {
+        const uint32_t *words = samples;
+        uint32_t taken = 0;
+
+        /* Compressed size is unknown ahead, so only samples that fit even
+         * in worst case are encoded at once */
+        while (taken < count) {
+            uint32_t fit = (chunker->limit_bits - chunker->bit_pos) / chunker->codec.max_sample_bits;
+
+            if (!fit) break;
+            if (fit > count - taken) fit = count - taken;
+            chunker->bit_pos = codec_encode(&chunker->codec, &words[taken * chunker->layout.channels], fit,
+                                            chunker->buf + sizeof(*header), chunker->bit_pos);
+            taken += fit;
+        }
+        count = taken;
+        header->payload_bytes = (chunker->bit_pos + 7) / 8;
+    } else if (chunker->encoding == CAPTURE_ENCODING_PACKED) {
+        chunker->bit_pos = bitpack_pack(samples, count, &chunker->layout,
+                                        chunker->buf + sizeof(*header), chunker->bit_pos);
+        header->payload_bytes = (chunker->bit_pos + 7) / 8;
+    } else {
+        memcpy(chunker->buf + sizeof(*header) + header->payload_bytes, samples, count * chunker->sample_bytes);
+        header->payload_bytes += count * chunker->sample_bytes;
+    }
+    header->sample_count += count;
+    chunker->next_sample += count;
+
+    return count;
+}
+
+int capture_chunker_full(struct capture_chunker *chunker) {
+    if ((chunker->encoding == CAPTURE_ENCODING_RICE) &&
+        (chunker->bit_pos + chunker->codec.max_sample_bits > chunker->limit_bits)) {
+        return 1;
+    }
+    return ((struct capture_chunk_header *)chunker->buf)->sample_count == chunker->capacity;
+}
+
+/* Sample "sample" was taken at sample_ns, following ones every period_fs.
+ * Reference must be within about 2 hours of chunk samples */
+void capture_chunker_set_clock(struct capture_chunker *chunker, uint64_t sample, uint64_t sample_ns,
+                               uint64_t period_fs) {
+    chunker->clock_sample    = sample;
+    chunker->clock_ns        = sample_ns;
+    chunker->clock_period_fs = period_fs;
+}
+
+/* Finalizes current chunk and returns it (chunk_size bytes). The buffer is
+ * reused by next put, so it must be written out before that */
+const void *capture_chunker_seal(struct capture_chunker *chunker, uint32_t flags) {
+    struct capture_chunk_header *header = (struct capture_chunk_header *)chunker->buf;
+    uint32_t used;
+
+    chunker_reopen(chunker);
+    if (!header->sample_count) header->first_sample = chunker->next_sample;
+    used = sizeof(*header) + header->payload_bytes;
+
+    if (chunker->clock_period_fs) {
+        int64_t offset = (int64_t)(header->first_sample - chunker->clock_sample);
+
+        header->sample_time_ns   = chunker->clock_ns + offset * (int64_t)chunker->clock_period_fs / 1000000;
+        header->sample_period_fs = chunker->clock_period_fs;
+    }
+
+    header->magic    = CAPTURE_CHUNK_MAGIC;
+    header->sequence = chunker->sequence++;
+    header->flags    = flags;
+    header->crc32    = 0;
+    memset(chunker->buf + used, 0, chunker->chunk_size - used);
+    header->crc32    = capture_crc32(0, chunker->buf, used);
+
+    chunker->opened_ns = 0;
+
+    return chunker->buf;
+}
+
+/* Gap record for "lost" samples starting at next_sample. Chunk being filled
+ * must be sealed before. Returned chunk is reused like in seal */
+const void *capture_chunker_gap(struct capture_chunker *chunker, uint64_t lost, uint32_t flags) {
+    struct capture_gap_record record = {0};
+    const void *chunk;
+
+    record.lost_samples = lost;
+    record.flags        = flags;
+    chunk = chunker_seal_record(chunker, &record, sizeof(record), CAPTURE_CHUNK_FLAG_GAP);
+    chunker->next_sample += lost;
+
+    return chunk;
+}
+
+/* Settings in effect from next_sample on, chunk being filled must be
+ * sealed before */
+const void *capture_chunker_config(struct capture_chunker *chunker, const struct capture_config_record *config) {
+    return chunker_seal_record(chunker, config, sizeof(*config), CAPTURE_CHUNK_FLAG_CONFIG);
+}
+
+/* Last chunk of recording, chunk being filled must be sealed before */
+const void *capture_chunker_trailer(struct capture_chunker *chunker, const struct capture_trailer_record *trailer) {
+    return chunker_seal_record(chunker, trailer, sizeof(*trailer),
+                               CAPTURE_CHUNK_FLAG_TRAILER | CAPTURE_CHUNK_FLAG_LAST);
+}
+
+/* Readers side: 0 if chunk is intact */
+int capture_check_chunk(const void *chunk, uint32_t chunk_size) {
+    struct capture_chunk_header header;
+    uint32_t crc;
+
+    memcpy(&header, chunk, sizeof(header));
+    if (header.magic != CAPTURE_CHUNK_MAGIC) return -1;
+    if (header.payload_bytes > chunk_size - sizeof(header)) return -1;
+
+    header.crc32 = 0;
+    crc = capture_crc32(0, &header, sizeof(header));
+    crc = capture_crc32(crc, (const uint8_t *)chunk + sizeof(header), header.payload_bytes);
+
+    return (crc == ((const struct capture_chunk_header *)chunk)->crc32) ? 0 : -1;
+}
+
+
+/* Chunk that was sealed is already written out, so it is started over.
+ * Packer ORs bits in, so old payload is cleared too */
+static void chunker_reopen(struct capture_chunker *chunker) {
+    struct capture_chunk_header *header = (struct capture_chunk_header *)chunker->buf;
+
+    if (header->magic == CAPTURE_CHUNK_MAGIC) {
+        memset(chunker->buf, 0, sizeof(*header) + header->payload_bytes);
+        chunker->bit_pos = 0;
+    }
+}
+
+/* Chunk without samples, payload is a record */
+static const void *chunker_seal_record(struct capture_chunker *chunker, const void *record, uint32_t size,
+                                       uint32_t flags) {
+    struct capture_chunk_header *header = (struct capture_chunk_header *)chunker->buf;
+
+    chunker_reopen(chunker);
+    memcpy(chunker->buf + sizeof(*header), record, size);
+    header->payload_bytes = size;
+
+    return capture_chunker_seal(chunker, flags);
+}
+
+static void crc32_init_table() {
+    uint32_t i;
+    int j;
+
+    for (i = 0; i < 256; i++) {
+        uint32_t c = i;
+        for (j = 0; j < 8; j++) {
+            c = (c & 1) ? (0xEDB88320 ^ (c >> 1)) : (c >> 1);
+        }
+        crc32_table[i] = c;
+    }
+    crc32_table_ready = 1;
+}
@@ -0,0 +1,239 @@
+/*
+ * filename: codec.c
+ *
+ * Encoder keeps bits in a 64-bit accumulator, decoder takes one unaligned
+ * 64-bit load per channel value. Both are branch light integer code, cheap
+ * enough for Cortex-A7 at highest sampling rates. Both are instantiated
+ * for every FIFO layout (see pipeline.h).
+ */
+
+#include <string.h>
+#include <pipeline.h>
+#include <codec.h>
+
+#define CODEC_INLINE static inline __attribute__((always_inline))
+
+#define CODEC_MASK(codec, c, channels, ecg, generic) \
+    ((generic) ? (codec)->mask[c] : PIPELINE_MASK(c, channels, ecg))
+#define CODEC_SIGN_SHIFT(codec, c, channels, ecg, generic) \
+    ((generic) ? (codec)->sign_shift[c] : (PIPELINE_IS_ECG(c, channels, ecg) ? 32 - BITPACK_ECG_BITS : 0))
+
+typedef uint64_t (*codec_encode_fn)(struct codec_state *codec, const uint32_t *src, uint32_t samples,
+                                    uint8_t *dst, uint64_t bit_pos);
+typedef uint64_t (*codec_decode_fn)(struct codec_state *codec, const uint8_t *src, uint64_t bit_pos,
+                                    uint32_t samples, uint32_t *dst);
+
+static inline int32_t codec_value(uint32_t mask, uint32_t shift, uint32_t word);
+static inline int32_t codec_predict(uint32_t history, const struct codec_channel *ch);
+static inline uint32_t codec_k(const struct codec_channel *ch);
+static inline void codec_update(struct codec_channel *ch, int32_t x, uint32_t u);
+
+
+/* Channel state is kept in locals for the whole call, so it stays in
+ * registers. Generic instance takes masks from codec state, variant ones
+ * have them as constants */
+CODEC_INLINE uint64_t codec_encode_tmpl(struct codec_state *codec, const uint32_t *src, uint32_t samples,
+                                        uint8_t *dst, uint64_t bit_pos,
+                                        const uint32_t channels, const int ecg, const int generic) {
+    struct codec_channel st[MAX_SIGNALS_ALLOWED];
+    uint32_t history = codec->history;
+    uint8_t *p    = dst + (bit_pos >> 3);
+    uint32_t fill = bit_pos & 7;
+    uint64_t acc  = *p & ((1u << fill) - 1);
+    uint8_t *start = p;
+    uint32_t start_fill = fill;
+    uint32_t i;
+    uint32_t c;
+
+    if (channels > MAX_SIGNALS_ALLOWED) return bit_pos; /* rejected by codec_init(), bounds st[] */
+    memcpy(st, codec->ch, sizeof(st));
+
+    for (i = 0; i < samples; i++) {
+#pragma GCC unroll 4
+        for (c = 0; c < channels; c++) {
+            struct codec_channel *ch = &st[c];
+            int32_t x = codec_value(CODEC_MASK(codec, c, channels, ecg, generic),
+                                    CODEC_SIGN_SHIFT(codec, c, channels, ecg, generic), src[c]);
+            int32_t e = x - codec_predict(history, ch);
+            uint32_t u = ((uint32_t)e << 1) ^ (uint32_t)(e >> 31);
+            uint32_t k = codec_k(ch);
+            uint32_t q = u >> k;
+            uint64_t v;
+            uint32_t n;
+
+            if (q < CODEC_ESCAPE_Q) {
+                v = ((uint64_t)(u & ((1u << k) - 1)) << (q + 1)) | (1ull << q);
+                n = q + 1 + k;
+            } else {
+                v = ((uint64_t)u << (CODEC_ESCAPE_Q + 1)) | (1ull << CODEC_ESCAPE_Q);
+                n = CODEC_MAX_CHANNEL_BITS;
+            }
+
+            acc  |= v << fill;
+            fill += n;
+            if (fill >= 64) {
+                bitpack_store64(p, acc);
+                p    += 8;
+                fill -= 64;
+                acc   = v >> (n - fill);
+            }
+
+            codec_update(ch, x, u);
+        }
+        if (history < 2) history++;
+        src += channels;
+    }
+    bitpack_store64(p, acc);
+
+    memcpy(codec->ch, st, sizeof(st));
+    codec->history = history;
+
+    return bit_pos + (uint64_t)(p - start) * 8 + fill - start_fill;
+}
+
+CODEC_INLINE uint64_t codec_decode_tmpl(struct codec_state *codec, const uint8_t *src, uint64_t bit_pos,
+                                        uint32_t samples, uint32_t *dst,
+                                        const uint32_t channels, const int ecg, const int generic) {
+    struct codec_channel st[MAX_SIGNALS_ALLOWED];
+    uint32_t history = codec->history;
+    uint32_t i;
+    uint32_t c;
+
+    if (channels > MAX_SIGNALS_ALLOWED) return bit_pos; /* rejected by codec_init(), bounds st[] */
+    memcpy(st, codec->ch, sizeof(st));
+
+    for (i = 0; i < samples; i++) {
+#pragma GCC unroll 4
+        for (c = 0; c < channels; c++) {
+            struct codec_channel *ch = &st[c];
+            uint64_t v = bitpack_load64(src + (bit_pos >> 3)) >> (bit_pos & 7);
+            uint32_t q = __builtin_ctzll(v | (1ull << CODEC_ESCAPE_Q));
+            uint32_t u;
+            int32_t x;
+
+            if (q < CODEC_ESCAPE_Q) {
+                uint32_t k = codec_k(ch);
+
+                u = (q << k) | ((v >> (q + 1)) & ((1u << k) - 1));
+                bit_pos += q + 1 + k;
+            } else {
+                u = (v >> (CODEC_ESCAPE_Q + 1)) & ((1u << CODEC_RAW_BITS) - 1);
+                bit_pos += CODEC_MAX_CHANNEL_BITS;
+            }
+
+            x = codec_predict(history, ch) + (int32_t)((u >> 1) ^ -(u & 1));
+            dst[c] = (uint32_t)x & CODEC_MASK(codec, c, channels, ecg, generic);
+
+            codec_update(ch, x, u);
+        }
+        if (history < 2) history++;
+        dst += channels;
+    }
+
+    memcpy(codec->ch, st, sizeof(st));
+    codec->history = history;
+
+    return bit_pos;
+}
+
+#define CODEC_VARIANT(id, channels, ecg) \
+    static uint64_t codec_encode_##id(struct codec_state *codec, const uint32_t *src, uint32_t samples, \
+                                      uint8_t *dst, uint64_t bit_pos) { \
+        return codec_encode_tmpl(codec, src, samples, dst, bit_pos, channels, ecg, 0); \
+    } \
+    static uint64_t codec_decode_##id(struct codec_state *codec, const uint8_t *src, uint64_t bit_pos, \
+                                      uint32_t samples, uint32_t *dst) { \
+        return codec_decode_tmpl(codec, src, bit_pos, samples, dst, channels, ecg, 0); \
+    }
+#define CODEC_ENCODE_ENTRY(id, channels, ecg) codec_encode_##id,
+#define CODEC_DECODE_ENTRY(id, channels, ecg) codec_decode_##id,
+
+PIPELINE_FOR_EACH_VARIANT(CODEC_VARIANT)
+static const codec_encode_fn encode_variants[PIPELINE_VARIANTS] = {
+    PIPELINE_FOR_EACH_VARIANT(CODEC_ENCODE_ENTRY)
+};
+static const codec_decode_fn decode_variants[PIPELINE_VARIANTS] = {
+    PIPELINE_FOR_EACH_VARIANT(CODEC_DECODE_ENTRY)
+};
+
+
+int codec_init(struct codec_state *codec, const uint8_t *slots, uint32_t channels) {
+    uint32_t i;
+
+    memset(codec, 0, sizeof(*codec));
+    if (!channels || (channels > MAX_SIGNALS_ALLOWED)) return -1;
+
+    for (i = 0; i < channels; i++) {
+        int bits = bitpack_slot_bits(slots[i]);
+
+        if (!bits) return -1;
+        codec->mask[i]       = (1u << bits) - 1;
+        codec->sign_shift[i] = (slots[i] == ECG) ? 32 - bits : 0;
+    }
+    codec->channels        = channels;
+    codec->variant         = pipeline_variant(slots, channels);
+    codec->max_sample_bits = channels * CODEC_MAX_CHANNEL_BITS;
+
+    return 0;
+}
+
+void codec_reset(struct codec_state *codec) {
+    memset(codec->ch, 0, sizeof(codec->ch));
+    codec->history = 0;
+}
+
+/* Appends "samples" samples to bitstream at bit_pos. Bits past bit_pos must
+ * be zero and dst needs BITPACK_SLACK_BYTES past the end. Returns new bit
+ * position */
+uint64_t codec_encode(struct codec_state *codec, const uint32_t *src, uint32_t samples,
+                      uint8_t *dst, uint64_t bit_pos) {
+    if (codec->variant != PIPELINE_VARIANT_ANY) {
+        return encode_variants[codec->variant](codec, src, samples, dst, bit_pos);
+    }
+    return codec_encode_tmpl(codec, src, samples, dst, bit_pos, codec->channels, 0, 1);
+}
+
+/* Reverse of codec_encode(), values come out masked to channel width.
+ * Source needs BITPACK_SLACK_BYTES readable bytes past the end. Returns
+ * bit position after the last sample */
+uint64_t codec_decode(struct codec_state *codec, const uint8_t *src, uint64_t bit_pos,
+                      uint32_t samples, uint32_t *dst) {
+    if (codec->variant != PIPELINE_VARIANT_ANY) {
+        return decode_variants[codec->variant](codec, src, bit_pos, samples, dst);
+    }
+    return codec_decode_tmpl(codec, src, bit_pos, samples, dst, codec->channels, 0, 1);
+}
+
+/* ECG is 18-bit two's complement, so it is sign extended to keep residuals
+ * small around zero crossing */
+static inline int32_t codec_value(uint32_t mask, uint32_t shift, uint32_t word) {
+    word &= mask;
+    return shift ? (int32_t)(word << shift) >> shift : (int32_t)word;
+}
+
+/* Order 0, 1 and 2 fixed predictors while history builds up after reset */
+static inline int32_t codec_predict(uint32_t history, const struct codec_channel *ch) {
+    switch (history) {
+        case 0:
+            return 0;
+        case 1:
+            return ch->x1;
+        default:
+            return 2 * ch->x1 - ch->x2;
+    }
+}
+
+static inline uint32_t codec_k(const struct codec_channel *ch) {
+    uint32_t m = ch->mean >> CODEC_MEAN_SHIFT;
+    uint32_t k;
+
+    if (!m) return 0;
+    k = 31 - __builtin_clz(m);
+    return (k > CODEC_MAX_K) ? CODEC_MAX_K : k;
+}
+
+static inline void codec_update(struct codec_channel *ch, int32_t x, uint32_t u) {
+    ch->x2 = ch->x1;
+    ch->x1 = x;
+    ch->mean += u - (ch->mean >> CODEC_MEAN_SHIFT);
+}
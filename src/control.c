@@ -0,0 +1,147 @@
+/*
+ * filename: control.c
+ *
+ * Pipe is opened read-write, so it always has a writer and epoll does not
+ * report hangup every time a client closes its end.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/stat.h>
+#include <filework.h>
+#include <peripheral.h>
+#include <signalwork.h>
+#include <control.h>
+
+#define UNUSED(x) ((void)x)
+
+struct control_setting {
+    const char *name;
+    size_t offset; /* in struct max86150_live_settings */
+};
+
+static const struct control_setting control_settings[] = {
+    { "set-ppg-range",             offsetof(struct max86150_live_settings, ppg_adc_scale)      },
+    { "set-ppg-smp-ave",           offsetof(struct max86150_live_settings, ppg_sample_average) },
+    { "set-led1-pulse-amplitude",  offsetof(struct max86150_live_settings, ppg_led1_amplitude) },
+    { "set-led2-pulse-amplitude",  offsetof(struct max86150_live_settings, ppg_led2_amplitude) },
+    { "set-ecg-pga-gain",          offsetof(struct max86150_live_settings, ecg_pga_gain)       },
+    { "set-ecg-ia-gain",           offsetof(struct max86150_live_settings, ecg_ia_gain)        },
+};
+
+static int control_event(int fd, uint32_t events, void *arg);
+static void control_apply(char *line, struct max86150_configuration *max86150);
+
+static int control_fd = -1;
+static char control_line[CONTROL_LINE_MAX];
+static size_t control_used;
+
+
+int open_max86150_control(struct max86150_configuration *max86150) {
+    if ((mkfifo(max86150->control_path, 0660) < 0) && (errno != EEXIST)) {
+        log_error("%s: cannot create %s - %s\n", __func__, max86150->control_path, strerror(errno));
+        return -1;
+    }
+
+    control_fd = open(max86150->control_path, O_RDWR | O_NONBLOCK | O_CLOEXEC);
+    if (control_fd < 0) {
+        log_error("%s: cannot open %s - %s\n", __func__, max86150->control_path, strerror(errno));
+        return -1;
+    }
+    control_used = 0;
+
+    if (add_max86150_event_fd(control_fd, EPOLLIN, control_event, max86150)) {
+        close(control_fd);
+        control_fd = -1;
+        return -1;
+    }
+    log_info("%s: listening on %s\n", __func__, max86150->control_path);
+
+    return 0;
+}
+
+void close_max86150_control() {
+    if (control_fd < 0) return;
+
+    remove_max86150_event_fd(control_fd);
+    close(control_fd);
+    control_fd = -1;
+}
+
+
+/* Runs in acquisition loop, i.e. between FIFO drains */
+static int control_event(int fd, uint32_t events, void *arg) {
+    ssize_t len;
+    char *line, *end;
+
+    UNUSED(events);
+
+    len = read(fd, control_line + control_used, sizeof(control_line) - 1 - control_used);
+    if (len < 0) {
+        if (errno == EAGAIN) return MAX86150_EVENT_NONE;
+        log_error("%s: cannot read control pipe - %s\n", __func__, strerror(errno));
+        return -1;
+    }
+    control_used += len;
+    control_line[control_used] = '\0';
+
+    line = control_line;
+    while ((end = strchr(line, '\n'))) {
+        *end = '\0';
+        control_apply(line, arg);
+        line = end + 1;
+    }
+
+    control_used -= line - control_line;
+    memmove(control_line, line, control_used);
+    if (control_used == sizeof(control_line) - 1) {
+        log_error("%s: control line too long, dropped\n", __func__);
+        control_used = 0;
+    }
+
+    return MAX86150_EVENT_NONE;
+}
+
+static void control_apply(char *line, struct max86150_configuration *max86150) {
+    struct max86150_live_settings settings = {0};
+    char *save = NULL;
+    char *name, *value, *end;
+    long number;
+    size_t i;
+
+    if (!line[strspn(line, " \t")]) return;
+
+    for (name = strtok_r(line, " \t", &save); name; name = strtok_r(NULL, " \t", &save)) {
+        value = strtok_r(NULL, " \t", &save);
+        if (!value) {
+            log_error("%s: %s needs a value\n", __func__, name);
+            return;
+        }
+        for (i = 0; i < sizeof(control_settings) / sizeof(control_settings[0]); i++) {
+            if (!strcmp(name, control_settings[i].name)) break;
+        }
+        if (i == sizeof(control_settings) / sizeof(control_settings[0])) {
+            log_error("%s: %s cannot be changed while recording\n", __func__, name);
+            return;
+        }
+        /* 0 in settings means "keep", so it is no value to set */
+        errno = 0;
+        number = strtol(value, &end, 0);
+        if ((end == value) || *end || errno || (number <= 0) || (number > INT_MAX)) {
+            log_error("%s: %s is no valid value of %s\n", __func__, value, name);
+            return;
+        }
+        *(int *)((char *)&settings + control_settings[i].offset) = (int)number;
+    }
+
+    if (reconfigure_max86150(max86150, &settings)) {
+        log_error("%s: change rejected, configuration kept\n", __func__);
+    }
+}
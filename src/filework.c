@@ -2,17 +2,103 @@
  * filename: filework.c
  */
 
+#define _GNU_SOURCE /* fallocate() */
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
-#include <stdarg.h>
+#include <string.h>
+#include <errno.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/mman.h>
 #include <fcntl.h>
 #include <unistd.h>
 #include <filework.h>
+#include <latency.h>
 
-static int binary_capture;
+#if defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#define HAVE_IO_URING
+#endif
+#endif
+
+#ifdef HAVE_IO_URING
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#endif
+
+/* Capture data is gathered in two aligned chunks: one is being filled while
+ * the other one is flushed */
+#define CAPTURE_CHUNKS    (2)
+#define CAPTURE_ALIGNMENT (4096)
+
+struct capture_chunk {
+    uint8_t     *data;
+    uint32_t     used;
+    int          in_flight;
+    struct iovec iov;      /* must stay valid until io_uring completion */
+};
+
+#ifdef HAVE_IO_URING
+struct capture_uring {
+    int                  fd;
+    void                *sq_ptr;
+    size_t               sq_size;
+    void                *cq_ptr;
+    size_t               cq_size;
+    struct io_uring_sqe *sqes;
+    size_t               sqes_size;
+    unsigned            *sq_tail;
+    unsigned            *sq_mask;
+    unsigned            *sq_array;
+    unsigned            *cq_head;
+    unsigned            *cq_tail;
+    unsigned            *cq_mask;
+    struct io_uring_cqe *cqes;
+};
+#endif
+
+static struct {
+    int                         fd;
+    capture_backend             backend;
+    uint32_t                    chunk_size;
+    uint64_t                    latency_ns;
+    uint64_t                    oldest_ns;  /* arrival of oldest unflushed byte, 0 - nothing pending */
+    off_t                       offset;
+    int                         current;
+    struct capture_chunk        chunks[CAPTURE_CHUNKS];
+    struct capture_writer_stats stats;
+#ifdef HAVE_IO_URING
+    struct capture_uring        uring;
+#endif
+    /* mmap backend */
+    uint8_t                    *window;
+    off_t                       window_offset;
+    off_t                       reserved;    /* file size allocated so far */
+    uint64_t                    reserve_step;
+} writer = {
+    .fd    = -1,
+#ifdef HAVE_IO_URING
+    .uring = { .fd = -1 },
+#endif
+};
+
+static int capture_chunk_submit(int index);
+static int capture_chunk_wait(int index);
+static int capture_mmap_open(uint64_t reserve_bytes);
+static int capture_mmap_append(const uint8_t *src, uint32_t bytes);
+static int capture_mmap_reserve(off_t end);
+static void capture_mmap_close(void);
+#ifdef HAVE_IO_URING
+static int uring_setup(struct capture_uring *uring, unsigned entries);
+static void uring_teardown(struct capture_uring *uring);
+static int uring_submit_writev(struct capture_uring *uring, struct iovec *iov, off_t offset, uint64_t user_data);
+static int uring_reap(struct capture_uring *uring, int wait);
+#endif
+
+static int binary_capture = -1;
+static off_t binary_capture_size = -1; /* real data size of preallocated file */
 static FILE *debug_file;
 
 int open_capture_file(char *name) {
@@ -25,33 +111,463 @@ int open_capture_file(char *name) {
 }
 
 int close_capture_file() {
-    return (binary_capture != -1) ? close(binary_capture) : -1;
+    int retval;
+
+    if (binary_capture == -1) return -1;
+
+    /* Drop preallocated tail that was never written */
+    if (binary_capture_size >= 0) {
+        if (ftruncate(binary_capture, binary_capture_size)) {
+            log_error("%s: cannot truncate capture file to %lld - %s\n",
+                      __func__, (long long)binary_capture_size, strerror(errno));
+        }
+        binary_capture_size = -1;
+    }
+
+    /* Recording is complete only once it is on storage */
+    retval = fsync(binary_capture);
+    if (retval) {
+        log_error("%s: cannot sync capture file - %s\n", __func__, strerror(errno));
+    }
+
+    if (close(binary_capture)) retval = -1;
+    binary_capture = -1;
+    return retval;
 }
 
 void init_debug() {
     debug_file = fopen(DEBUG_FNAME, "a");
     if (!debug_file) {
         printf("%s: Cannot open debug file\n", __func__);
+        return;
     }
+    logger_start(debug_file);
 }
 
 void close_debug() {
     if (debug_file) {
-        d_print("############################################\n");
+        log_info("############################################\n");
+        logger_stop();
         fclose(debug_file);
     }
 }
 
-void d_print(const char *__format, ...) {
-    va_list list;
-    va_start(list, __format);
-    if (debug_file) {
-        vfprintf(debug_file, __format, list);
-        fflush(debug_file);
-    } else {
-        printf("%s: debug file is not opened, console output: ", __func__);
-        vprintf(__format, list);
+
+/* Batched capture writer. Data is copied into large aligned chunks, which
+ * are written out only when full or when flush latency has passed. */
+int capture_writer_open(int fd, capture_backend backend, uint32_t flush_bytes, uint32_t flush_latency_ms,
+                        uint64_t reserve_bytes) {
+    int i;
+
+    memset(&writer.stats, 0, sizeof(writer.stats));
+#ifdef HAVE_IO_URING
+    writer.uring.fd   = -1; /* every return below ends in capture_writer_close() */
+#endif
+    writer.fd         = fd;
+    writer.chunk_size = (flush_bytes + CAPTURE_ALIGNMENT - 1) & ~(CAPTURE_ALIGNMENT - 1);
+    writer.latency_ns = (uint64_t)flush_latency_ms * 1000000;
+    writer.oldest_ns  = 0;
+    writer.current    = 0;
+
+    if (!writer.chunk_size) {
+        log_error("%s: flush size cannot be zero\n", __func__);
+        return -1;
+    }
+
+    /* Data goes after whatever was written with plain write() before */
+    writer.offset = lseek(fd, 0, SEEK_CUR);
+    if (writer.offset < 0) {
+        log_error("%s: lseek failed - %s\n", __func__, strerror(errno));
+        return -1;
+    }
+
+    if (backend == CAPTURE_BACKEND_MMAP) {
+        writer.backend = CAPTURE_BACKEND_MMAP;
+        return capture_mmap_open(reserve_bytes);
+    }
+
+    for (i = 0; i < CAPTURE_CHUNKS; i++) {
+        void *mem;
+
+        if (posix_memalign(&mem, CAPTURE_ALIGNMENT, writer.chunk_size)) {
+            log_error("%s: cannot allocate %u bytes chunk\n", __func__, writer.chunk_size);
+            capture_writer_close(NULL);
+            return -1;
+        }
+        memset(mem, 0, writer.chunk_size);
+        writer.chunks[i].data      = mem;
+        writer.chunks[i].used      = 0;
+        writer.chunks[i].in_flight = 0;
+    }
+
+    writer.backend = CAPTURE_BACKEND_WRITEV;
+#ifdef HAVE_IO_URING
+    if (backend != CAPTURE_BACKEND_WRITEV) {
+        if (uring_setup(&writer.uring, CAPTURE_CHUNKS) == 0) {
+            writer.backend = CAPTURE_BACKEND_IO_URING;
+        }
+    }
+#endif
+    if ((backend == CAPTURE_BACKEND_IO_URING) && (writer.backend != CAPTURE_BACKEND_IO_URING)) {
+        log_error("%s: io_uring is not available\n", __func__);
+        capture_writer_close(NULL);
+        return -1;
+    }
+
+    log_info("%s: %s backend, %u bytes per flush, flush latency %u ms\n", __func__,
+             (writer.backend == CAPTURE_BACKEND_IO_URING) ? "io_uring" : "writev",
+             writer.chunk_size, flush_latency_ms);
+
+    return 0;
+}
+
+int capture_writer_append(const void *data, uint32_t bytes) {
+    const uint8_t *src = data;
+
+    if (writer.backend == CAPTURE_BACKEND_MMAP) return capture_mmap_append(src, bytes);
+
+    while (bytes) {
+        struct capture_chunk *chunk = &writer.chunks[writer.current];
+        uint32_t space;
+
+        if (chunk->in_flight) {
+            if (capture_chunk_wait(writer.current)) return -1;
+        }
+
+        space = writer.chunk_size - chunk->used;
+        if (space > bytes) space = bytes;
+
+        memcpy(chunk->data + chunk->used, src, space);
+        chunk->used += space;
+        src         += space;
+        bytes       -= space;
+
+        if (!writer.oldest_ns) writer.oldest_ns = latency_now_ns();
+
+        if (chunk->used == writer.chunk_size) {
+            if (capture_writer_flush()) return -1;
+        }
+    }
+
+    return 0;
+}
+
+/* Flushes partially filled chunk if its data waited longer than allowed */
+int capture_writer_flush_due() {
+    /* Data copied into mapping is already in page cache */
+    if (writer.backend == CAPTURE_BACKEND_MMAP) return 0;
+    if (!writer.oldest_ns) return 0;
+    if ((latency_now_ns() - writer.oldest_ns) < writer.latency_ns) return 0;
+
+    return capture_writer_flush();
+}
+
+/* Hands current chunk to the backend and switches to the other one.
+ * With io_uring it returns before data reaches the file */
+int capture_writer_flush() {
+    if (writer.backend == CAPTURE_BACKEND_MMAP) return 0;
+    if (!writer.chunks[writer.current].used) return 0;
+
+    if (capture_chunk_submit(writer.current)) return -1;
+
+    writer.current   = (writer.current + 1) % CAPTURE_CHUNKS;
+    writer.oldest_ns = 0;
+
+    return 0;
+}
+
+int capture_writer_close(struct capture_writer_stats *stats) {
+    int retval = 0;
+    int i;
+
+    if (writer.fd != -1) {
+        if (capture_writer_flush()) retval = -1;
+    }
+
+    for (i = 0; i < CAPTURE_CHUNKS; i++) {
+        if (writer.chunks[i].in_flight && capture_chunk_wait(i)) retval = -1;
+        free(writer.chunks[i].data);
+        writer.chunks[i].data = NULL;
+    }
+
+#ifdef HAVE_IO_URING
+    uring_teardown(&writer.uring);
+#endif
+    capture_mmap_close();
+
+    if (writer.fd != -1) {
+        log_info("%s: %llu bytes in %u flushes, %u syscalls, %u waits for flush\n", __func__,
+                 (unsigned long long)writer.stats.bytes, writer.stats.flushes,
+                 writer.stats.syscalls, writer.stats.waits);
+    }
+    if (stats) *stats = writer.stats;
+    writer.fd = -1;
+
+    return retval;
+}
+
+static int capture_chunk_submit(int index) {
+    struct capture_chunk *chunk = &writer.chunks[index];
+    ssize_t bytes_written;
+    uint64_t start_ns;
+
+    chunk->iov.iov_base = chunk->data;
+    chunk->iov.iov_len  = chunk->used;
+    writer.stats.flushes++;
+    writer.stats.syscalls++;
+
+#ifdef HAVE_IO_URING
+    if (writer.backend == CAPTURE_BACKEND_IO_URING) {
+        if (uring_submit_writev(&writer.uring, &chunk->iov, writer.offset, index)) return -1;
+        chunk->in_flight = 1;
+        writer.offset += chunk->used;
+        return 0;
+    }
+#endif
+
+    start_ns = latency_now_ns();
+    bytes_written = pwritev(writer.fd, &chunk->iov, 1, writer.offset);
+    latency_record(LATENCY_WRITE, latency_now_ns() - start_ns);
+    if (bytes_written != (ssize_t)chunk->used) {
+        log_error("%s: binary write failed, bytes written %zd, fd = %d\n",
+                  __func__, bytes_written, writer.fd);
+        log_error("%s: errno = %d(%s)\n", __func__, errno, strerror(errno));
+        return -1;
+    }
+    writer.offset      += chunk->used;
+    writer.stats.bytes += chunk->used;
+    chunk->used = 0;
+
+    return 0;
+}
+
+static int capture_chunk_wait(int index) {
+#ifdef HAVE_IO_URING
+    uint64_t start_ns;
+    int ret;
+
+    /* Completions already posted cost no syscall */
+    while (writer.chunks[index].in_flight) {
+        ret = uring_reap(&writer.uring, 0);
+        if (ret < 0) return -1;
+        if (ret == 0) continue;
+
+        writer.stats.waits++;
+        start_ns = latency_now_ns();
+        if (uring_reap(&writer.uring, 1)) return -1;
+        latency_record(LATENCY_WRITE, latency_now_ns() - start_ns);
+    }
+#else
+    (void)index;
+#endif
+    return 0;
+}
+
+
+/* mmap backend: file is allocated ahead with fallocate(), so appending
+ * never changes file size or block map, and data is just copied into a
+ * window mapped over the current end of data */
+static int capture_mmap_open(uint64_t reserve_bytes) {
+    long page = sysconf(_SC_PAGESIZE);
+
+    writer.window        = NULL;
+    writer.window_offset = 0;
+    writer.reserved      = writer.offset;
+    writer.reserve_step  = (reserve_bytes + page - 1) & ~((uint64_t)page - 1);
+    if (writer.reserve_step < CAPTURE_MMAP_WINDOW) writer.reserve_step = CAPTURE_MMAP_WINDOW;
+
+    if (capture_mmap_reserve(writer.offset + writer.reserve_step)) return -1;
+
+    binary_capture_size = writer.offset;
+    log_info("%s: mmap backend, %llu bytes preallocated, %u bytes window\n", __func__,
+             (unsigned long long)writer.reserved, CAPTURE_MMAP_WINDOW);
+
+    return 0;
+}
+
+static int capture_mmap_append(const uint8_t *src, uint32_t bytes) {
+    while (bytes) {
+        off_t    window_end = writer.window_offset + CAPTURE_MMAP_WINDOW;
+        uint32_t space;
+
+        if (!writer.window || (writer.offset >= window_end)) {
+            if (writer.window) munmap(writer.window, CAPTURE_MMAP_WINDOW);
+            writer.window = NULL;
+
+            writer.window_offset = writer.offset & ~((off_t)CAPTURE_MMAP_WINDOW - 1);
+            window_end = writer.window_offset + CAPTURE_MMAP_WINDOW;
+            if (window_end > writer.reserved) {
+                if (capture_mmap_reserve(writer.reserved + writer.reserve_step)) return -1;
+            }
+
+            writer.window = mmap(NULL, CAPTURE_MMAP_WINDOW, PROT_READ | PROT_WRITE,
+                                 MAP_SHARED, writer.fd, writer.window_offset);
+            if (writer.window == MAP_FAILED) {
+                log_error("%s: cannot map capture file at %lld - %s\n",
+                          __func__, (long long)writer.window_offset, strerror(errno));
+                writer.window = NULL;
+                return -1;
+            }
+            writer.stats.syscalls++;
+            writer.stats.flushes++;
+        }
+
+        space = window_end - writer.offset;
+        if (space > bytes) space = bytes;
+
+        memcpy(writer.window + (writer.offset - writer.window_offset), src, space);
+        writer.offset      += space;
+        writer.stats.bytes += space;
+        src   += space;
+        bytes -= space;
+    }
+
+    binary_capture_size = writer.offset;
+
+    return 0;
+}
+
+/* Grows allocated file size up to "end", rounded to whole windows */
+static int capture_mmap_reserve(off_t end) {
+    end = (end + CAPTURE_MMAP_WINDOW - 1) & ~((off_t)CAPTURE_MMAP_WINDOW - 1);
+    if (end <= writer.reserved) return 0;
+
+    writer.stats.syscalls++;
+    if (fallocate(writer.fd, 0, writer.reserved, end - writer.reserved)) {
+        if (errno != EOPNOTSUPP) {
+            log_error("%s: cannot preallocate capture file - %s\n", __func__, strerror(errno));
+            return -1;
+        }
+        /* Filesystem cannot preallocate, sparse file still can be mapped */
+        log_error("%s: fallocate failed - %s, extending file instead\n", __func__, strerror(errno));
+        if (ftruncate(writer.fd, end)) {
+            log_error("%s: cannot extend capture file - %s\n", __func__, strerror(errno));
+            return -1;
+        }
+    }
+    writer.reserved = end;
+
+    return 0;
+}
+
+static void capture_mmap_close() {
+    if (writer.window) {
+        munmap(writer.window, CAPTURE_MMAP_WINDOW);
+        writer.window = NULL;
+    }
+}
+
+
+#ifdef HAVE_IO_URING
+static int uring_setup(struct capture_uring *uring, unsigned entries) {
+    struct io_uring_params params;
+    uint8_t *sq;
+    uint8_t *cq;
+
+    memset(&params, 0, sizeof(params));
+    uring->fd = syscall(__NR_io_uring_setup, entries, &params);
+    if (uring->fd < 0) {
+        log_error("%s: io_uring_setup failed - %s\n", __func__, strerror(errno));
+        uring->fd = -1;
+        return -1;
+    }
+
+    uring->sq_size   = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    uring->cq_size   = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    uring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+
+    uring->sq_ptr = mmap(NULL, uring->sq_size, PROT_READ | PROT_WRITE,
+                         MAP_SHARED | MAP_POPULATE, uring->fd, IORING_OFF_SQ_RING);
+    uring->cq_ptr = mmap(NULL, uring->cq_size, PROT_READ | PROT_WRITE,
+                         MAP_SHARED | MAP_POPULATE, uring->fd, IORING_OFF_CQ_RING);
+    uring->sqes   = mmap(NULL, uring->sqes_size, PROT_READ | PROT_WRITE,
+                         MAP_SHARED | MAP_POPULATE, uring->fd, IORING_OFF_SQES);
+    if ((uring->sq_ptr == MAP_FAILED) || (uring->cq_ptr == MAP_FAILED) || (uring->sqes == MAP_FAILED)) {
+        log_error("%s: cannot map io_uring - %s\n", __func__, strerror(errno));
+        uring_teardown(uring);
+        return -1;
+    }
+
+    sq = uring->sq_ptr;
+    cq = uring->cq_ptr;
+    uring->sq_tail  = (unsigned *)(sq + params.sq_off.tail);
+    uring->sq_mask  = (unsigned *)(sq + params.sq_off.ring_mask);
+    uring->sq_array = (unsigned *)(sq + params.sq_off.array);
+    uring->cq_head  = (unsigned *)(cq + params.cq_off.head);
+    uring->cq_tail  = (unsigned *)(cq + params.cq_off.tail);
+    uring->cq_mask  = (unsigned *)(cq + params.cq_off.ring_mask);
+    uring->cqes     = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+
+    return 0;
+}
+
+static void uring_teardown(struct capture_uring *uring) {
+    if (uring->fd < 0) return;
+
+    if (uring->sq_ptr && (uring->sq_ptr != MAP_FAILED)) munmap(uring->sq_ptr, uring->sq_size);
+    if (uring->cq_ptr && (uring->cq_ptr != MAP_FAILED)) munmap(uring->cq_ptr, uring->cq_size);
+    if (uring->sqes && ((void *)uring->sqes != MAP_FAILED)) munmap(uring->sqes, uring->sqes_size);
+    close(uring->fd);
+    memset(uring, 0, sizeof(*uring));
+    uring->fd = -1;
+}
+
+static int uring_submit_writev(struct capture_uring *uring, struct iovec *iov, off_t offset, uint64_t user_data) {
+    unsigned tail = *uring->sq_tail;
+    unsigned index = tail & *uring->sq_mask;
+    struct io_uring_sqe *sqe = &uring->sqes[index];
+
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode    = IORING_OP_WRITEV;
+    sqe->fd        = writer.fd;
+    sqe->addr      = (uint64_t)(uintptr_t)iov;
+    sqe->len       = 1;
+    sqe->off       = offset;
+    sqe->user_data = user_data;
+    uring->sq_array[index] = index;
+
+    __atomic_store_n(uring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+
+    if (syscall(__NR_io_uring_enter, uring->fd, 1, 0, 0, NULL, 0) != 1) {
+        log_error("%s: io_uring_enter failed - %s\n", __func__, strerror(errno));
+        return -1;
+    }
+
+    return 0;
+}
+
+/* Takes one completion and marks its chunk free. Without wait it returns
+ * 1 if nothing has completed yet */
+static int uring_reap(struct capture_uring *uring, int wait) {
+    unsigned head = *uring->cq_head;
+    struct io_uring_cqe *cqe;
+    struct capture_chunk *chunk;
+    int32_t result;
+
+    while (head == __atomic_load_n(uring->cq_tail, __ATOMIC_ACQUIRE)) {
+        if (!wait) return 1;
+        writer.stats.syscalls++;
+        if (syscall(__NR_io_uring_enter, uring->fd, 0, 1, IORING_ENTER_GETEVENTS, NULL, 0) < 0) {
+            if (errno == EINTR) continue;
+            log_error("%s: io_uring_enter failed - %s\n", __func__, strerror(errno));
+            return -1;
+        }
+    }
+
+    cqe    = &uring->cqes[head & *uring->cq_mask];
+    chunk  = &writer.chunks[cqe->user_data];
+    result = cqe->res;
+    __atomic_store_n(uring->cq_head, head + 1, __ATOMIC_RELEASE);
+
+    chunk->in_flight = 0;
+    if (result != (int32_t)chunk->used) {
+        log_error("%s: binary write failed, result %d of %u bytes\n", __func__, result, chunk->used);
+        chunk->used = 0;
+        return -1;
     }
-    va_end(list);
+    writer.stats.bytes += chunk->used;
+    chunk->used = 0;
 
+    return 0;
 }
+#endif /* HAVE_IO_URING */
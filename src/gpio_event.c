@@ -0,0 +1,165 @@
+/*
+ * filename: gpio_event.c
+ *
+ * Wakeup source driven by MAX86150 INT pin. Edges are taken from GPIO
+ * character device, so any gpiochip can be used - including gpio-sim or
+ * gpio-mockup lines on a plain Linux box.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/ioctl.h>
+#include <sys/timerfd.h>
+#include <linux/gpio.h>
+#include <filework.h>
+#include <signalwork.h>
+#include <gpio_event.h>
+
+#define GPIO_EVENTS_PER_READ (16)
+#define GPIO_CONSUMER_LABEL  "max86150_int"
+
+#define UNUSED(x) ((void)x)
+
+static int gpio_source_start(struct max86150_configuration *max86150);
+static int gpio_source_stop(void);
+static int gpio_edge_event(int fd, uint32_t events, void *arg);
+static int gpio_watchdog_event(int fd, uint32_t events, void *arg);
+static int gpio_watchdog_arm(void);
+
+static int gpio_event_fd = -1;
+static int gpio_watchdog_fd = -1;
+static int gpio_timeout_ms;
+static uint32_t gpio_edges;
+static uint32_t gpio_timeouts;
+
+const struct max86150_event_source gpio_event_source = {
+    .name  = "gpio",
+    .start = gpio_source_start,
+    .stop  = gpio_source_stop,
+};
+
+
+static int gpio_source_start(struct max86150_configuration *max86150) {
+    struct gpioevent_request req = {0};
+    int chip_fd;
+
+    chip_fd = open(max86150->gpio_chip_name, O_RDONLY);
+    if (chip_fd < 0) {
+        log_error("%s: cannot open %s - %s\n", __func__, max86150->gpio_chip_name, strerror(errno));
+        return -1;
+    }
+
+    /* INT is open drain, active low */
+    req.lineoffset  = max86150->gpio_line;
+    req.handleflags = GPIOHANDLE_REQUEST_INPUT;
+    req.eventflags  = GPIOEVENT_REQUEST_FALLING_EDGE;
+    strncpy(req.consumer_label, GPIO_CONSUMER_LABEL, sizeof(req.consumer_label) - 1);
+
+    if (ioctl(chip_fd, GPIO_GET_LINEEVENT_IOCTL, &req) < 0) {
+        log_error("%s: cannot request line %d of %s - %s\n",
+                  __func__, max86150->gpio_line, max86150->gpio_chip_name, strerror(errno));
+        close(chip_fd);
+        return -1;
+    }
+    close(chip_fd);
+
+    /* Read by epoll dispatcher, which must never block */
+    fcntl(req.fd, F_SETFL, fcntl(req.fd, F_GETFL) | O_NONBLOCK);
+    gpio_event_fd = req.fd;
+    gpio_edges    = 0;
+    gpio_timeouts = 0;
+
+    /* Missed edge must not stall recording: poll FIFO anyway after
+     * half of FIFO worth of samples without an edge */
+    gpio_timeout_ms = (MAX86150_FIFO_DEPTH / 2) * 1000 / max86150->sampling_frequency;
+    if (gpio_timeout_ms < 1) gpio_timeout_ms = 1;
+
+    gpio_watchdog_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (gpio_watchdog_fd < 0) {
+        log_error("%s: cannot create watchdog timer - %s\n", __func__, strerror(errno));
+        gpio_source_stop();
+        return -1;
+    }
+    if (gpio_watchdog_arm() ||
+        add_max86150_event_fd(gpio_event_fd, EPOLLIN | EPOLLPRI, gpio_edge_event, NULL) ||
+        add_max86150_event_fd(gpio_watchdog_fd, EPOLLIN, gpio_watchdog_event, NULL)) {
+        gpio_source_stop();
+        return -1;
+    }
+
+    log_info("%s: line %d of %s, fd = %d, timeout %d ms\n", __func__,
+             max86150->gpio_line, max86150->gpio_chip_name, gpio_event_fd, gpio_timeout_ms);
+
+    return 0;
+}
+
+static int gpio_source_stop() {
+    if (gpio_watchdog_fd >= 0) {
+        remove_max86150_event_fd(gpio_watchdog_fd);
+        close(gpio_watchdog_fd);
+        gpio_watchdog_fd = -1;
+    }
+    if (gpio_event_fd < 0) return 0;
+
+    log_info("%s: %u INT edges, %u timeouts\n", __func__, gpio_edges, gpio_timeouts);
+    remove_max86150_event_fd(gpio_event_fd);
+    close(gpio_event_fd);
+    gpio_event_fd = -1;
+
+    return 0;
+}
+
+static int gpio_edge_event(int fd, uint32_t events, void *arg) {
+    struct gpioevent_data edges[GPIO_EVENTS_PER_READ];
+    ssize_t rd_bytes;
+
+    UNUSED(events);
+    UNUSED(arg);
+
+    /* Kernel hands out every queued edge in one read */
+    rd_bytes = read(fd, edges, sizeof(edges));
+    if (rd_bytes < 0) {
+        if (errno == EAGAIN) return MAX86150_EVENT_NONE;
+        log_error("%s: cannot read GPIO event - %s\n", __func__, strerror(errno));
+        return -1;
+    }
+    gpio_edges += rd_bytes / sizeof(edges[0]);
+
+    if (gpio_watchdog_arm()) return -1;
+    return MAX86150_EVENT_POLL;
+}
+
+static int gpio_watchdog_event(int fd, uint32_t events, void *arg) {
+    uint64_t expirations;
+
+    UNUSED(events);
+    UNUSED(arg);
+
+    if (read(fd, &expirations, sizeof(expirations)) != sizeof(expirations)) {
+        if (errno == EAGAIN) return MAX86150_EVENT_NONE;
+        log_error("%s: cannot read watchdog timer - %s\n", __func__, strerror(errno));
+        return -1;
+    }
+    gpio_timeouts++;
+
+    return MAX86150_EVENT_POLL;
+}
+
+/* Restarts watchdog period, it keeps firing periodically while INT is silent */
+static int gpio_watchdog_arm() {
+    struct itimerspec its = {0};
+
+    its.it_value.tv_sec     = gpio_timeout_ms / 1000;
+    its.it_value.tv_nsec    = (gpio_timeout_ms % 1000) * 1000000;
+    its.it_interval         = its.it_value;
+
+    if (timerfd_settime(gpio_watchdog_fd, 0, &its, NULL)) {
+        log_error("%s: cannot arm watchdog - %s\n", __func__, strerror(errno));
+        return -1;
+    }
+    return 0;
+}
@@ -0,0 +1,67 @@
+/*
+ * filename: i2c_transport.c
+ *
+ * MAX86150 on I2C0 of NanoPi through i2c-dev
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <linux/i2c-dev.h>
+#include <linux/i2c.h>
+#include <filework.h>
+#include <transport.h>
+
+static int i2c_open(struct max86150_configuration *max86150);
+static int i2c_transfer(struct i2c_msg *msgs, int count);
+static void i2c_close(void);
+
+static int max86150_fd = -1;
+
+const struct max86150_transport i2c_transport = {
+    .name     = "i2c",
+    .open     = i2c_open,
+    .transfer = i2c_transfer,
+    .close    = i2c_close,
+};
+
+
+static int i2c_open(struct max86150_configuration *max86150) {
+    (void)max86150;
+
+    if (wiringPiSetup()) {
+        log_error("%s: wiringPiSetup() failed\n", __func__);
+        return -1;
+    }
+
+    if ((max86150_fd = open(I2C_BUS_NAME, O_RDWR)) < 0) {
+        log_error("%s: Failed to open i2c bus %s\n", __func__, I2C_BUS_NAME);
+        return -1;
+    }
+
+    if (ioctl(max86150_fd, I2C_SLAVE, MAX86150_DEV_ID)) {
+        log_error("%s: ioctl(%d, 0x%02x, 0x%02x) failed\n",
+                  __func__, max86150_fd, I2C_SLAVE, MAX86150_DEV_ID);
+        return -1;
+    }
+    log_debug("%s: max86150_fd = %d\n", __func__, max86150_fd);
+
+    return 0;
+}
+
+static int i2c_transfer(struct i2c_msg *msgs, int count) {
+    struct i2c_rdwr_ioctl_data msgset[1];
+
+    msgset[0].msgs  = msgs;
+    msgset[0].nmsgs = count;
+
+    return (ioctl(max86150_fd, I2C_RDWR, &msgset) < 0) ? -1 : 0;
+}
+
+static void i2c_close() {
+    if (max86150_fd >= 0) close(max86150_fd);
+    max86150_fd = -1;
+}
@@ -0,0 +1,125 @@
+/*
+ * filename: latency.c
+ */
+
+#include <stdio.h>
+#include <stdatomic.h>
+#include <time.h>
+#include <filework.h>
+#include <latency.h>
+
+#define LATENCY_SUB_BUCKETS (1 << LATENCY_SUB_BITS)
+
+/* Counters are only incremented by their owner thread, relaxed load and
+ * store keep it cheap and reports free of torn values */
+struct latency_histogram {
+    _Atomic uint32_t counts[LATENCY_BUCKETS];
+    _Atomic uint64_t total;
+    _Atomic uint64_t sum_ns;
+    _Atomic uint64_t max_ns;
+};
+
+static const char *stage_names[LATENCY_STAGES] = {
+    [LATENCY_WAKEUP]    = "wakeup",
+    [LATENCY_POINTERS]  = "pointers",
+    [LATENCY_FIFO_READ] = "fifo_read",
+    [LATENCY_DRAIN]     = "drain",
+    [LATENCY_WRITE]     = "write",
+};
+
+static struct latency_histogram histograms[LATENCY_STAGES];
+
+static uint32_t bucket_of(uint64_t ns);
+static uint64_t bucket_top(uint32_t bucket);
+static void bump(_Atomic uint64_t *v, uint64_t add);
+
+
+/* Same clock as FIFO drain timestamps */
+uint64_t latency_now_ns() {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC_RAW, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+void latency_record(latency_stage stage, uint64_t ns) {
+    struct latency_histogram *h = &histograms[stage];
+    uint32_t bucket = bucket_of(ns);
+
+    atomic_store_explicit(&h->counts[bucket],
+                          atomic_load_explicit(&h->counts[bucket], memory_order_relaxed) + 1,
+                          memory_order_relaxed);
+    bump(&h->total, 1);
+    bump(&h->sum_ns, ns);
+    if (ns > atomic_load_explicit(&h->max_ns, memory_order_relaxed)) {
+        atomic_store_explicit(&h->max_ns, ns, memory_order_relaxed);
+    }
+}
+
+/* Percentiles are upper bounds of the buckets they fall in, capped by max */
+void latency_report(const char *title) {
+    static const double quantiles[] = { 0.5, 0.99, 0.999 };
+    int s;
+
+    log_info("%s: %s, us         count       mean        p50        p99      p99.9        max\n",
+             __func__, title);
+
+    for (s = 0; s < LATENCY_STAGES; s++) {
+        struct latency_histogram *h = &histograms[s];
+        uint64_t total  = atomic_load_explicit(&h->total, memory_order_relaxed);
+        uint64_t max_ns = atomic_load_explicit(&h->max_ns, memory_order_relaxed);
+        uint64_t p[3] = {0};
+        uint64_t seen = 0;
+        uint32_t b = 0;
+        int q;
+
+        if (!total) continue;
+
+        for (q = 0; q < 3; q++) {
+            uint64_t rank = (uint64_t)(quantiles[q] * total + 0.5);
+
+            if (!rank) rank = 1;
+            for (; b < LATENCY_BUCKETS; b++) {
+                uint32_t count = atomic_load_explicit(&h->counts[b], memory_order_relaxed);
+
+                if (seen + count >= rank) break;
+                seen += count;
+            }
+            p[q] = bucket_top(b < LATENCY_BUCKETS ? b : LATENCY_BUCKETS - 1);
+            if (p[q] > max_ns) p[q] = max_ns;
+        }
+
+        log_info("%s: %-12s %12llu %10.1f %10.1f %10.1f %10.1f %10.1f\n", __func__, stage_names[s],
+                 (unsigned long long)total,
+                 atomic_load_explicit(&h->sum_ns, memory_order_relaxed) / 1e3 / total,
+                 p[0] / 1e3, p[1] / 1e3, p[2] / 1e3, max_ns / 1e3);
+    }
+}
+
+
+/* Values below LATENCY_SUB_BUCKETS have a bucket each, above it the top
+ * LATENCY_SUB_BITS + 1 bits select the bucket */
+static uint32_t bucket_of(uint64_t ns) {
+    int msb;
+
+    if (ns < LATENCY_SUB_BUCKETS) return ns;
+    if (ns >> LATENCY_MAX_BITS) return LATENCY_BUCKETS - 1;
+
+    msb = 63 - __builtin_clzll(ns);
+    return ((msb - LATENCY_SUB_BITS + 1) << LATENCY_SUB_BITS) +
+           ((ns >> (msb - LATENCY_SUB_BITS)) & (LATENCY_SUB_BUCKETS - 1));
+}
+
+static uint64_t bucket_top(uint32_t bucket) {
+    uint32_t shift;
+
+    if (bucket < LATENCY_SUB_BUCKETS) return bucket;
+
+    shift = (bucket >> LATENCY_SUB_BITS) - 1;
+    return (((uint64_t)LATENCY_SUB_BUCKETS + (bucket & (LATENCY_SUB_BUCKETS - 1))) << shift) +
+           ((uint64_t)1 << shift) - 1;
+}
+
+static void bump(_Atomic uint64_t *v, uint64_t add) {
+    atomic_store_explicit(v, atomic_load_explicit(v, memory_order_relaxed) + add, memory_order_relaxed);
+}
@@ -0,0 +1,386 @@
+/*
+ * filename: logger.c
+ *
+ * Ring is a bounded MPMC queue (D. Vyukov) used with a single consumer:
+ * every slot has a sequence number telling whether it is free for the
+ * producer of round "pos" or holds a record for the consumer. Producers
+ * only race for the enqueue position, so no thread ever waits on another.
+ * Arguments are taken from va_list by walking the format the same way
+ * printf does, and the consumer walks it again to print them one by one.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdarg.h>
+#include <stddef.h>
+#include <stdatomic.h>
+#include <string.h>
+#include <signal.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <ringbuffer.h>
+#include <logger.h>
+
+#define LOG_SPEC_MAX (32) /* longest conversion specification kept */
+
+union log_arg {
+    long long i;  /* integers, %s as offset in text, -1 if it did not fit */
+    double d;
+    const void *p;
+};
+
+struct log_record {
+    _Alignas(CACHE_LINE_SIZE) atomic_uint sequence;
+    uint16_t args;
+    uint16_t text_used;
+    const char *format;
+    union log_arg arg[LOG_RECORD_ARGS];
+    char text[LOG_RECORD_TEXT];
+};
+
+/* Length modifiers: 'H' is hh, 'q' is ll */
+struct log_spec {
+    char length;
+    char conversion; /* 0 if not supported */
+    int stars;
+};
+
+static struct log_record log_ring[LOG_RING_SLOTS];
+static atomic_uint enqueue_pos;
+static unsigned dequeue_pos;
+static atomic_uint dropped;
+static unsigned dropped_reported;
+
+static FILE *log_file;
+static pthread_t log_thread;
+static atomic_int running;
+static atomic_int stopping;
+
+static const char *parse_spec(const char *p, struct log_spec *spec);
+static void record_args(struct log_record *record, const char *format, va_list *list);
+static void record_string(struct log_record *record, union log_arg *arg, const char *s);
+static void write_record(const struct log_record *record);
+static void write_arg(const char *spec_text, const struct log_spec *spec, const union log_arg *arg,
+                      const struct log_record *record);
+static int logger_drain(void);
+static void *logger_thread(void *arg);
+
+
+/* Log goes to file, which stays open until logger_stop() returns */
+int logger_start(FILE *file) {
+    sigset_t all_signals, old_signals;
+    unsigned i;
+    int ret;
+
+    for (i = 0; i < LOG_RING_SLOTS; i++) atomic_init(&log_ring[i].sequence, i);
+    atomic_init(&enqueue_pos, 0);
+    atomic_init(&dropped, 0);
+    atomic_init(&stopping, 0);
+    dequeue_pos      = 0;
+    dropped_reported = 0;
+    log_file         = file;
+
+    /* Signals are for the acquisition loop signalfd, never for this thread */
+    sigfillset(&all_signals);
+    pthread_sigmask(SIG_SETMASK, &all_signals, &old_signals);
+    ret = pthread_create(&log_thread, NULL, logger_thread, NULL);
+    pthread_sigmask(SIG_SETMASK, &old_signals, NULL);
+    if (ret) {
+        fprintf(file, "%s: cannot start logger thread - %s, logging synchronously\n", __func__, strerror(ret));
+        return -1;
+    }
+    atomic_store_explicit(&running, 1, memory_order_release);
+
+    return 0;
+}
+
+/* Writes out everything logged so far. Records of other threads still
+ * logging at this point may be lost */
+void logger_stop() {
+    if (!atomic_load_explicit(&running, memory_order_acquire)) return;
+
+    atomic_store_explicit(&running, 0, memory_order_release);
+    atomic_store_explicit(&stopping, 1, memory_order_release);
+    pthread_join(log_thread, NULL);
+}
+
+void logger_print(const char *format, ...) {
+    va_list list;
+
+    va_start(list, format);
+    if (atomic_load_explicit(&running, memory_order_acquire)) {
+        unsigned pos = atomic_load_explicit(&enqueue_pos, memory_order_relaxed);
+        struct log_record *record;
+
+        for (;;) {
+            int diff;
+
+            record = &log_ring[pos & (LOG_RING_SLOTS - 1)];
+            diff = (int)(atomic_load_explicit(&record->sequence, memory_order_acquire) - pos);
+            if (!diff) {
+                if (atomic_compare_exchange_weak_explicit(&enqueue_pos, &pos, pos + 1,
+                                                          memory_order_relaxed, memory_order_relaxed)) break;
+            } else if (diff < 0) {
+                /* Consumer is a full ring behind */
+                atomic_fetch_add_explicit(&dropped, 1, memory_order_relaxed);
+                va_end(list);
+                return;
+            } else {
+                pos = atomic_load_explicit(&enqueue_pos, memory_order_relaxed);
+            }
+        }
+
+        record->format = format;
+        record_args(record, format, &list);
+        atomic_store_explicit(&record->sequence, pos + 1, memory_order_release);
+    } else if (log_file) {
+        vfprintf(log_file, format, list);
+        fflush(log_file);
+    } else {
+        printf("logger_print: debug file is not opened, console output: ");
+        vprintf(format, list);
+    }
+    va_end(list);
+}
+
+
+/* p points right after '%'. Returns end of conversion specification */
+static const char *parse_spec(const char *p, struct log_spec *spec) {
+    spec->length     = 0;
+    spec->conversion = 0;
+    spec->stars      = 0;
+
+    while (*p && strchr("-+ #0'", *p)) p++;
+    if (*p == '*') {
+        spec->stars++;
+        p++;
+    }
+    while ((*p >= '0') && (*p <= '9')) p++;
+    if (*p == '.') {
+        p++;
+        if (*p == '*') {
+            spec->stars++;
+            p++;
+        }
+        while ((*p >= '0') && (*p <= '9')) p++;
+    }
+
+    if ((p[0] == 'h') && (p[1] == 'h')) {
+        spec->length = 'H';
+        p += 2;
+    } else if ((p[0] == 'l') && (p[1] == 'l')) {
+        spec->length = 'q';
+        p += 2;
+    } else if (*p && strchr("hlzjtL", *p)) {
+        spec->length = *p++;
+    }
+
+    if (*p && strchr("diouxXcfFeEgGaAspn%", *p)) spec->conversion = *p++;
+
+    return p;
+}
+
+static void record_args(struct log_record *record, const char *format, va_list *list) {
+    const char *p = format;
+    struct log_spec spec;
+    int i;
+
+    record->args      = 0;
+    record->text_used = 0;
+
+    while ((p = strchr(p, '%'))) {
+        union log_arg *arg;
+
+        p = parse_spec(p + 1, &spec);
+        if (!spec.conversion) break;
+        if (spec.conversion == '%') continue;
+        if (spec.conversion == 'n') {
+            (void)va_arg(*list, int *);
+            continue;
+        }
+        if (record->args + spec.stars + 1 > LOG_RECORD_ARGS) break;
+
+        for (i = 0; i < spec.stars; i++) record->arg[record->args++].i = va_arg(*list, int);
+        arg = &record->arg[record->args++];
+
+        switch (spec.conversion) {
+        case 'd': case 'i':
+            switch (spec.length) {
+            case 'l': arg->i = va_arg(*list, long);      break;
+            case 'q': arg->i = va_arg(*list, long long); break;
+            case 'z': arg->i = va_arg(*list, ssize_t);   break;
+            case 'j': arg->i = va_arg(*list, intmax_t);  break;
+            case 't': arg->i = va_arg(*list, ptrdiff_t); break;
+            default:  arg->i = va_arg(*list, int);       break;
+            }
+            break;
+        case 'o': case 'u': case 'x': case 'X':
+            switch (spec.length) {
+            case 'l': arg->i = va_arg(*list, unsigned long);      break;
+            case 'q': arg->i = va_arg(*list, unsigned long long); break;
+            case 'z': arg->i = va_arg(*list, size_t);             break;
+            case 'j': arg->i = va_arg(*list, uintmax_t);          break;
+            case 't': arg->i = va_arg(*list, ptrdiff_t);          break;
+            default:  arg->i = va_arg(*list, unsigned);           break;
+            }
+            break;
+        case 'c':
+            arg->i = va_arg(*list, int);
+            break;
+        case 's':
+            record_string(record, arg, va_arg(*list, const char *));
+            break;
+        case 'p':
+            arg->p = va_arg(*list, void *);
+            break;
+        default:
+            arg->d = (spec.length == 'L') ? (double)va_arg(*list, long double) : va_arg(*list, double);
+            break;
+        }
+    }
+}
+
+/* Strings may live on caller stack (strerror() buffer etc.), so they are copied */
+static void record_string(struct log_record *record, union log_arg *arg, const char *s) {
+    size_t space = LOG_RECORD_TEXT - record->text_used;
+    size_t len;
+
+    if (!s) s = "(null)";
+    if (!space) {
+        arg->i = -1;
+        return;
+    }
+
+    len = strnlen(s, space - 1);
+    memcpy(&record->text[record->text_used], s, len);
+    record->text[record->text_used + len] = '\0';
+    arg->i = record->text_used;
+    record->text_used += len + 1;
+}
+
+static void write_record(const struct log_record *record) {
+    const char *p = record->format;
+    struct log_spec spec;
+    unsigned a = 0;
+
+    while (*p) {
+        const char *percent = strchr(p, '%');
+        char spec_text[LOG_SPEC_MAX + 16];
+        const char *end, *s;
+        size_t n = 0;
+
+        if (!percent) {
+            fputs(p, log_file);
+            return;
+        }
+        fwrite(p, 1, percent - p, log_file);
+
+        end = parse_spec(percent + 1, &spec);
+        p = end;
+        if (spec.conversion == '%') {
+            fputc('%', log_file);
+            continue;
+        }
+        if (spec.conversion == 'n') continue;
+        if (!spec.conversion || (a + spec.stars + 1 > record->args) || (end - percent > LOG_SPEC_MAX)) {
+            fputs(" ...\n", log_file);
+            return;
+        }
+
+        /* Width and precision given as arguments are put in the spec text,
+         * so every conversion is printed with a single argument */
+        for (s = percent; s < end; s++) {
+            if (*s == '*') {
+                n += snprintf(&spec_text[n], sizeof(spec_text) - n, "%d", (int)record->arg[a++].i);
+            } else if (*s != 'L') {
+                spec_text[n++] = *s;
+            }
+        }
+        spec_text[n] = '\0';
+
+        write_arg(spec_text, &spec, &record->arg[a++], record);
+    }
+}
+
+/* Arguments are passed back with the type their length modifier asks for */
+static void write_arg(const char *spec_text, const struct log_spec *spec, const union log_arg *arg,
+                      const struct log_record *record) {
+    switch (spec->conversion) {
+    case 'd': case 'i':
+        switch (spec->length) {
+        case 'l': fprintf(log_file, spec_text, (long)arg->i);      break;
+        case 'q': fprintf(log_file, spec_text, (long long)arg->i); break;
+        case 'z': fprintf(log_file, spec_text, (ssize_t)arg->i);   break;
+        case 'j': fprintf(log_file, spec_text, (intmax_t)arg->i);  break;
+        case 't': fprintf(log_file, spec_text, (ptrdiff_t)arg->i); break;
+        default:  fprintf(log_file, spec_text, (int)arg->i);       break;
+        }
+        break;
+    case 'o': case 'u': case 'x': case 'X':
+        switch (spec->length) {
+        case 'l': fprintf(log_file, spec_text, (unsigned long)arg->i);      break;
+        case 'q': fprintf(log_file, spec_text, (unsigned long long)arg->i); break;
+        case 'z': fprintf(log_file, spec_text, (size_t)arg->i);             break;
+        case 'j': fprintf(log_file, spec_text, (uintmax_t)arg->i);          break;
+        case 't': fprintf(log_file, spec_text, (ptrdiff_t)arg->i);          break;
+        default:  fprintf(log_file, spec_text, (unsigned)arg->i);           break;
+        }
+        break;
+    case 'c':
+        fprintf(log_file, spec_text, (int)arg->i);
+        break;
+    case 's':
+        fprintf(log_file, spec_text, (arg->i < 0) ? "" : &record->text[arg->i]);
+        break;
+    case 'p':
+        fprintf(log_file, spec_text, arg->p);
+        break;
+    default:
+        fprintf(log_file, spec_text, arg->d);
+        break;
+    }
+}
+
+/* Returns number of records written */
+static int logger_drain() {
+    unsigned lost = atomic_load_explicit(&dropped, memory_order_relaxed);
+    int count = 0;
+
+    for (;;) {
+        struct log_record *record = &log_ring[dequeue_pos & (LOG_RING_SLOTS - 1)];
+
+        if (atomic_load_explicit(&record->sequence, memory_order_acquire) != dequeue_pos + 1) break;
+
+        write_record(record);
+        atomic_store_explicit(&record->sequence, dequeue_pos + LOG_RING_SLOTS, memory_order_release);
+        dequeue_pos++;
+        count++;
+    }
+
+    if (lost != dropped_reported) {
+        fprintf(log_file, "%s: %u log records lost on full ring\n", __func__, lost - dropped_reported);
+        dropped_reported = lost;
+        count++;
+    }
+
+    return count;
+}
+
+/* Wakes up every LOG_FLUSH_INTERVAL_MS, so producers never make a syscall
+ * to wake it, and one write covers every record of the interval */
+static void *logger_thread(void *arg) {
+    struct timespec interval = { 0, LOG_FLUSH_INTERVAL_MS * 1000000L };
+
+    (void)arg;
+
+    while (!atomic_load_explicit(&stopping, memory_order_acquire)) {
+        if (logger_drain()) fflush(log_file);
+        nanosleep(&interval, NULL);
+    }
+    logger_drain();
+    fflush(log_file);
+
+    return NULL;
+}
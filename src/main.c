@@ -2,52 +2,87 @@
  * filename: main.c
  */
 
-#if defined(LITTLE_ENDIAN) && defined(BIG_ENDIAN)
-#error /* Both Little-Endian and Big-Endian cannot be enabled */
-#endif
-
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
-#include <string.h>
-#include <wiringPi.h>
-#include <wiringPiI2C.h>
+#include <errno.h>
+#include <sys/resource.h>
 #include <max86150_defs.h>
 #include <filework.h>
 #include <peripheral.h>
 #include <signalwork.h>
+#include <ringbuffer.h>
+#include <capture.h>
+#include <capture_format.h>
+#include <unpack.h>
+#include <pipeline.h>
+#include <poll_control.h>
+#include <realtime.h>
+#include <latency.h>
+#include <control.h>
+#include <transport.h>
 
 #define UNUSED(x) ((void)x)
 
 static int validate_input(int argc, char **argv, struct max86150_configuration *max86150);
 static void set_default_max86150_values(struct max86150_configuration *max86150);
 static void print_usage(char **argv);
+static void adapt_poll_period(struct poll_control *poll_control, int fifo_level);
+static void add_lost_samples(uint64_t *lost_pending, uint32_t *lost_flags, uint64_t *samples_total,
+                             uint32_t count, uint32_t flags);
+static void latency_snapshot(void);
+static void write_run_stats(struct max86150_configuration *max86150, uint64_t wall_ns,
+                            const struct rusage *usage_start, uint64_t samples, uint64_t lost,
+                            uint32_t overflows, uint32_t ring_full, uint32_t drains,
+                            uint32_t i2c_transfers, uint32_t bus_bytes);
 
 
 int main(int argc, char **argv) {
     int retval = 0;
     struct max86150_configuration max86150 = {0};
     uint8_t *read_buf = NULL;
-    uint32_t *write_buf = NULL;
+    struct spsc_ring capture_ring = {0};
+    struct spsc_ring_stats ring_stats;
     ssize_t bytes_written;
     int write_buf_len_int;
     int binary_capture_file;
+    uint32_t drains_total    = 0;
+    uint32_t syscalls_total  = 0;
+    uint32_t bus_bytes_total = 0;
+    uint64_t samples_total   = 0;
+    uint64_t lost_pending    = 0; /* not yet reported in a batch */
+    uint32_t lost_flags      = 0;
+    uint64_t lost_fifo_total = 0;
+    uint64_t lost_ring_total = 0;
+    uint32_t overflows_total = 0;
+    uint32_t overflows_saturated = 0;
+    int speculative_count;
+    struct unpack_layout unpack_layout;
+    uint8_t slots[MAX_SIGNALS_ALLOWED];
+    struct poll_control poll_control;
+    int adaptive_poll;
+    int final_drain = 0;
+    uint64_t stop_ns = 0; /* CLOCK_MONOTONIC_RAW of stop request */
+    uint64_t drained_ns, written_ns;
+    uint64_t recording_ns = 0;
+    struct rusage usage_start;
+    uint64_t launch_ns = latency_now_ns();
 
     init_debug();
 
     set_default_max86150_values(&max86150);
 
     if (validate_input(argc, argv, &max86150)) {
-        /* d_print("%s: cannot validate input\n", __func__); */ /* May be silently closed */
+        /* log_error("%s: cannot validate input\n", __func__); */ /* May be silently closed */
         retval = -1;
         goto cant_start;
     }
 
-    if (init_gpio() == 0) {
-        d_print("%s: init_gpio() successful\n", __func__);
+    if (init_gpio(&max86150) == 0) {
+        log_info("%s: init_gpio() successful\n", __func__);
     } else {
-        d_print("%s: init_gpio() NOT successful\n", __func__);
+        log_error("%s: init_gpio() NOT successful\n", __func__);
         retval = -1;
         goto cant_start;
     }
@@ -57,135 +92,376 @@ int main(int argc, char **argv) {
         goto cant_start;
     }
 
-    read_buf = (uint8_t *)malloc(max86150.number_of_bytes_per_fifo_read * sizeof(typeof(read_buf[0])));
+#ifdef MAX86150_SIM
+    /* Simulated device runs faster, host side follows its sample rate */
+    if (max86150.sim_speed > 1) {
+        max86150.sampling_frequency *= max86150.sim_speed;
+        log_info("%s: %dx real time, %u Hz sample rate\n", __func__, max86150.sim_speed, max86150.sampling_frequency);
+    }
+#endif
+
+    speculative_count = max86150.fifo_read_unit;
+
+    /* INT pin already wakes up at A_FULL, only timer needs adapting.
+     * Adapted polls drain whole FIFO, so fill is only what arrived since
+     * previous poll and its limit is the overflow point */
+    adaptive_poll = max86150.adaptive_poll && (max86150.event_source == EVENT_SOURCE_TIMER);
+    poll_control_init(&poll_control, max86150.sampling_frequency,
+                      max86150.fifo_read_unit, MAX86150_FIFO_DEPTH);
+
+    unpack_init();
+    if (unpack_layout_init(&unpack_layout, slots,
+                           capture_channel_slots(max86150.allowed_signals, slots))) {
+        log_error("%s: unsupported FIFO slot layout\n", __func__);
+        retval = -1;
+        goto cant_start;
+    }
+
+    /* Buffers hold the whole FIFO, so a single drain never needs to be split */
+    read_buf = (uint8_t *)malloc(MAX86150_FIFO_DEPTH * max86150.number_of_bytes_per_fifo_read * sizeof(typeof(read_buf[0])) +
+                                 UNPACK_SLACK_BYTES);
     if(!read_buf) {
-        d_print("%s: cannot allocate memory for read_buf\n", __func__);
+        log_error("%s: cannot allocate memory for read_buf\n", __func__);
         retval = -1;
         goto cant_start;
     }
 
-    write_buf_len_int = max86150.number_of_bytes_per_fifo_read / 3;
-    write_buf = (uint32_t *)malloc(write_buf_len_int * sizeof(typeof(write_buf[0])));
-    if(!write_buf) {
-        d_print("%s: cannot allocate memory for write_buf\n", __func__);
+    write_buf_len_int = max86150.number_of_bytes_per_fifo_read / BYTES_PER_FIFO_READ;
+
+    if (spsc_ring_init(&capture_ring, max86150.ring_slots, sizeof(struct capture_batch))) {
+        log_error("%s: cannot allocate capture ring\n", __func__);
         retval = -1;
         goto cant_start;
     }
 
     binary_capture_file = open_capture_file(max86150.capture_file_name);
     if (-1 == binary_capture_file) {
-        d_print("%s cannot open capture file \"%s\"\n",
-                __func__, max86150.capture_file_name);
+        log_error("%s cannot open capture file \"%s\"\n",
+                  __func__, max86150.capture_file_name);
         retval = -1;
         goto cant_start;
     } else {
-        uint32_t allowed_signals = max86150.allowed_signals;
+        struct capture_file_header header;
 
-        bytes_written = write(binary_capture_file, &allowed_signals, sizeof(allowed_signals));
-        if (sizeof(allowed_signals) != bytes_written) {
-            d_print("%s: cannot write first byte of file, fd = %d\n", __func__, binary_capture_file);
-            d_print("%s: errno = %d(%s)\n", __func__, errno, strerror(errno));
+        capture_fill_header(&header, &max86150, max86150.capture_chunk_size);
+        bytes_written = write(binary_capture_file, &header, sizeof(header));
+        if (sizeof(header) != bytes_written) {
+            log_error("%s: cannot write capture file header, fd = %d\n", __func__, binary_capture_file);
+            log_error("%s: errno = %d(%s)\n", __func__, errno, strerror(errno));
             retval = -1;
             goto cant_start;
         }
     }
 
-    d_print("%s: read_buf_size %d\n", __func__, max86150.number_of_bytes_per_fifo_read * sizeof(typeof(read_buf[0])));
+    log_info("%s: read_buf_size %zu, FIFO read mode: %s, unpack: %s, layout: %s\n", __func__,
+             MAX86150_FIFO_DEPTH * max86150.number_of_bytes_per_fifo_read * sizeof(typeof(read_buf[0])),
+             (max86150.fifo_read_mode == FIFO_READ_BURST)    ? "burst" :
+             (max86150.fifo_read_mode == FIFO_READ_COMBINED) ? "combined" : "per sample",
+             unpack_path_name(unpack_selected()), pipeline_variant_name(unpack_layout.variant));
 
     if (register_term_signal()) {
         retval = -1;
         goto cant_start;
     }
+    register_snapshot_handler(latency_snapshot);
+
+    if (start_capture_writer(binary_capture_file, &capture_ring, &max86150)) {
+        retval = -1;
+        goto cant_start;
+    }
+
+    /* Writer thread is already started, so it stays at normal priority */
+    if (max86150.realtime) {
+        if (enter_realtime(&max86150)) {
+            retval = -1;
+            goto cant_start;
+        }
+        prefault_buffer(read_buf, MAX86150_FIFO_DEPTH * max86150.number_of_bytes_per_fifo_read + UNPACK_SLACK_BYTES);
+        prefault_buffer(capture_ring.slots, (size_t)(capture_ring.mask + 1) * capture_ring.slot_size);
+    }
 
     if (start_recording(&max86150)) {
         retval = 1;
         goto cant_start;
     }
+    recording_ns = latency_now_ns();
+    getrusage(RUSAGE_SELF, &usage_start);
 
-    while (1) {
-        uint8_t register_buffer[3];
+    if (max86150.control_path[0] && open_max86150_control(&max86150)) {
+        retval = -1;
+        goto cant_start;
+    }
+
+    do {
+        uint8_t register_buffer[MAX86150_REG_FIFO_RP - MAX86150_REG_IS1 + 1];
+        uint8_t *status_buffer = NULL;
+        uint8_t *pointer_buffer = register_buffer;
+        struct capture_batch *batch;
+        uint64_t drain_ns, read_ns;
+        int fifo_level;
+        uint32_t ovc              = 0;
+        uint32_t ovc_flags        = 0;
         uint8_t read_pointer_val  = 0;
         uint8_t ovc_pointer_val   = 0;
         uint8_t write_pointer_val = 0;
         int i;
         int to_read_count;
+        int event;
+
+        event = wait_max86150_event();
+        if (event < 0) break;
+        if (event) {
+            /* Stop request: no new samples, what is in FIFO is the last batch */
+            stop_ns = latency_now_ns();
+            final_drain = 1;
+            speculative_count = MAX86150_FIFO_DEPTH;
+            if (stop_conversions()) break;
+        }
+        if (capture_writer_failed()) {
+            retval = -1;
+            break;
+        }
 
-        sleep(0xffffffff);
-        if (get_sigint_status()) break;
+        /* In interrupt mode IS1/IS2 are read along with pointers to clear INT */
+        if (max86150.event_source == EVENT_SOURCE_GPIO) {
+            status_buffer  = register_buffer;
+            pointer_buffer = &register_buffer[MAX86150_REG_FIFO_WP - MAX86150_REG_IS1];
+        }
 
         piLock(0);
-        if(read_max86150_register(MAX86150_REG_FIFO_WP, register_buffer, 3))
-        {
-            piUnlock(0);
-            d_print("%s: read FIFO WP/OVC/RP failed\n", __func__);
-            break;
-        }
-        write_pointer_val = register_buffer[0];
-        ovc_pointer_val   = register_buffer[1];
-        read_pointer_val  = register_buffer[2];
 
-        if (ovc_pointer_val) {
+        /* Sample count is known as of FIFO pointers read, time is taken
+         * right before it, so I2C transfer time stays out of timestamp */
+        drain_ns = latency_now_ns();
+
+        if (max86150.fifo_read_mode == FIFO_READ_COMBINED) {
+            struct max86150_i2c_stats drain_stats;
+
+            if (read_max86150_FIFO_combined(speculative_count, max86150.number_of_bytes_per_fifo_read,
+                                            status_buffer, pointer_buffer, read_buf, &to_read_count, &drain_stats)) {
+                piUnlock(0);
+                log_error("%s: combined FIFO read failed\n", __func__);
+                break;
+            }
+            read_ns = latency_now_ns();
+            latency_record(LATENCY_FIFO_READ, read_ns - drain_ns);
+            syscalls_total  += drain_stats.syscalls;
+            bus_bytes_total += drain_stats.bytes;
+
+            /* Overflowed FIFO is drained whole, see below. So is FIFO
+             * grown past the guess when polling is adapted */
+            ovc = pointer_buffer[1] & MAX86150_BIT_OVF_COUNTER;
+            fifo_level = max86150_fifo_level(pointer_buffer[0], pointer_buffer[1], pointer_buffer[2]);
+            if ((ovc && (to_read_count < MAX86150_FIFO_DEPTH)) || (adaptive_poll && (to_read_count < fifo_level))) {
+                int rest = (ovc ? MAX86150_FIFO_DEPTH : fifo_level) - to_read_count;
+
+                if (read_max86150_FIFO_burst(rest, max86150.number_of_bytes_per_fifo_read,
+                                             read_buf + to_read_count * max86150.number_of_bytes_per_fifo_read,
+                                             &drain_stats)) {
+                    piUnlock(0);
+                    log_error("%s: FIFO burst read of %d samples failed\n", __func__, rest);
+                    break;
+                }
+                latency_record(LATENCY_FIFO_READ, latency_now_ns() - read_ns);
+                syscalls_total  += drain_stats.syscalls;
+                bus_bytes_total += drain_stats.bytes;
+                to_read_count += rest;
+            }
             piUnlock(0);
-            d_print("%s: FIFO Overflow counter is not empty! Stopping recording\n", __func__);
-            break;
-        }
 
-        to_read_count = (write_pointer_val > read_pointer_val) ?
-                        (write_pointer_val - read_pointer_val) :
-                        (32 + write_pointer_val - read_pointer_val);
+            /* Next guess is what was waiting this time, leftovers included */
+            speculative_count = (fifo_level < 1) ? 1 : fifo_level;
+            if (adaptive_poll) adapt_poll_period(&poll_control, fifo_level);
 
-        if (to_read_count < SAMPLES_PER_SINGLE_READ) {
-            to_read_count = 0;
-        } else if (to_read_count < (SAMPLES_PER_SINGLE_READ * 2)) {
-            to_read_count = SAMPLES_PER_SINGLE_READ;
-        } else if (to_read_count < (SAMPLES_PER_SINGLE_READ * 3)) {
-            to_read_count = SAMPLES_PER_SINGLE_READ * 2;
+            if (!to_read_count) continue;
+            drains_total++;
         } else {
-            to_read_count = SAMPLES_PER_SINGLE_READ * 3;
-        }
+            int reg_count = status_buffer ? sizeof(register_buffer) : 3;
 
-        for (i = 0; i < to_read_count; i++) {
-            int j;
-            if (read_max86150_FIFO_multiple(max86150.number_of_bytes_per_fifo_read, read_buf)) {
+            if(read_max86150_register(status_buffer ? MAX86150_REG_IS1 : MAX86150_REG_FIFO_WP,
+                                      register_buffer, reg_count))
+            {
                 piUnlock(0);
-                d_print("%s: FIFO read failed\n", __func__);
+                log_error("%s: read FIFO WP/OVC/RP failed\n", __func__);
                 break;
             }
-            for (j = 0; j < write_buf_len_int; j++) {
-#if defined(LITTLE_ENDIAN)
-                write_buf[j] = (read_buf[j * BYTES_PER_FIFO_READ + 2] << 0) |
-                               (read_buf[j * BYTES_PER_FIFO_READ + 1] << 8) |
-                               (read_buf[j * BYTES_PER_FIFO_READ + 0] << 16);
-#endif /* defined(LITTLE_ENDIAN) */
-#if defined(BIG_ENDIAN)
-                write_buf[j] = (read_buf[j * BYTES_PER_FIFO_READ + 2] << 16) |
-                               (read_buf[j * BYTES_PER_FIFO_READ + 1] << 8) |
-                               (read_buf[j * BYTES_PER_FIFO_READ + 0] << 0);
-#endif /* defined(BIG_ENDIAN) */
+            read_ns = latency_now_ns();
+            latency_record(LATENCY_POINTERS, read_ns - drain_ns);
+            write_pointer_val = pointer_buffer[0];
+            ovc_pointer_val   = pointer_buffer[1];
+            read_pointer_val  = pointer_buffer[2];
+            syscalls_total++;
+            bus_bytes_total += reg_count;
+
+            fifo_level = max86150_fifo_level(write_pointer_val, ovc_pointer_val, read_pointer_val);
+            if (adaptive_poll) adapt_poll_period(&poll_control, fifo_level);
+
+            /* Whole read units only, leftovers wait for next wakeup.
+             * Overflowed FIFO is drained whole: RP catches up with WP and
+             * reading FIFO data clears OVF_COUNTER. Last drain takes all,
+             * so does adapted poll, which has no read unit period */
+            ovc = ovc_pointer_val & MAX86150_BIT_OVF_COUNTER;
+            to_read_count = (ovc || final_drain || adaptive_poll) ?
+                            fifo_level : fifo_level - fifo_level % max86150.fifo_read_unit;
+
+            if (!to_read_count) {
+                piUnlock(0);
+                continue;
+            }
+
+            if (max86150.fifo_read_mode == FIFO_READ_BURST) {
+                struct max86150_i2c_stats drain_stats;
+
+                if (read_max86150_FIFO_burst(to_read_count, max86150.number_of_bytes_per_fifo_read,
+                                             read_buf, &drain_stats)) {
+                    piUnlock(0);
+                    log_error("%s: FIFO burst read of %d samples failed\n", __func__, to_read_count);
+                    break;
+                }
+                latency_record(LATENCY_FIFO_READ, latency_now_ns() - read_ns);
+                syscalls_total  += drain_stats.syscalls;
+                bus_bytes_total += drain_stats.bytes;
+            } else {
+                for (i = 0; i < to_read_count; i++) {
+                    if (read_max86150_FIFO_multiple(max86150.number_of_bytes_per_fifo_read,
+                                                    read_buf + i * max86150.number_of_bytes_per_fifo_read)) {
+                        log_error("%s: FIFO read failed\n", __func__);
+                        break;
+                    }
+                    latency_record(LATENCY_FIFO_READ, latency_now_ns() - read_ns);
+                    read_ns = latency_now_ns();
+                    syscalls_total++;
+                    bus_bytes_total += max86150.number_of_bytes_per_fifo_read;
+                }
+                if (i != to_read_count) {
+                    piUnlock(0);
+                    break;
+                }
             }
+            piUnlock(0);
+            drains_total++;
         }
-        if (i != to_read_count) break;
-        piUnlock(0);
-
-        bytes_written = write(binary_capture_file, write_buf, write_buf_len_int * sizeof(uint32_t));
-        if ((write_buf_len_int * sizeof(uint32_t)) != (uint32_t)bytes_written) {
-            d_print("%s: binary write failed, bytes written %d, fd = %d\n",
-                    __func__, bytes_written, binary_capture_file);
-            d_print("%s: errno = %d(%s)\n", __func__, errno, strerror(errno));
-            retval = -1;
-            break;
+
+        /* Setup cost paid on every session restart */
+        if (drains_total == 1) {
+            log_info("%s: first samples drained %.1f ms after start, %.1f ms after conversions started\n", __func__,
+                     (drain_ns - launch_ns) / 1e6, (drain_ns - recording_ns) / 1e6);
+        }
+
+        /* Full FIFO drops new samples, so the lost ones come right after
+         * the ones read now. With rollover they replaced the oldest, i.e.
+         * came before them */
+        if (ovc) {
+            ovc_flags = CAPTURE_GAP_FIFO_OVERFLOW;
+            if (ovc == MAX86150_BIT_OVF_COUNTER) ovc_flags |= CAPTURE_GAP_AT_LEAST;
+            overflows_total++;
+            lost_fifo_total += ovc;
+            if (ovc == MAX86150_BIT_OVF_COUNTER) overflows_saturated++;
+            log_error("%s: FIFO overflow, %u%s samples lost\n", __func__, ovc,
+                      (ovc == MAX86150_BIT_OVF_COUNTER) ? " or more" : "");
+            if (max86150.fifo_rollover) add_lost_samples(&lost_pending, &lost_flags, &samples_total, ovc, ovc_flags);
+        }
+
+        /* Last batch waits for a free slot rather than being dropped,
+         * writer releases one at least every flush latency */
+        batch = spsc_ring_reserve(&capture_ring);
+        for (i = 0; !batch && final_drain && (i < (int)max86150.capture_flush_latency_ms); i++) {
+            usleep(1000);
+            batch = spsc_ring_reserve(&capture_ring);
+        }
+        if (!batch) {
+            log_error("%s: capture ring is full, %d samples lost\n", __func__, to_read_count);
+            lost_ring_total += to_read_count;
+            add_lost_samples(&lost_pending, &lost_flags, &samples_total, to_read_count, CAPTURE_GAP_RING_FULL);
+        } else {
+            batch->timestamp_ns = drain_ns;
+            batch->first_sample = samples_total;
+            batch->lost         = lost_pending;
+            batch->lost_flags   = lost_flags;
+            batch->flags        = ovc ? CAPTURE_BATCH_OVERFLOW : 0;
+            batch->fifo_level   = fifo_level;
+            batch->samples      = to_read_count;
+            batch->words        = to_read_count * write_buf_len_int;
+            unpack_fifo(read_buf, to_read_count, &unpack_layout, (int32_t *)batch->data);
+            /* Live change goes with first batch that gets a slot. Of several
+             * changes between two drains only the last one is recorded */
+            if (max86150.config_changed_ns) {
+                capture_fill_config(&batch->config, &max86150);
+                batch->flags |= CAPTURE_BATCH_CONFIG;
+                max86150.config_changed_ns = 0;
+            }
+            spsc_ring_commit(&capture_ring);
+            samples_total += to_read_count;
+            lost_pending   = 0;
+            lost_flags     = 0;
         }
+        latency_record(LATENCY_DRAIN, latency_now_ns() - drain_ns);
+
+        if (ovc && !max86150.fifo_rollover) add_lost_samples(&lost_pending, &lost_flags, &samples_total, ovc, ovc_flags);
+    } while (!final_drain);
+    close_max86150_control();
+
+    /* Writer appends trailer, flushes and exits. Its work is bounded by
+     * ring depth, so is the stop latency */
+    drained_ns = latency_now_ns();
+    capture_set_stop(get_sigint_status(), stop_ns);
+    spsc_ring_close(&capture_ring);
+    if (stop_capture_writer()) {
+        retval = -1;
+    }
+    written_ns = latency_now_ns();
+    if (close_capture_file()) {
+        retval = -1;
+    }
+    if (stop_ns) {
+        uint64_t synced_ns = latency_now_ns();
+
+        log_info("%s: stopped in %.1f ms: last FIFO drain %.1f ms, writer %.1f ms, fsync %.1f ms\n", __func__,
+                 (synced_ns - stop_ns) / 1e6, (drained_ns - stop_ns) / 1e6,
+                 (written_ns - drained_ns) / 1e6, (synced_ns - written_ns) / 1e6);
+    }
+
+    spsc_ring_get_stats(&capture_ring, &ring_stats);
+    log_info("%s: capture ring %u slots, high water %u (%u%%), %u batches lost on full ring\n",
+             __func__, ring_stats.capacity, ring_stats.high_water,
+             ring_stats.high_water * 100 / ring_stats.capacity, ring_stats.full_events);
+
+    if (drains_total) {
+        log_info("%s: %u FIFO drains, %u I2C syscalls (%u.%02u per drain), %u FIFO bytes (%u per drain)\n",
+                 __func__, drains_total, syscalls_total,
+                 syscalls_total / drains_total, (syscalls_total % drains_total) * 100 / drains_total,
+                 bus_bytes_total, bus_bytes_total / drains_total);
+    }
+    if (adaptive_poll) poll_control_report(&poll_control);
+    latency_report("final");
+
+    if (lost_fifo_total || lost_ring_total) {
+        log_info("%s: %llu samples lost in %u FIFO overflows (%u with saturated counter, loss may be larger), "
+                 "%llu on full capture ring, %.3f%% of %llu\n", __func__,
+                 (unsigned long long)lost_fifo_total, overflows_total, overflows_saturated,
+                 (unsigned long long)lost_ring_total,
+                 (lost_fifo_total + lost_ring_total) * 100.0 / samples_total, (unsigned long long)samples_total);
+    }
+
+    if (max86150.stats_path[0]) {
+        write_run_stats(&max86150, drained_ns - recording_ns, &usage_start, samples_total,
+                        lost_fifo_total + lost_ring_total, overflows_total, ring_stats.full_events,
+                        drains_total, syscalls_total, bus_bytes_total);
     }
 
     if (stop_recording()) {
-        d_print("%s: cannot stop recording. Physical device reboot may be required\n", __func__);
+        log_error("%s: cannot stop recording. Physical device reboot may be required\n", __func__);
         retval = -1;
         goto cant_start;
     }
-    /* TODO: collect last data */
 
 cant_start:
     if (read_buf) free(read_buf);
+    if (capture_ring.slots) {
+        spsc_ring_close(&capture_ring);
+        stop_capture_writer();
+        spsc_ring_destroy(&capture_ring);
+    }
     deinit_gpio();
     close_capture_file();
     close_debug();
@@ -284,13 +560,196 @@ static int validate_input(int argc, char **argv, struct max86150_configuration *
                 max86150->ecg_ia_gain = atoi(argv[++i]);
                 continue;
             }
+            if (0 == strcmp(argv[i], "--per-sample-read")) {
+                max86150->fifo_read_mode = FIFO_READ_PER_SAMPLE;
+                continue;
+            }
+            if (0 == strcmp(argv[i], "--combined-read")) {
+                max86150->fifo_read_mode = FIFO_READ_COMBINED;
+                continue;
+            }
+            if (0 == strcmp(argv[i], "--adaptive-poll")) {
+                max86150->adaptive_poll = 1;
+                continue;
+            }
+            if (0 == strcmp(argv[i], "--realtime")) {
+                max86150->realtime = 1;
+                continue;
+            }
+            if (0 == strcmp(argv[i], "--rt-priority")) {
+                max86150->rt_priority = atoi(argv[++i]);
+                if ((max86150->rt_priority < 1) || (max86150->rt_priority > 99)) {
+                    printf("%s: realtime priority is invalid - %s\n", __func__, argv[i]);
+                    return -1;
+                }
+                continue;
+            }
+            if (0 == strcmp(argv[i], "--rt-cpu")) {
+                max86150->rt_cpu = atoi(argv[++i]);
+                continue;
+            }
+            if (0 == strcmp(argv[i], "--interrupt")) {
+                max86150->event_source = EVENT_SOURCE_GPIO;
+                continue;
+            }
+            if (0 == strcmp(argv[i], "--interrupt-data-ready")) {
+                max86150->event_source = EVENT_SOURCE_GPIO;
+                max86150->interrupt_data_ready = 1;
+                continue;
+            }
+            if (0 == strcmp(argv[i], "--gpio-chip")) {
+                size_t size;
+
+                i++;
+                size = strlen(argv[i]);
+                if (size >= MAX_FILENAME_LENGTH) {
+                    log_error("%s gpio chip name too long %zu\n", __func__, size);
+                    return -1;
+                }
+                memcpy(max86150->gpio_chip_name, argv[i], size);
+                max86150->gpio_chip_name[size] = 0;
+                continue;
+            }
+            if (0 == strcmp(argv[i], "--control")) {
+                size_t size;
+
+                i++;
+                size = strlen(argv[i]);
+                if (size >= MAX_FILENAME_LENGTH) {
+                    log_error("%s control pipe name too long %zu\n", __func__, size);
+                    return -1;
+                }
+                memcpy(max86150->control_path, argv[i], size);
+                max86150->control_path[size] = 0;
+                continue;
+            }
+            if (0 == strcmp(argv[i], "--gpio-line")) {
+                max86150->gpio_line = atoi(argv[++i]);
+                continue;
+            }
+            if (0 == strcmp(argv[i], "--stats")) {
+                size_t size;
+
+                i++;
+                size = strlen(argv[i]);
+                if (size >= MAX_FILENAME_LENGTH) {
+                    log_error("%s stats file name too long %zu\n", __func__, size);
+                    return -1;
+                }
+                memcpy(max86150->stats_path, argv[i], size);
+                max86150->stats_path[size] = 0;
+                continue;
+            }
+#ifdef MAX86150_SIM
+            if (0 == strcmp(argv[i], "--sim-bus-latency")) {
+                max86150->sim_bus_latency_us = atoi(argv[++i]);
+                continue;
+            }
+            if (0 == strcmp(argv[i], "--sim-bus-errors")) {
+                max86150->sim_bus_error_ppm = atoi(argv[++i]);
+                continue;
+            }
+            if (0 == strcmp(argv[i], "--sim-drift")) {
+                max86150->sim_clock_ppm = atof(argv[++i]);
+                continue;
+            }
+            if (0 == strcmp(argv[i], "--sim-speed")) {
+                max86150->sim_speed = atoi(argv[++i]);
+                if (max86150->sim_speed < 1) {
+                    printf("%s: simulation speed is invalid - %s\n", __func__, argv[i]);
+                    return -1;
+                }
+                continue;
+            }
+            if (0 == strcmp(argv[i], "--sim-replay")) {
+                size_t size;
+
+                i++;
+                size = strlen(argv[i]);
+                if (size >= MAX_FILENAME_LENGTH) {
+                    log_error("%s replay name too long %zu\n", __func__, size);
+                    return -1;
+                }
+                memcpy(max86150->sim_replay, argv[i], size);
+                max86150->sim_replay[size] = 0;
+                continue;
+            }
+#endif
+            if (0 == strcmp(argv[i], "--set-fifo-a-full")) {
+                max86150->fifo_a_full_samples = atoi(argv[++i]);
+                continue;
+            }
+            if (0 == strcmp(argv[i], "--fifo-rollover")) {
+                max86150->fifo_rollover = 1;
+                continue;
+            }
+            if (0 == strcmp(argv[i], "--set-ring-slots")) {
+                max86150->ring_slots = atoi(argv[++i]);
+                if (max86150->ring_slots <= 0) {
+                    printf("%s: ring size is invalid - %s\n", __func__, argv[i]);
+                    return -1;
+                }
+                continue;
+            }
+            if (0 == strcmp(argv[i], "--capture-backend")) {
+                i++;
+                if (0 == strcmp(argv[i], "writev")) {
+                    max86150->capture_backend = CAPTURE_BACKEND_WRITEV;
+                } else if (0 == strcmp(argv[i], "io_uring")) {
+                    max86150->capture_backend = CAPTURE_BACKEND_IO_URING;
+                } else if (0 == strcmp(argv[i], "mmap")) {
+                    max86150->capture_backend = CAPTURE_BACKEND_MMAP;
+                } else if (0 == strcmp(argv[i], "auto")) {
+                    max86150->capture_backend = CAPTURE_BACKEND_AUTO;
+                } else {
+                    printf("%s: unknown capture backend - %s\n", __func__, argv[i]);
+                    return -1;
+                }
+                continue;
+            }
+            if (0 == strcmp(argv[i], "--set-flush-size")) {
+                max86150->capture_flush_bytes = atoi(argv[++i]) * 1024;
+                if (!max86150->capture_flush_bytes) {
+                    printf("%s: flush size is invalid - %s\n", __func__, argv[i]);
+                    return -1;
+                }
+                continue;
+            }
+            if (0 == strcmp(argv[i], "--set-flush-latency")) {
+                max86150->capture_flush_latency_ms = atoi(argv[++i]);
+                if (!max86150->capture_flush_latency_ms) {
+                    printf("%s: flush latency is invalid - %s\n", __func__, argv[i]);
+                    return -1;
+                }
+                continue;
+            }
+            if (0 == strcmp(argv[i], "--set-expected-duration")) {
+                max86150->capture_duration_s = atoi(argv[++i]);
+                continue;
+            }
+            if (0 == strcmp(argv[i], "--set-chunk-size")) {
+                max86150->capture_chunk_size = atoi(argv[++i]);
+                if (max86150->capture_chunk_size < CAPTURE_CHUNK_SIZE_MIN) {
+                    printf("%s: chunk size is invalid - %s\n", __func__, argv[i]);
+                    return -1;
+                }
+                continue;
+            }
+            if (0 == strcmp(argv[i], "--packed")) {
+                max86150->capture_encoding = CAPTURE_ENCODING_PACKED;
+                continue;
+            }
+            if (0 == strcmp(argv[i], "--compress")) {
+                max86150->capture_encoding = CAPTURE_ENCODING_RICE;
+                continue;
+            }
             if (0 == strcmp(argv[i], "--capture_file_name")) {
                 size_t size;
 
                 i++;
                 size = strlen(argv[i]);
                 if (size >= MAX_FILENAME_LENGTH) {
-                    d_print("%s file name too long %d\n", __func__, size);
+                    log_error("%s file name too long %zu\n", __func__, size);
                     return -1;
                 }
                 memcpy(max86150->capture_file_name, argv[i], size);
@@ -308,6 +767,12 @@ static int validate_input(int argc, char **argv, struct max86150_configuration *
         }
     }
 
+    /* Live changes recompute registers from the sample rate */
+    if ((max86150->sim_speed > 1) && max86150->control_path[0]) {
+        printf("%s: --control cannot be used with --sim-speed\n", __func__);
+        return -1;
+    }
+
     return 0;
 }
 
@@ -324,6 +789,34 @@ static void set_default_max86150_values(struct max86150_configuration *max86150)
     max86150->ecg_adc_clk_osr               = 0;
     max86150->ecg_pga_gain                  = 2;
     max86150->ecg_ia_gain                   = 10;
+    max86150->fifo_read_mode                = FIFO_READ_BURST;
+    max86150->event_source                  = EVENT_SOURCE_TIMER;
+    max86150->adaptive_poll                 = 0;
+    max86150->realtime                      = 0;
+    max86150->rt_priority                   = REALTIME_PRIORITY_DEFAULT;
+    max86150->rt_cpu                        = -1;
+    max86150->interrupt_data_ready          = 0;
+    max86150->gpio_line                     = MAX86150_GPIO_LINE_DEFAULT;
+    max86150->control_path[0]               = 0;
+    max86150->sim_bus_latency_us            = 0;
+    max86150->sim_bus_error_ppm             = 0;
+    max86150->sim_clock_ppm                 = 0;
+    max86150->sim_speed                     = 1;
+    max86150->sim_replay[0]                 = 0;
+    max86150->stats_path[0]                 = 0;
+    max86150->fifo_a_full_samples           = 0;
+    max86150->fifo_rollover                 = 0;
+    max86150->ring_slots                    = CAPTURE_RING_SLOTS_DEFAULT;
+    max86150->capture_backend               = CAPTURE_BACKEND_AUTO;
+    max86150->capture_flush_bytes           = CAPTURE_FLUSH_BYTES_DEFAULT;
+    max86150->capture_flush_latency_ms      = CAPTURE_FLUSH_LATENCY_DEFAULT;
+    max86150->capture_duration_s            = CAPTURE_DURATION_DEFAULT;
+    max86150->capture_chunk_size            = CAPTURE_CHUNK_SIZE_DEFAULT;
+    max86150->capture_encoding              = CAPTURE_ENCODING_U32;
+    max86150->config_changed_ns             = 0;
+
+    memcpy(max86150->gpio_chip_name, MAX86150_GPIO_CHIP_DEFAULT, strlen(MAX86150_GPIO_CHIP_DEFAULT));
+    max86150->gpio_chip_name[strlen(MAX86150_GPIO_CHIP_DEFAULT)] = 0;
 
     memcpy(max86150->capture_file_name, DEFAULT_BINARY_NAME, strlen(DEFAULT_BINARY_NAME));
     max86150->capture_file_name[strlen(DEFAULT_BINARY_NAME)] = 0;
@@ -355,5 +848,90 @@ static void print_usage(char **argv) {
     printf("\t--set-ecg-pga-gain\t\t-\tSet ECG PGA gain [1, 2(default), 4, 8]\n");
     printf("\t--set-ecg-ia-gain\t\t-\tSet ECG IA gain [5, 9/10(default), 20, 50]\n");
     printf("\t\t\t\t\t\tIA Gain 9/10 is 9.5. Both 9 or 10 can be used to set this value\n");
+    printf("\t--per-sample-read\t\t-\tRead FIFO with one I2C transaction per sample instead of one per batch\n");
+    printf("\t--combined-read\t\t\t-\tRead FIFO pointers and speculative batch in one I2C transaction\n");
+    printf("\t--adaptive-poll\t\t\t-\tStretch timer interval to FIFO fill level, for least wakeups\n");
+    printf("\t--realtime\t\t\t-\tSCHED_FIFO, pinned CPU and locked memory for acquisition thread\n");
+    printf("\t--rt-priority\t\t\t-\tSCHED_FIFO priority [1..99]. Default %d\n", REALTIME_PRIORITY_DEFAULT);
+    printf("\t--rt-cpu\t\t\t-\tCPU acquisition thread is pinned to. Default last one\n");
+    printf("\t--interrupt\t\t\t-\tWake up on INT pin A_FULL events instead of timer\n");
+    printf("\t--interrupt-data-ready\t\t-\tAlso wake up on PPG_RDY/ECG_RDY events\n");
+    printf("\t--gpio-chip\t\t\t-\tGPIO chip with INT line. Default %s\n", MAX86150_GPIO_CHIP_DEFAULT);
+    printf("\t--gpio-line\t\t\t-\tINT line offset in GPIO chip. Default %d (GPIOG11)\n", MAX86150_GPIO_LINE_DEFAULT);
+    printf("\t--control\t\t\t-\tNamed pipe for live changes of LED amplitudes, PPG range and averaging, ECG gains\n");
+    printf("\t--stats\t\t\t\t-\tAppend one line summary of the run to file, see README\n");
+#ifdef MAX86150_SIM
+    printf("\t--sim-bus-latency\t\t-\tExtra time in us every I2C transfer takes. Default 0\n");
+    printf("\t--sim-bus-errors\t\t-\tFailed I2C transfers per million. Default 0\n");
+    printf("\t--sim-drift\t\t\t-\tDevice clock error in ppm. Default 0\n");
+    printf("\t--sim-speed\t\t\t-\tRun device and acquisition N times faster than real time. Default 1\n");
+    printf("\t--sim-replay\t\t\t-\tReplay PREFIX_ppg1.raw, PREFIX_ppg2.raw, PREFIX_ecg.raw from max86150_dump -f raw\n");
+#endif
+    printf("\t--set-fifo-a-full\t\t-\tSamples in FIFO raising A_FULL [17..32]. Default derived from rate\n");
+    printf("\t--fifo-rollover\t\t\t-\tOverwrite oldest samples when FIFO is full instead of dropping new ones\n");
+    printf("\t--set-ring-slots\t\t-\tFIFO batches buffered between reader and writer. Default %d\n", CAPTURE_RING_SLOTS_DEFAULT);
+    printf("\t--capture-backend\t\t-\tCapture file writes [auto(default), writev, io_uring, mmap]\n");
+    printf("\t--set-flush-size\t\t-\tCapture file flush size in KiB. Default %d\n", CAPTURE_FLUSH_BYTES_DEFAULT / 1024);
+    printf("\t--set-flush-latency\t\t-\tMax time in ms data waits before flush. Default %d\n", CAPTURE_FLUSH_LATENCY_DEFAULT);
+    printf("\t--set-expected-duration\t\t-\tRecording length in s to preallocate for mmap backend. Default %d\n", CAPTURE_DURATION_DEFAULT);
+    printf("\t--set-chunk-size\t\t-\tCapture file chunk size in bytes. Default %d\n", CAPTURE_CHUNK_SIZE_DEFAULT);
+    printf("\t--packed\t\t\t-\tStore samples at native 18/19-bit width instead of 32-bit words\n");
+    printf("\t--compress\t\t\t-\tStore samples losslessly compressed (linear prediction, Rice coding)\n");
     printf("\tNote: \"-f200\" is invalid value. Please, separate flags and values\n");
 }
+
+static void adapt_poll_period(struct poll_control *poll_control, int fifo_level) {
+    if (!poll_control_update(poll_control, fifo_level)) return;
+
+    log_info("%s: fill %.1f +- %.1f of %d, interval %.2f ms\n", __func__,
+             poll_control->level_mean, poll_control->level_dev, poll_control->limit,
+             poll_control->period_ns / 1e6);
+    set_max86150_timer_period(poll_control_period_ns(poll_control));
+}
+
+/* Lost samples still take sample numbers, so the following ones keep
+ * their place in time */
+static void add_lost_samples(uint64_t *lost_pending, uint32_t *lost_flags, uint64_t *samples_total,
+                             uint32_t count, uint32_t flags) {
+    *lost_pending  += count;
+    *lost_flags    |= flags;
+    *samples_total += count;
+}
+
+/* SIGUSR1: stage latencies so far, acquisition goes on */
+static void latency_snapshot() {
+    latency_report("snapshot");
+}
+
+/* One line of key=value pairs per run, appended, for benchmarks. Rate is
+ * the configured one, times are from recording start to the last drain */
+static void write_run_stats(struct max86150_configuration *max86150, uint64_t wall_ns,
+                            const struct rusage *usage_start, uint64_t samples, uint64_t lost,
+                            uint32_t overflows, uint32_t ring_full, uint32_t drains,
+                            uint32_t i2c_transfers, uint32_t bus_bytes) {
+    struct capture_writer_stats writer_stats;
+    struct rusage usage;
+    FILE *file;
+
+    getrusage(RUSAGE_SELF, &usage);
+    capture_get_writer_stats(&writer_stats);
+
+    file = fopen(max86150->stats_path, "a");
+    if (!file) {
+        log_error("%s: cannot open %s - %s\n", __func__, max86150->stats_path, strerror(errno));
+        return;
+    }
+    fprintf(file, "rate_hz=%u signals=0x%02x speed=%d wall_s=%.3f cpu_user_s=%.3f cpu_sys_s=%.3f "
+            "samples=%llu lost=%llu overflows=%u ring_full=%u drains=%u i2c_transfers=%u bus_bytes=%u "
+            "writer_syscalls=%u loop_syscalls=%llu bytes_written=%llu\n",
+            max86150->sampling_frequency / max86150->sim_speed, max86150->allowed_signals,
+            max86150->sim_speed, wall_ns / 1e9,
+            (usage.ru_utime.tv_sec - usage_start->ru_utime.tv_sec) +
+            (usage.ru_utime.tv_usec - usage_start->ru_utime.tv_usec) / 1e6,
+            (usage.ru_stime.tv_sec - usage_start->ru_stime.tv_sec) +
+            (usage.ru_stime.tv_usec - usage_start->ru_stime.tv_usec) / 1e6,
+            (unsigned long long)samples, (unsigned long long)lost, overflows, ring_full, drains,
+            i2c_transfers, bus_bytes, writer_stats.syscalls,
+            (unsigned long long)get_event_loop_syscalls(), (unsigned long long)writer_stats.bytes);
+    fclose(file);
+}
@@ -17,15 +17,15 @@
  */
 
 #include <stdint.h>
-#include <sys/ioctl.h>
-#include <linux/i2c-dev.h>
+#include <string.h>
+#include <errno.h>
 #include <linux/i2c.h>
 #include <peripheral.h>
 #include <signalwork.h>
 #include <filework.h>
 #include <max86150_defs.h>
-#include <wiringPi.h>
-#include <wiringPiI2C.h>
+#include <latency.h>
+#include <transport.h>
 
 
 #define UNUSED(x) ((void)x)
@@ -34,10 +34,35 @@
 #define I2C0_WPI_SCL_PIN (9)
 #define I2C0_WPI_INT_PIN (7)
 
-static int max86150_fd;
+#define RESET_TIMEOUT_NS (50 * 1000000ULL)
+
+#define IMAGE_RUNS    (5)
+#define IMAGE_RUN_MAX (5)
+
+struct image_run {
+    uint8_t first;
+    uint8_t count;
+};
+
+/* Configured registers as runs of adjacent ones, reserved 0x0B-0x0C, 0x13
+ * and 0x3D are skipped. PROX_INT_TH only joins PPG_CFG2 and LED1_PA */
+static const struct image_run image_runs[IMAGE_RUNS] = {
+    { MAX86150_REG_FIFO_CONF, 3 }, /* FIFO_CONF, FIFO_DCR1, FIFO_DCR2             */
+    { MAX86150_REG_PPG_CFG1,  5 }, /* PPG_CFG1, PPG_CFG2, PROX_INT_TH, LED1/2_PA  */
+    { MAX86150_REG_LED_RANGE, 1 },
+    { MAX86150_REG_ECG_CFG1,  1 },
+    { MAX86150_REG_ECG_CFG3,  1 },
+};
+
+#ifdef MAX86150_SIM
+static const struct max86150_transport *transport = &sim_transport;
+#else
+static const struct max86150_transport *transport = &i2c_transport;
+#endif
+static struct max86150_register_image shadow; /* what device registers hold */
+static int shadow_valid;                      /* 0 - unknown after failed write */
 
 static dcr_slot set_dcr_slot(uint16_t sig);
-static int init_i2c0_for_max86150();
 static int check_sampling_frequency(struct max86150_configuration *max86150);
 static int ppg_check_pulses_per_sample(struct max86150_configuration *max86150);
 static int ppg_convert_freq_to_register_value(struct max86150_configuration *max86150);
@@ -47,30 +72,32 @@ static int ppg_set_smp_ave(struct max86150_configuration *max86150);
 static int ppg_set_leds_range(struct max86150_configuration *max86150);
 static int ecg_set_sampling_rate(struct max86150_configuration *max86150);
 static int ecg_set_gains(struct max86150_configuration *max86150);
+static int fifo_set_a_full(struct max86150_configuration *max86150, int enabled_signals);
+static int build_register_image(struct max86150_configuration *max86150, struct max86150_register_image *image);
+static int write_register_image(const struct max86150_register_image *image);
+static int read_register_image(struct max86150_register_image *image);
+static int verify_register_image(const struct max86150_register_image *image);
+static int write_register_delta(const struct max86150_register_image *image);
+static void refresh_register_shadow(void);
 
 
-int init_gpio() {
+int init_gpio(struct max86150_configuration *max86150) {
     uint8_t reg_rd_buf = 0;
 
-    if (wiringPiSetup()) {
-        d_print("%s: wiringPiSetup() failed\n", __func__);
+    if (transport->open(max86150)) {
+        log_error("%s: cannot open %s transport\n", __func__, transport->name);
         return -1;
     }
 
-    if (init_i2c0_for_max86150()) {
-        d_print("%s: init_i2c0_for_max86150() failed\n", __func__);
-        return -1;
-    }
-
-    d_print("%s: max86150_fd = %d\n", __func__, max86150_fd);
+    log_info("%s: MAX86150 on %s transport\n", __func__, transport->name);
 
     piLock(0);
     if (read_max86150_register(MAX86150_REG_PART_ID, &reg_rd_buf, 1)) {
-        d_print("%s: read unsuccessful\n", __func__);
+        log_error("%s: read unsuccessful\n", __func__);
     }
     if (MAX86150_PART_ID != reg_rd_buf) {
-        d_print("%s: MAX86150 Part ID is 0x%02x. Must be 0x%02x\n",
-                __func__, reg_rd_buf, MAX86150_PART_ID);
+        log_error("%s: MAX86150 Part ID is 0x%02x. Must be 0x%02x\n",
+                  __func__, reg_rd_buf, MAX86150_PART_ID);
         piUnlock(0);
         return -1;
     }
@@ -80,36 +107,35 @@ int init_gpio() {
 }
 
 void deinit_gpio() {
-    if (max86150_fd) close(max86150_fd);
+    transport->close();
 }
 
 int init_max86150(struct max86150_configuration *max86150) {
-    int i;
-    int enabled_signals = 0;
-    uint8_t reg_write_data;
-
-    d_print("%s: freq = %u, sig = 0x%02x - ppg1(%c) ppg2(%c) pilot1(%c) pilot2(%c) ecg(%c)\n",
-            __func__,
-            max86150->sampling_frequency,
-            max86150->allowed_signals,
-            (max86150->allowed_signals & ppg1) ? 'T': 'F',
-            (max86150->allowed_signals & ppg2) ? 'T': 'F',
-            (max86150->allowed_signals & pilot1) ? 'T': 'F',
-            (max86150->allowed_signals & pilot2) ? 'T': 'F',
-            (max86150->allowed_signals & ecg) ? 'T': 'F');
+    struct max86150_register_image image;
+    uint64_t start_ns, reset_ns, written_ns, verified_ns;
+
+    log_info("%s: freq = %u, sig = 0x%02x - ppg1(%c) ppg2(%c) pilot1(%c) pilot2(%c) ecg(%c)\n",
+             __func__,
+             max86150->sampling_frequency,
+             max86150->allowed_signals,
+             (max86150->allowed_signals & ppg1) ? 'T': 'F',
+             (max86150->allowed_signals & ppg2) ? 'T': 'F',
+             (max86150->allowed_signals & pilot1) ? 'T': 'F',
+             (max86150->allowed_signals & pilot2) ? 'T': 'F',
+             (max86150->allowed_signals & ecg) ? 'T': 'F');
 
     if (!max86150->allowed_signals) {
-        d_print("%s: no signal enabled\n", __func__);
+        log_error("%s: no signal enabled\n", __func__);
         return -1;
     }
 
     if (max86150->allowed_signals == PPG_SIGNALS_ALLOW_EVERY_SIGNAL) {
-        d_print("%s: cannot allow every signal\n", __func__);
+        log_error("%s: cannot allow every signal\n", __func__);
         return -1;
     }
 
     if (max86150->allowed_signals & (pilot1 | pilot2)) {
-        d_print("%s: pilot signals currently not supported\n", __func__);
+        log_error("%s: pilot signals currently not supported\n", __func__);
         return -1;
     }
 
@@ -117,217 +143,413 @@ int init_max86150(struct max86150_configuration *max86150) {
     if (max86150->allowed_signals & ppg2) max86150->number_of_bytes_per_fifo_read += 3;
     if (max86150->allowed_signals & ecg)  max86150->number_of_bytes_per_fifo_read += 3;
 
-    d_print("%s: Bytes per FIFO read: %d\n", __func__, max86150->number_of_bytes_per_fifo_read);
+    log_debug("%s: Bytes per FIFO read: %d\n", __func__, max86150->number_of_bytes_per_fifo_read);
 
     if (check_sampling_frequency(max86150)) {
-        d_print("%s: wrong baudrate\n", __func__);
+        log_error("%s: wrong baudrate\n", __func__);
         return -1;
     }
 
+    /* Whole configuration is worked out before the device is touched */
+    if (build_register_image(max86150, &image)) return -1;
+
     piLock(0);
+    start_ns = latency_now_ns();
     if (reset_device()) {
-        d_print("%s: cannot reset device\n", __func__);
+        log_error("%s: cannot reset device\n", __func__);
+        piUnlock(0);
+        return -1;
+    }
+    reset_ns = latency_now_ns();
+    if (write_register_image(&image)) {
+        log_error("%s: write unsuccessful\n", __func__);
+        piUnlock(0);
+        return -1;
+    }
+    written_ns = latency_now_ns();
+    memcpy(&shadow, &image, sizeof(shadow));
+    shadow_valid = 1;
+    if (verify_register_image(&image)) {
+        log_error("%s: register readback does not match configuration\n", __func__);
         piUnlock(0);
         return -1;
     }
+    verified_ns = latency_now_ns();
     piUnlock(0);
 
-    /* Form data for MAX86150_REG_PPG_CFG1 */
-    reg_write_data = 0;
-    if (max86150->allowed_signals & (ppg1 | ppg2)) {
-        int tempret = 0;
-        tempret += ppg_set_range(max86150);
-        tempret += ppg_convert_freq_to_register_value(max86150);
-        tempret += ppg_check_pulses_per_sample(max86150);
-        tempret += ppg_set_led_pw(max86150);
-        if (tempret) {
-            d_print("%s: wrong data for MAX86150_REG_PPG_CFG1 register\n", __func__);
+    log_info("%s: configured in %llu us: reset %llu us, register image write %llu us, readback %llu us\n",
+             __func__, (unsigned long long)(verified_ns - start_ns) / 1000,
+             (unsigned long long)(reset_ns - start_ns) / 1000, (unsigned long long)(written_ns - reset_ns) / 1000,
+             (unsigned long long)(verified_ns - written_ns) / 1000);
+
+    return 0;
+}
+
+
+/* Live change between FIFO drains: only registers that differ from the
+ * shadow are written, in one I2C transfer. On error configuration is
+ * left as it was: a transfer may have failed after some of its messages,
+ * so registers are read back and the previous image is written again.
+ * Successful change sets config_changed_ns, for capture stream */
+int reconfigure_max86150(struct max86150_configuration *max86150, const struct max86150_live_settings *settings) {
+    struct max86150_configuration next = *max86150;
+    struct max86150_register_image image;
+    uint64_t start_ns, changed_ns;
+    int changed, restored;
+
+    if (settings->ppg_adc_scale)      next.ppg_adc_scale      = settings->ppg_adc_scale;
+    if (settings->ppg_sample_average) next.ppg_sample_average = settings->ppg_sample_average;
+    if (settings->ppg_led1_amplitude) next.ppg_led1_amplitude = settings->ppg_led1_amplitude;
+    if (settings->ppg_led2_amplitude) next.ppg_led2_amplitude = settings->ppg_led2_amplitude;
+    if (settings->ecg_pga_gain)       next.ecg_pga_gain       = settings->ecg_pga_gain;
+    if (settings->ecg_ia_gain)        next.ecg_ia_gain        = settings->ecg_ia_gain;
+
+    if (build_register_image(&next, &image)) return -1;
+
+    piLock(0);
+    start_ns = latency_now_ns();
+    changed = write_register_delta(&image);
+    changed_ns = latency_now_ns();
+    if (changed < 0) {
+        refresh_register_shadow();
+        restored = build_register_image(max86150, &image) ? -1 : write_register_delta(&image);
+        if (restored < 0) {
+            log_error("%s: previous configuration not restored, registers may hold part of the change\n",
+                      __func__);
+        } else {
+            log_info("%s: %d registers restored after failed change\n", __func__, restored);
+        }
+    }
+    piUnlock(0);
+    if (changed < 0) return -1;
+
+    *max86150 = next;
+    if (changed) {
+        max86150->config_changed_ns = changed_ns;
+    }
+    log_info("%s: %d registers changed in %llu us\n", __func__, changed,
+             (unsigned long long)(latency_now_ns() - start_ns) / 1000);
+
+    return 0;
+}
+
+/* Conversions start here, not in init_max86150(), so buffers, writer and
+ * realtime setup done in between cannot overflow FIFO. FIFO is empty
+ * since reset, event source is armed right after the first conversion */
+int start_recording(struct max86150_configuration *max86150) {
+    if (max86150->event_source == EVENT_SOURCE_GPIO) {
+        if (enable_max86150_interrupts(max86150)) {
+            log_error("%s: cannot enable interrupts\n", __func__);
             return -1;
         }
-        reg_write_data |= ((max86150->ppg_range_reg << MAX86150_SHIFT_PPG_ADC_RGE) & MAX86150_BIT_PPG_ADC_RGE);
-        reg_write_data |= ((max86150->ppg_sampling_reg << MAX86150_SHIFT_PPG_SR) & MAX86150_BIT_PPG_SR);
-        reg_write_data |= ((max86150->ppg_width_reg << MAX86150_SHIFT_PPG_LED_PW) & MAX86150_BIT_PPG_LED_PW);
     }
+
     piLock(0);
-    if (write_max86150_register(MAX86150_REG_PPG_CFG1, reg_write_data)) {
+    if (write_max86150_register(MAX86150_REG_SYS_CTL, MAX86150_BIT_FIFO_EN)) {
+        log_error("%s: cannot start conversions\n", __func__);
         piUnlock(0);
-        d_print("%s: write unsuccessful\n", __func__);
         return -1;
     }
     piUnlock(0);
 
-    /* Form data for MAX86150_REG_PPG_CFG2 */
-    reg_write_data = 0;
-    if (max86150->allowed_signals & (ppg1 | ppg2)) {
-        if (ppg_set_smp_ave(max86150)) {
-            d_print("%s: wrong data for MAX86150_REG_PPG_CFG2 register\n", __func__);
-            return -1;
-        }
-        reg_write_data = max86150->ppg_smp_avg_reg & MAX86150_BIT_SMP_AVE;
+    if (start_max86150_events(max86150)) {
+        log_error("%s: cannot start event source\n", __func__);
+        return -1;
     }
+    return 0;
+}
+
+/* Power save mode ends conversions, registers and FIFO stay readable,
+ * so samples already in FIFO can still be drained */
+int stop_conversions() {
+    int retval = 0;
+
     piLock(0);
-    if (write_max86150_register(MAX86150_REG_PPG_CFG2, reg_write_data)) {
+    if (write_max86150_register(MAX86150_REG_SYS_CTL, MAX86150_BIT_FIFO_EN | MAX86150_BIT_SHDN)) {
+        log_error("%s: cannot enter power save mode\n", __func__);
+        retval = -1;
+    }
+    piUnlock(0);
+
+    return retval;
+}
+
+int stop_recording() {
+    piLock(0);
+    if(write_max86150_register(MAX86150_REG_SYS_CTL, 0)) {
+        log_error("%s: cannot stop capturing\n", __func__);
+    }
+    if(write_max86150_register(MAX86150_REG_IE1, 0)) {
+        log_error("%s: cannot disable interrupts\n", __func__);
+    }
+    if(write_max86150_register(MAX86150_REG_IE2, 0)) {
+        log_error("%s: cannot disable interrupts\n", __func__);
+    }
+    if(write_max86150_register(MAX86150_REG_FIFO_DCR1, 0)) {
+        log_error("%s: cannot stop capturing\n", __func__);
+    }
+    if(write_max86150_register(MAX86150_REG_FIFO_DCR2, 0)) {
+        log_error("%s: cannot stop capturing\n", __func__);
+    }
+    piUnlock(0);
+
+    if (stop_max86150_events()) {
+        log_error("%s: cannot stop event source\n", __func__);
+        return -1;
+    }
+
+    return 0;
+}
+
+/* INT pin is asserted on A_FULL (threshold is set by init_max86150()), and
+ * on every new sample if data ready interrupts were asked for.
+ * Pending status is cleared before first wait */
+int enable_max86150_interrupts(struct max86150_configuration *max86150) {
+    uint8_t ie1 = MAX86150_BIT_A_FULL_EN;
+    uint8_t ie2 = 0;
+    uint8_t status[2];
+
+    if (max86150->interrupt_data_ready) {
+        if (max86150->allowed_signals & (ppg1 | ppg2)) ie1 |= MAX86150_BIT_PPG_RDY_EN;
+        if (max86150->allowed_signals & ecg)           ie2 |= MAX86150_BIT_ECG_RDY_EN;
+    }
+
+    piLock(0);
+    if (write_max86150_register(MAX86150_REG_IE1, ie1)) {
+        piUnlock(0);
+        return -1;
+    }
+    if (write_max86150_register(MAX86150_REG_IE2, ie2)) {
+        piUnlock(0);
+        return -1;
+    }
+    if (read_max86150_register(MAX86150_REG_IS1, status, 2)) {
         piUnlock(0);
-        d_print("%s: write unsuccessful\n", __func__);
         return -1;
     }
     piUnlock(0);
 
-    /* Form data for MAX86150_REG_LED1_PA */
-    /* Form data for MAX86150_REG_LED2_PA */
-    /* Form data for MAX86150_REG_LED_RANGE */
-    reg_write_data = 0;
+    return 0;
+}
+
+
+/* Works out every configured register from max86150. Registers of signals
+ * that are not enabled keep their reset value 0 */
+static int build_register_image(struct max86150_configuration *max86150, struct max86150_register_image *image) {
+    uint8_t *value = image->value;
+    int i;
+    int enabled_signals = 0;
+
+    memset(image, 0, sizeof(*image));
+
     if (max86150->allowed_signals & (ppg1 | ppg2)) {
-        if (ppg_set_leds_range(max86150)) {
-            d_print("%s: cannot set LED current range - %d/%d\n",
-                    __func__, max86150->ppg_led1_amplitude, max86150->ppg_led2_amplitude);
-            return -1;
-        }
-        reg_write_data |= ((max86150->ppg_led1_amplitude_range << MAX86150_SHIFT_LED1_RGE) & MAX86150_BIT_LED1_RGE);
-        piLock(0);
-        if (write_max86150_register(MAX86150_REG_LED1_PA, max86150->ppg_led1_amplitude_reg)) {
-            piUnlock(0);
-            d_print("%s: write unsuccessful\n", __func__);
+        int tempret = 0;
+        tempret += ppg_set_range(max86150);
+        tempret += ppg_convert_freq_to_register_value(max86150);
+        tempret += ppg_check_pulses_per_sample(max86150);
+        tempret += ppg_set_led_pw(max86150);
+        if (tempret) {
+            log_error("%s: wrong data for MAX86150_REG_PPG_CFG1 register\n", __func__);
             return -1;
         }
-        reg_write_data |= ((max86150->ppg_led2_amplitude_range << MAX86150_SHIFT_LED2_RGE) & MAX86150_BIT_LED2_RGE);
-        if (write_max86150_register(MAX86150_REG_LED2_PA, max86150->ppg_led2_amplitude_reg)) {
-            piUnlock(0);
-            d_print("%s: write unsuccessful\n", __func__);
+        value[MAX86150_REG_PPG_CFG1] |= ((max86150->ppg_range_reg << MAX86150_SHIFT_PPG_ADC_RGE) & MAX86150_BIT_PPG_ADC_RGE);
+        value[MAX86150_REG_PPG_CFG1] |= ((max86150->ppg_sampling_reg << MAX86150_SHIFT_PPG_SR) & MAX86150_BIT_PPG_SR);
+        value[MAX86150_REG_PPG_CFG1] |= ((max86150->ppg_width_reg << MAX86150_SHIFT_PPG_LED_PW) & MAX86150_BIT_PPG_LED_PW);
+
+        if (ppg_set_smp_ave(max86150)) {
+            log_error("%s: wrong data for MAX86150_REG_PPG_CFG2 register\n", __func__);
             return -1;
         }
-        if (write_max86150_register(MAX86150_REG_LED_RANGE, reg_write_data)) {
-            piUnlock(0);
-            d_print("%s: write unsuccessful\n", __func__);
+        value[MAX86150_REG_PPG_CFG2] = max86150->ppg_smp_avg_reg & MAX86150_BIT_SMP_AVE;
+
+        if (ppg_set_leds_range(max86150)) {
+            log_error("%s: cannot set LED current range - %d/%d\n",
+                      __func__, max86150->ppg_led1_amplitude, max86150->ppg_led2_amplitude);
             return -1;
         }
-        piUnlock(0);
+        value[MAX86150_REG_LED1_PA]    = max86150->ppg_led1_amplitude_reg;
+        value[MAX86150_REG_LED2_PA]    = max86150->ppg_led2_amplitude_reg;
+        value[MAX86150_REG_LED_RANGE] |= ((max86150->ppg_led1_amplitude_range << MAX86150_SHIFT_LED1_RGE) & MAX86150_BIT_LED1_RGE);
+        value[MAX86150_REG_LED_RANGE] |= ((max86150->ppg_led2_amplitude_range << MAX86150_SHIFT_LED2_RGE) & MAX86150_BIT_LED2_RGE);
     }
 
-    /* Form data for MAX86150_REG_ECG_CFG1 */
-    reg_write_data = 0;
     if (max86150->allowed_signals & ecg) {
         if (ecg_set_sampling_rate(max86150)) {
-            d_print("%s: incorrect sampling rate - %d\n", __func__, max86150->sampling_frequency);
+            log_error("%s: incorrect sampling rate - %d\n", __func__, max86150->sampling_frequency);
             return -1;
         }
-        reg_write_data |= (max86150->ecg_adc_clk_osr_reg) & MAX86150_MASK_ECG_ADC_CLK;
-    }
-    piLock(0);
-    if (write_max86150_register(MAX86150_REG_ECG_CFG1, reg_write_data)) {
-        piUnlock(0);
-        d_print("%s: write unsuccessful\n", __func__);
-        return -1;
-    }
-    piUnlock(0);
+        value[MAX86150_REG_ECG_CFG1] |= (max86150->ecg_adc_clk_osr_reg) & MAX86150_MASK_ECG_ADC_CLK;
 
-    /* Form data for MAX86150_REG_ECG_CFG3 */
-    reg_write_data = 0;
-    if (max86150->allowed_signals & ecg) {
         if (ecg_set_gains(max86150)) {
-            d_print("%s: incorrect gain - PGA %d; IA %d\n",
-                    __func__, max86150->ecg_pga_gain, max86150->ecg_ia_gain);
+            log_error("%s: incorrect gain - PGA %d; IA %d\n",
+                      __func__, max86150->ecg_pga_gain, max86150->ecg_ia_gain);
             return -1;
         }
-        reg_write_data |= (((max86150->ecg_pga_gain_reg) & MAX86150_MASK_PGA_IA_GAIN) << MAX86150_SHIFT_PGA_GAIN);
-        reg_write_data |= (((max86150->ecg_ia_gain_reg) & MAX86150_MASK_PGA_IA_GAIN) << MAX86150_SHIFT_IA_GAIN);
-    }
-    piLock(0);
-    if (write_max86150_register(MAX86150_REG_ECG_CFG3, reg_write_data)) {
-        piUnlock(0);
-        d_print("%s: write unsuccessful\n", __func__);
-        return -1;
+        value[MAX86150_REG_ECG_CFG3] |= (((max86150->ecg_pga_gain_reg) & MAX86150_MASK_PGA_IA_GAIN) << MAX86150_SHIFT_PGA_GAIN);
+        value[MAX86150_REG_ECG_CFG3] |= (((max86150->ecg_ia_gain_reg) & MAX86150_MASK_PGA_IA_GAIN) << MAX86150_SHIFT_IA_GAIN);
     }
-    piUnlock(0);
 
-    /* Form data for MAX86150_REG_FIFO_DCR1 */
-    reg_write_data = 0;
-    enabled_signals = 0;
+    /* FIFO slots 1, 2 go to DCR1, slots 3, 4 to DCR2 */
     for (i = 0; i < TOTAL_SIGNALS; i++) {
-        if ((1 << i) & max86150->allowed_signals) {
-            enabled_signals++;
-        }
-        if (enabled_signals == 1) {
-            reg_write_data |= set_dcr_slot((1 << i) & max86150->allowed_signals);
-        } else if (enabled_signals == 2) {
-            reg_write_data |= (set_dcr_slot((1 << i) & max86150->allowed_signals) << 4);
-            break;
+        uint16_t sig = (1 << i) & max86150->allowed_signals;
+
+        if (!sig) continue;
+        if (enabled_signals < 2) {
+            value[MAX86150_REG_FIFO_DCR1] |= set_dcr_slot(sig) << (4 * enabled_signals);
+        } else {
+            value[MAX86150_REG_FIFO_DCR2] |= set_dcr_slot(sig) << (4 * (enabled_signals - 2));
         }
+        enabled_signals++;
     }
-    piLock(0);
-    if (write_max86150_register(MAX86150_REG_FIFO_DCR1, reg_write_data)) {
-        piUnlock(0);
-        d_print("%s: write unsuccessful\n", __func__);
+
+    if (fifo_set_a_full(max86150, max86150->number_of_bytes_per_fifo_read / BYTES_PER_FIFO_READ)) {
+        log_error("%s: incorrect FIFO almost full value - %d\n", __func__, max86150->fifo_a_full_samples);
         return -1;
     }
-    piUnlock(0);
+    /* A_FULL is cleared by FIFO data read, no extra status read needed */
+    value[MAX86150_REG_FIFO_CONF] = MAX86150_BIT_A_FULL_CLR;
+    value[MAX86150_REG_FIFO_CONF] |= (MAX86150_FIFO_DEPTH - max86150->fifo_a_full_samples) & MAX86150_BIT_FIFO_A_FULL;
+    if (max86150->fifo_rollover) value[MAX86150_REG_FIFO_CONF] |= MAX86150_BIT_FIFO_ROLLS_ON_FULL;
 
-    /* Form data for MAX86150_REG_FIFO_DCR2 */
-    reg_write_data = 0;
-    for (++i; i < TOTAL_SIGNALS; i++) {
-        if ((1 << i) & max86150->allowed_signals) {
-            enabled_signals++;
-        }
-        if (enabled_signals == 3) {
-            reg_write_data |= set_dcr_slot((1 << i) & max86150->allowed_signals);
-        } else if (enabled_signals == 4) {
-            reg_write_data |= (set_dcr_slot((1 << i) & max86150->allowed_signals) << 4);
-            break;
-        }
-    }
-    piLock(0);
-    if (write_max86150_register(MAX86150_REG_FIFO_DCR2, reg_write_data)) {
-        piUnlock(0);
-        d_print("%s: write unsuccessful\n", __func__);
-        return -1;
+    return 0;
+}
+
+/* Every run is one message, register address auto-increments within it.
+ * All of them go in a single I2C transfer. SYS_CTL is not in the image,
+ * FIFO_EN is set by start_recording() */
+static int write_register_image(const struct max86150_register_image *image) {
+    uint8_t bufs[IMAGE_RUNS][1 + IMAGE_RUN_MAX];
+    struct i2c_msg msgs[IMAGE_RUNS];
+    int r;
+
+    for (r = 0; r < IMAGE_RUNS; r++) {
+        bufs[r][0] = image_runs[r].first;
+        memcpy(&bufs[r][1], &image->value[image_runs[r].first], image_runs[r].count);
+
+        msgs[r].addr  = MAX86150_DEV_ID;
+        msgs[r].flags = 0;
+        msgs[r].len   = 1 + image_runs[r].count;
+        msgs[r].buf   = bufs[r];
     }
-    piUnlock(0);
 
-    /* Form data for MAX86150_REG_SYS_CTL */
-    piLock(0);
-    if (write_max86150_register(MAX86150_REG_SYS_CTL, MAX86150_BIT_FIFO_EN)) {
-        d_print("%s: cannot enable FIFO\n", __func__);
-        piUnlock(0);
+    if (transport->transfer(msgs, IMAGE_RUNS) < 0) {
+        log_error("%s: I2C transfer failed - %s\n", __func__, strerror(errno));
         return -1;
     }
-    piUnlock(0);
 
     return 0;
 }
 
+/* Reads all runs back in a single I2C transfer, registers outside of
+ * them are left as they are in image */
+static int read_register_image(struct max86150_register_image *image) {
+    uint8_t addrs[IMAGE_RUNS];
+    struct i2c_msg msgs[2 * IMAGE_RUNS];
+    int r;
+
+    for (r = 0; r < IMAGE_RUNS; r++) {
+        addrs[r] = image_runs[r].first;
+
+        msgs[2 * r].addr      = MAX86150_DEV_ID;
+        msgs[2 * r].flags     = 0;
+        msgs[2 * r].len       = 1;
+        msgs[2 * r].buf       = &addrs[r];
+        msgs[2 * r + 1].addr  = MAX86150_DEV_ID;
+        msgs[2 * r + 1].flags = I2C_M_RD;
+        msgs[2 * r + 1].len   = image_runs[r].count;
+        msgs[2 * r + 1].buf   = &image->value[image_runs[r].first];
+    }
 
-int start_recording(struct max86150_configuration *max86150) {
-    piLock(0);
+    if (transport->transfer(msgs, 2 * IMAGE_RUNS) < 0) {
+        log_error("%s: I2C transfer failed - %s\n", __func__, strerror(errno));
+        return -1;
+    }
 
-    piUnlock(0);
-    start_max86150_timer(max86150->sampling_frequency);
     return 0;
 }
 
-int stop_recording() {
-    piLock(0);
-    if(write_max86150_register(MAX86150_REG_SYS_CTL, 0)) {
-        piUnlock(0);
-        d_print("%s: cannot stop capturing\n", __func__);
-    }
-    if(write_max86150_register(MAX86150_REG_FIFO_DCR1, 0)) {
-        piUnlock(0);
-        d_print("%s: cannot stop capturing\n", __func__);
+static int verify_register_image(const struct max86150_register_image *image) {
+    struct max86150_register_image readback = *image;
+    int r, i;
+    int mismatches = 0;
+
+    if (read_register_image(&readback)) return -1;
+
+    for (r = 0; r < IMAGE_RUNS; r++) {
+        for (i = 0; i < image_runs[r].count; i++) {
+            uint8_t reg = image_runs[r].first + i;
+
+            if (readback.value[reg] != image->value[reg]) {
+                log_error("%s: register 0x%02x is 0x%02x, 0x%02x was written\n",
+                          __func__, reg, readback.value[reg], image->value[reg]);
+                mismatches++;
+            }
+        }
     }
-    if(write_max86150_register(MAX86150_REG_FIFO_DCR1, 0)) {
-        piUnlock(0);
-        d_print("%s: cannot stop capturing\n", __func__);
+
+    return mismatches ? -1 : 0;
+}
+
+
+/* Adjacent changed registers share a message. SYS_CTL is not in the
+ * image, so conversions are neither started nor stopped by a delta.
+ * Returns number of registers written */
+static int write_register_delta(const struct max86150_register_image *image) {
+    uint8_t bufs[2 * IMAGE_RUNS][1 + IMAGE_RUN_MAX];
+    struct i2c_msg msgs[2 * IMAGE_RUNS];
+    int last_reg = -1;
+    int n = 0;
+    int changed = 0;
+    int r, i;
+
+    for (r = 0; r < IMAGE_RUNS; r++) {
+        for (i = 0; i < image_runs[r].count; i++) {
+            uint8_t reg = image_runs[r].first + i;
+
+            if (shadow_valid && (image->value[reg] == shadow.value[reg])) continue;
+
+            if (reg != last_reg + 1) {
+                bufs[n][0]    = reg;
+                msgs[n].addr  = MAX86150_DEV_ID;
+                msgs[n].flags = 0;
+                msgs[n].len   = 1;
+                msgs[n].buf   = bufs[n];
+                n++;
+            }
+            bufs[n - 1][msgs[n - 1].len++] = image->value[reg];
+            last_reg = reg;
+            changed++;
+        }
     }
-    piUnlock(0);
+    if (!changed) return 0;
 
-    if (stop_max86150_timer()) {
-        d_print("%s: cannot stop timer\n");
+    if (transport->transfer(msgs, n) < 0) {
+        log_error("%s: I2C transfer failed - %s\n", __func__, strerror(errno));
         return -1;
     }
 
-    return 0;
+    for (r = 0; r < IMAGE_RUNS; r++) {
+        memcpy(&shadow.value[image_runs[r].first], &image->value[image_runs[r].first], image_runs[r].count);
+    }
+    shadow_valid = 1;
+
+    return changed;
+}
+
+/* After failed transfer device may hold any part of it. If registers
+ * cannot be read either, next delta writes all of them */
+static void refresh_register_shadow() {
+    if (read_register_image(&shadow)) {
+        shadow_valid = 0;
+        return;
+    }
+    shadow_valid = 1;
 }
 
+/* FIFO slot code of a single signal */
+dcr_slot max86150_signal_to_slot(uint16_t sig) {
+    return set_dcr_slot(sig);
+}
 
 static dcr_slot set_dcr_slot(uint16_t sig) {
     switch (sig) {
@@ -348,27 +570,13 @@ static dcr_slot set_dcr_slot(uint16_t sig) {
     }
 }
 
-static int init_i2c0_for_max86150() {
-    if ((max86150_fd = open("/dev/i2c-0", O_RDWR)) < 0) {
-        d_print("%s: Failed to open i2c bus /dev/i2c-0\n", __func__);
-        return -1;
-    }
-
-    if (ioctl(max86150_fd, I2C_SLAVE, MAX86150_DEV_ID)) {
-        d_print("%s: ioctl(%d, 0x%02x, 0x%02x) failed\n",
-                __func__, max86150_fd, I2C_SLAVE, MAX86150_DEV_ID);
-        return -1;
-    }
-    return 0;
-}
-
 static int check_sampling_frequency(struct max86150_configuration *max86150) {
     int i;
     int enabled_signals = 0;
     int max_bits_per_sec;
 
     if (!max86150->sampling_frequency) {
-        d_print("%s: sampling frequency not set\n", __func__);
+        log_error("%s: sampling frequency not set\n", __func__);
     }
 
     for (i = 0; i < TOTAL_SIGNALS; i++) {
@@ -386,8 +594,8 @@ static int check_sampling_frequency(struct max86150_configuration *max86150) {
     max_bits_per_sec = enabled_signals * BITS_PER_FIFO_READ * max86150->sampling_frequency;
 
     if (max_bits_per_sec > (I2C0_BAUD_RATE >> 1)) {
-        d_print("%s: max Baudrate %d; asked for %d\n",
-                __func__, I2C0_BAUD_RATE, (max_bits_per_sec << 1));
+        log_info("%s: max Baudrate %d; asked for %d\n",
+                 __func__, I2C0_BAUD_RATE, (max_bits_per_sec << 1));
         return -1;
     }
 
@@ -413,8 +621,8 @@ static int check_sampling_frequency(struct max86150_configuration *max86150) {
                 max86150->ppg_sampling_freq = max86150->sampling_frequency;
                 break;
             default:
-                d_print("%s: incorrect PPG sampling frequency - %d\n",
-                        __func__, max86150->sampling_frequency);
+                log_error("%s: incorrect PPG sampling frequency - %d\n",
+                          __func__, max86150->sampling_frequency);
                 return -1;
         }
     }
@@ -443,13 +651,13 @@ static int ppg_check_pulses_per_sample(struct max86150_configuration *max86150)
                 max86150->ppg_sampling_reg = PPG_SR_1111;
                 return 0;
             default:
-                d_print("%s: pulse width check failed - ppg_pulses = %d, ppg_sampling_reg = 0x%02x\n",
-                        __func__, max86150->ppg_pulses_reg, max86150->ppg_sampling_reg);
+                log_error("%s: pulse width check failed - ppg_pulses = %d, ppg_sampling_reg = 0x%02x\n",
+                          __func__, max86150->ppg_pulses_reg, max86150->ppg_sampling_reg);
                 return -1;
         }
     }
-    d_print("%s: pulse width check failed - ppg_pulses = %d, ppg_sampling = 0x%02x\n",
-            __func__, max86150->ppg_pulses_reg, max86150->ppg_sampling_reg);
+    log_error("%s: pulse width check failed - ppg_pulses = %d, ppg_sampling = 0x%02x\n",
+              __func__, max86150->ppg_pulses_reg, max86150->ppg_sampling_reg);
     return -1;
 }
 
@@ -495,8 +703,8 @@ static int ppg_convert_freq_to_register_value(struct max86150_configuration *max
         max86150->ppg_sampling_reg = PPG_SR_1010;
         return 0;
     default:
-        d_print("%s: PPG sampling conversion failed - ppg_sampling_freq = %d\n",
-                __func__, max86150->ppg_sampling_freq);
+        log_error("%s: PPG sampling conversion failed - ppg_sampling_freq = %d\n",
+                  __func__, max86150->ppg_sampling_freq);
         return -1;
     }
 }
@@ -516,8 +724,8 @@ static int ppg_set_range(struct max86150_configuration *max86150) {
             max86150->ppg_range_reg = PPG_RGE_UA32;
             return 0;
         default:
-            d_print("%s: PPG range incorrect - ppg_adc_scale = %d\n",
-                    __func__, max86150->ppg_adc_scale);
+            log_error("%s: PPG range incorrect - ppg_adc_scale = %d\n",
+                      __func__, max86150->ppg_adc_scale);
             return -1;
     }
 }
@@ -537,8 +745,8 @@ static int ppg_set_led_pw(struct max86150_configuration *max86150) {
             max86150->ppg_width_reg = PPG_PULSE_WIDTH_400US;
             return 0;
     }
-    d_print("%s: LED pulse width incorrect - ppg_led_pw = %d\n",
-            __func__, max86150->ppg_led_pw);
+    log_error("%s: LED pulse width incorrect - ppg_led_pw = %d\n",
+              __func__, max86150->ppg_led_pw);
     return -1;
 }
 
@@ -563,8 +771,8 @@ static int ppg_set_smp_ave(struct max86150_configuration *max86150) {
             max86150->ppg_smp_avg_reg = PPG_SMP_AVE_32;
             return 0;
     }
-    d_print("%s: PPG sample average incorrect - %d\n",
-            __func__, max86150->ppg_sample_average);
+    log_error("%s: PPG sample average incorrect - %d\n",
+              __func__, max86150->ppg_sample_average);
     return -1;
 }
 
@@ -577,7 +785,7 @@ static int ppg_set_leds_range(struct max86150_configuration *max86150) {
         max86150->ppg_led1_amplitude_reg = (max86150->ppg_led1_amplitude >> 1) * LED_AMPLITUDE_MULTIPLIER;
         max86150->ppg_led1_amplitude_range = PPG_LED_CURRENT100;
     } else {
-        d_print("%s: cannot set LED1 current amplitude - %d\n", __func__, max86150->ppg_led1_amplitude);
+        log_error("%s: cannot set LED1 current amplitude - %d\n", __func__, max86150->ppg_led1_amplitude);
         return -1;
     }
 
@@ -588,7 +796,7 @@ static int ppg_set_leds_range(struct max86150_configuration *max86150) {
         max86150->ppg_led2_amplitude_reg = (max86150->ppg_led2_amplitude >> 1) * LED_AMPLITUDE_MULTIPLIER;
         max86150->ppg_led2_amplitude_range = PPG_LED_CURRENT100;
     } else {
-        d_print("%s: cannot set LED2 current amplitude - %d\n", __func__, max86150->ppg_led2_amplitude);
+        log_error("%s: cannot set LED2 current amplitude - %d\n", __func__, max86150->ppg_led2_amplitude);
         return -1;
     }
 
@@ -617,7 +825,7 @@ static int ecg_set_sampling_rate(struct max86150_configuration *max86150) {
                 max86150->ecg_adc_clk_osr_reg = ECG_ADC_CLK_OSR_0_200;
                 break;
             default:
-                d_print("%s: cannot set ECG sampling rate - %d\n", __func__, max86150->sampling_frequency);
+                log_error("%s: cannot set ECG sampling rate - %d\n", __func__, max86150->sampling_frequency);
                 return -1;
         }
     } else {
@@ -635,7 +843,7 @@ static int ecg_set_sampling_rate(struct max86150_configuration *max86150) {
                 max86150->ecg_adc_clk_osr_reg = ECG_ADC_CLK_OSR_1_400;
                 break;
             default:
-                d_print("%s: cannot set ECG sampling rate - %d\n", __func__, max86150->sampling_frequency);
+                log_error("%s: cannot set ECG sampling rate - %d\n", __func__, max86150->sampling_frequency);
                 return -1;
         }
     }
@@ -659,7 +867,7 @@ static int ecg_set_gains(struct max86150_configuration *max86150) {
             max86150->ecg_pga_gain_reg = ECG_PGA_GAIN_8;
             break;
         default:
-            d_print("%s: incorrect ECG PGA gain %d\n", __func__, max86150->ecg_pga_gain);
+            log_error("%s: incorrect ECG PGA gain %d\n", __func__, max86150->ecg_pga_gain);
             return -1;
     }
 
@@ -678,30 +886,76 @@ static int ecg_set_gains(struct max86150_configuration *max86150) {
             max86150->ecg_ia_gain_reg = ECG_IA_GAIN_50;
             break;
         default:
-            d_print("%s: incorrect ECG IA gain %d\n", __func__, max86150->ecg_ia_gain);
+            log_error("%s: incorrect ECG IA gain %d\n", __func__, max86150->ecg_ia_gain);
             return -1;
     }
 
     return 0;
 }
 
+/* A_FULL fires when fifo_a_full_samples are waiting. The rest of FIFO must
+ * absorb samples arriving while host wakes up and reads the batch, so the
+ * threshold is the largest one leaving enough room at this rate.
+ * FIFO is then read in halves of it, which keeps leftovers below overflow
+ * when polled by timer. */
+static int fifo_set_a_full(struct max86150_configuration *max86150, int enabled_signals) {
+    int sample_read_us = enabled_signals * BYTES_PER_FIFO_READ * 9 * 1000000 / I2C0_BAUD_RATE;
+    int threshold;
+
+    if (!max86150->fifo_a_full_samples) {
+        for (threshold = MAX86150_FIFO_A_FULL_MAX; threshold > MAX86150_FIFO_A_FULL_MIN; threshold--) {
+            int64_t busy_us  = FIFO_WAKEUP_LATENCY_US + threshold * sample_read_us;
+            int     headroom = (busy_us * max86150->sampling_frequency + 999999) / 1000000;
+
+            if (threshold + headroom <= MAX86150_FIFO_DEPTH) break;
+        }
+        max86150->fifo_a_full_samples = threshold;
+    }
+
+    if ((max86150->fifo_a_full_samples < MAX86150_FIFO_A_FULL_MIN) ||
+        (max86150->fifo_a_full_samples > MAX86150_FIFO_A_FULL_MAX)) {
+        log_error("%s: A_FULL must be %d..%d samples - %d\n", __func__,
+                  MAX86150_FIFO_A_FULL_MIN, MAX86150_FIFO_A_FULL_MAX, max86150->fifo_a_full_samples);
+        return -1;
+    }
+
+    max86150->fifo_read_unit = max86150->fifo_a_full_samples >> 1;
+    if (max86150->fifo_read_unit < SAMPLES_PER_SINGLE_READ) {
+        max86150->fifo_read_unit = SAMPLES_PER_SINGLE_READ;
+    }
+
+    log_info("%s: A_FULL at %d samples, read unit %d samples, rollover %s\n", __func__,
+             max86150->fifo_a_full_samples, max86150->fifo_read_unit,
+             max86150->fifo_rollover ? "on" : "off");
+
+    return 0;
+}
+
 int write_max86150_register(int reg, int data) {
-    int wr_bytes = 0;
-    char buf[2];
+    uint8_t buf[2];
+    struct i2c_msg msg;
+    int ret;
 
-    /* WRITE can work like this, while READ cannot for some reason */
     buf[0] = reg;
     buf[1] = data;
-    d_print("%s: setting for fd=%d \treg 0x%02x \tdata 0x%02x - ", __func__, max86150_fd, reg, data);
-    wr_bytes = write(max86150_fd, buf, 2);
-    d_print("wr_bytes = %d\n", wr_bytes);
-    return (wr_bytes == 2) ? 0 : wr_bytes;
+
+    msg.addr  = MAX86150_DEV_ID;
+    msg.flags = 0;
+    msg.len   = 2;
+    msg.buf   = buf;
+
+    ret = transport->transfer(&msg, 1);
+    if (!ret && (reg < (int)sizeof(shadow.value))) shadow.value[reg] = data;
+    log_debug("%s: setting reg 0x%02x \tdata 0x%02x - ret = %d\n", __func__, reg, data, ret);
+    if (ret) {
+        log_error("%s: reg 0x%02x write failed\n", __func__, reg);
+    }
+    return ret ? -1 : 0;
 }
 
 int read_max86150_register(int reg, uint8_t *data, int num) {
     uint8_t outbuf[1];
     struct i2c_msg msgs[2];
-    struct i2c_rdwr_ioctl_data msgset[1];
 
     msgs[0].addr = MAX86150_DEV_ID;
     msgs[0].flags = 0;
@@ -713,14 +967,12 @@ int read_max86150_register(int reg, uint8_t *data, int num) {
     msgs[1].len = num;
     msgs[1].buf = data;
 
-    msgset[0].msgs = msgs;
-    msgset[0].nmsgs = 2;
 
     outbuf[0] = reg;
 
     *(msgs[1].buf) = 0;
-    if (ioctl(max86150_fd, I2C_RDWR, &msgset) < 0) {
-        d_print("%s: ioctl(I2C_RDWR) in i2c_read\n", __func__);
+    if (transport->transfer(msgs, 2) < 0) {
+        log_error("%s: I2C read failed\n", __func__);
         return -1;
     }
 
@@ -730,7 +982,6 @@ int read_max86150_register(int reg, uint8_t *data, int num) {
 int read_max86150_FIFO_multiple(int count, uint8_t *data) {
     uint8_t outbuf[1];
     struct i2c_msg msgs[2];
-    struct i2c_rdwr_ioctl_data msgset[1];
 
     msgs[0].addr = MAX86150_DEV_ID;
     msgs[0].flags = 0;
@@ -742,27 +993,176 @@ int read_max86150_FIFO_multiple(int count, uint8_t *data) {
     msgs[1].len = count;
     msgs[1].buf = data;
 
-    msgset[0].msgs = msgs;
-    msgset[0].nmsgs = 2;
 
     outbuf[0] = MAX86150_REG_FIFO_DR;
 
     *(msgs[1].buf) = 0;
-    if (ioctl(max86150_fd, I2C_RDWR, &msgset) < 0) {
-        d_print("%s: ioctl(I2C_RDWR) in i2c_read\n", __func__);
+    if (transport->transfer(msgs, 2) < 0) {
+        log_error("%s: I2C read failed\n", __func__);
         return -1;
     }
 
     return 0;
 }
 
+/* Reads "samples" FIFO samples of "bytes_per_sample" bytes each with one
+ * I2C transfer. FIFO_DATA register does not auto-increment, so the whole
+ * batch can be clocked out after a single register pointer setup. */
+int read_max86150_FIFO_burst(int samples, int bytes_per_sample, uint8_t *data,
+                             struct max86150_i2c_stats *stats) {
+    int count = samples * bytes_per_sample;
+
+    if (stats) {
+        stats->syscalls = 0;
+        stats->bytes    = 0;
+    }
+
+    if (!samples) return 0;
+
+    if ((samples < 0) || (samples > MAX86150_FIFO_DEPTH)) {
+        log_error("%s: cannot read %d samples, FIFO depth is %d\n",
+                  __func__, samples, MAX86150_FIFO_DEPTH);
+        return -1;
+    }
+
+    if (read_max86150_FIFO_multiple(count, data)) {
+        if (stats) stats->syscalls = 1;
+        return -1;
+    }
+
+    if (stats) {
+        stats->syscalls = 1;
+        stats->bytes    = count;
+    }
+
+    return 0;
+}
+
+/* Reads FIFO WP/OVC/RP and speculatively "speculative_samples" FIFO samples
+ * in one I2C transfer. Samples that were not in the FIFO yet are trimmed
+ * off and the read pointer is rewound to the last valid sample, which costs
+ * one extra write only when the guess was too big.
+ * pointers must be at least 3 bytes, data must fit speculative_samples.
+ * If status is not NULL, IS1/IS2 are read (and so cleared) in the same go. */
+int read_max86150_FIFO_combined(int speculative_samples, int bytes_per_sample,
+                                uint8_t *status, uint8_t *pointers, uint8_t *data, int *valid_samples,
+                                struct max86150_i2c_stats *stats) {
+    uint8_t wp_reg[1];
+    uint8_t dr_reg[1];
+    uint8_t regs[MAX86150_REG_FIFO_RP - MAX86150_REG_IS1 + 1];
+    struct i2c_msg msgs[4];
+    int available;
+
+    *valid_samples = 0;
+    if (stats) {
+        stats->syscalls = 0;
+        stats->bytes    = 0;
+    }
+
+    if ((speculative_samples <= 0) || (speculative_samples > MAX86150_FIFO_DEPTH)) {
+        log_error("%s: cannot read %d samples, FIFO depth is %d\n",
+                  __func__, speculative_samples, MAX86150_FIFO_DEPTH);
+        return -1;
+    }
+
+    wp_reg[0] = status ? MAX86150_REG_IS1 : MAX86150_REG_FIFO_WP;
+    dr_reg[0] = MAX86150_REG_FIFO_DR;
+
+    msgs[0].addr = MAX86150_DEV_ID;
+    msgs[0].flags = 0;
+    msgs[0].len = 1;
+    msgs[0].buf = wp_reg;
+
+    msgs[1].addr = MAX86150_DEV_ID;
+    msgs[1].flags = I2C_M_RD;
+    msgs[1].len = status ? sizeof(regs) : 3;
+    msgs[1].buf = status ? regs : pointers;
+
+    msgs[2].addr = MAX86150_DEV_ID;
+    msgs[2].flags = 0;
+    msgs[2].len = 1;
+    msgs[2].buf = dr_reg;
+
+    msgs[3].addr = MAX86150_DEV_ID;
+    msgs[3].flags = I2C_M_RD;
+    msgs[3].len = speculative_samples * bytes_per_sample;
+    msgs[3].buf = data;
+
+    if (stats) stats->syscalls++;
+    if (transport->transfer(msgs, 4) < 0) {
+        log_error("%s: I2C read failed\n", __func__);
+        return -1;
+    }
+    if (stats) stats->bytes += msgs[1].len + msgs[3].len;
+
+    if (status) {
+        status[0] = regs[MAX86150_REG_IS1 - MAX86150_REG_IS1];
+        status[1] = regs[MAX86150_REG_IS2 - MAX86150_REG_IS1];
+        memcpy(pointers, &regs[MAX86150_REG_FIFO_WP - MAX86150_REG_IS1], 3);
+    }
+
+    available = max86150_fifo_level(pointers[0], pointers[1], pointers[2]);
+    if (available >= speculative_samples) {
+        *valid_samples = speculative_samples;
+        return 0;
+    }
+
+    /* Read pointer went past the samples that really were there */
+    *valid_samples = available;
+    if (stats) stats->syscalls++;
+    if (write_max86150_register(MAX86150_REG_FIFO_RP,
+                                (pointers[2] + available) & MAX86150_BIT_FIFO_RD_PTR)) {
+        log_error("%s: cannot rewind FIFO read pointer\n", __func__);
+        return -1;
+    }
+
+    return 0;
+}
+
+/* Number of samples waiting in the FIFO. Equal pointers mean empty FIFO,
+ * unless overflow counter says it has been filled up */
+int max86150_fifo_level(uint8_t write_pointer, uint8_t ovc, uint8_t read_pointer) {
+    write_pointer &= MAX86150_BIT_FIFO_WP_PTR;
+    read_pointer  &= MAX86150_BIT_FIFO_RD_PTR;
+
+    if (write_pointer == read_pointer) {
+        return (ovc & MAX86150_BIT_OVF_COUNTER) ? MAX86150_FIFO_DEPTH : 0;
+    }
+
+    return (write_pointer > read_pointer) ?
+           (write_pointer - read_pointer) :
+           (MAX86150_FIFO_DEPTH + write_pointer - read_pointer);
+}
+
+/* RESET bit clears itself once reset is over, registers written before
+ * that are lost. Every poll is an I2C read, which paces the loop. Reads
+ * that fail while the chip is busy are retried until timeout */
 int reset_device() {
-    int wr_bytes = 0;
-    char buf[2];
-    buf[0] = MAX86150_REG_SYS_CTL;
-    buf[1] = MAX86150_BIT_RESET;
-    d_print("%s: resetting MAX86150 - ", __func__);
-    wr_bytes = write(max86150_fd, buf, 2);
-    d_print("wr_bytes = %d\n", wr_bytes);
-    return (wr_bytes == 2) ? 0 : wr_bytes;
+    uint64_t start_ns;
+    uint8_t sys_ctl = MAX86150_BIT_RESET;
+    int polls = 0;
+    int ret;
+
+    ret = write_max86150_register(MAX86150_REG_SYS_CTL, MAX86150_BIT_RESET);
+    log_debug("%s: resetting MAX86150 - ret = %d\n", __func__, ret);
+    if (ret) return ret;
+
+    start_ns = latency_now_ns();
+    do {
+        polls++;
+        if (read_max86150_register(MAX86150_REG_SYS_CTL, &sys_ctl, 1)) sys_ctl = MAX86150_BIT_RESET;
+        if (!(sys_ctl & MAX86150_BIT_RESET)) break;
+    } while (latency_now_ns() - start_ns < RESET_TIMEOUT_NS);
+
+    if (sys_ctl & MAX86150_BIT_RESET) {
+        log_error("%s: reset not finished in %llu ms\n", __func__, RESET_TIMEOUT_NS / 1000000);
+        shadow_valid = 0;
+        return -1;
+    }
+    log_debug("%s: reset finished after %d SYS_CTL reads\n", __func__, polls);
+
+    /* Every configured register resets to 0 */
+    memset(&shadow, 0, sizeof(shadow));
+    shadow_valid = 1;
+    return 0;
 }
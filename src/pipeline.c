@@ -0,0 +1,42 @@
+/*
+ * filename: pipeline.c
+ */
+
+#include <pipeline.h>
+
+static const char *variant_names[PIPELINE_VARIANTS] = {
+    "1ch", "ecg", "2ch", "1ch+ecg", "3ch", "2ch+ecg", "4ch", "3ch+ecg"
+};
+
+
+/* Variant of FIFO slot order, PIPELINE_VARIANT_ANY if ECG is not last */
+int pipeline_variant(const uint8_t *slots, uint32_t channels) {
+    uint32_t i;
+
+    if (!channels || (channels > MAX_SIGNALS_ALLOWED)) return PIPELINE_VARIANT_ANY;
+
+    for (i = 0; i < channels; i++) {
+        if ((slots[i] == ECG) && (i != channels - 1)) return PIPELINE_VARIANT_ANY;
+        if ((slots[i] != ECG) && ((slots[i] < PPG_LED1) || (slots[i] > PILOT_LED2))) return PIPELINE_VARIANT_ANY;
+    }
+    return PIPELINE_VARIANT(channels, slots[channels - 1] == ECG);
+}
+
+/* Same for channel widths, as stored in capture file header */
+int pipeline_variant_of_bits(const uint8_t *bits, uint32_t channels) {
+    uint32_t i;
+
+    if (!channels || (channels > MAX_SIGNALS_ALLOWED)) return PIPELINE_VARIANT_ANY;
+
+    for (i = 0; i + 1 < channels; i++) {
+        if (bits[i] != 19) return PIPELINE_VARIANT_ANY;
+    }
+    if ((bits[channels - 1] != 19) && (bits[channels - 1] != 18)) return PIPELINE_VARIANT_ANY;
+
+    return PIPELINE_VARIANT(channels, bits[channels - 1] == 18);
+}
+
+const char *pipeline_variant_name(int variant) {
+    if ((variant < 0) || (variant >= PIPELINE_VARIANTS)) return "generic";
+    return variant_names[variant];
+}
@@ -0,0 +1,90 @@
+/*
+ * filename: poll_control.c
+ *
+ * Fill level at a poll is leftovers plus samples arrived since previous
+ * poll, so it scales with the interval. Interval is scaled by target/mean
+ * fill, cutting fast (down to half per poll) and stretching slowly.
+ * Changes under 1/16 are ignored, so settled loop does not re-arm timer.
+ */
+
+#include <math.h>
+#include <string.h>
+#include <filework.h>
+#include <poll_control.h>
+
+#define POLL_CONTROL_WEIGHT     (1.0 / 16)
+#define POLL_CONTROL_CUT_MAX    (0.5)
+#define POLL_CONTROL_GROW_MAX   (1.125)
+#define POLL_CONTROL_HYSTERESIS (1.0 / 16)
+#define POLL_CONTROL_MARGIN_MIN (2.0)    /* samples, also when fill does not vary at all */
+#define POLL_CONTROL_PEAK_DECAY (1.0 / 64) /* rare late wakeups keep margin wide this long */
+
+
+void poll_control_init(struct poll_control *pc, uint32_t sampling_frequency, int read_unit, int limit) {
+    memset(pc, 0, sizeof(*pc));
+    pc->sample_period_ns = 1e9 / sampling_frequency;
+    pc->min_period_ns    = read_unit * pc->sample_period_ns;
+    pc->max_period_ns    = limit * pc->sample_period_ns;
+    pc->period_ns        = pc->min_period_ns;
+    pc->limit            = limit;
+}
+
+/* Returns 1 when wakeup interval has changed */
+int poll_control_update(struct poll_control *pc, int fifo_level) {
+    double target, ratio, period;
+
+    if (fifo_level < 0) fifo_level = 0;
+    if (fifo_level > MAX86150_FIFO_DEPTH) fifo_level = MAX86150_FIFO_DEPTH;
+    pc->histogram[fifo_level]++;
+
+    if (!pc->polls++) {
+        pc->level_mean = fifo_level;
+        return 0;
+    }
+    pc->level_peak  = fmax(fifo_level - pc->level_mean, pc->level_peak * (1 - POLL_CONTROL_PEAK_DECAY));
+    pc->level_dev  += (fabs(fifo_level - pc->level_mean) - pc->level_dev) * POLL_CONTROL_WEIGHT;
+    pc->level_mean += (fifo_level - pc->level_mean) * POLL_CONTROL_WEIGHT;
+
+    target = pc->limit - 1 - fmax(fmax(POLL_CONTROL_MARGIN_DEVS * pc->level_dev, pc->level_peak),
+                                  POLL_CONTROL_MARGIN_MIN);
+
+    /* Margin is used up, next poll could find FIFO overflowed */
+    if (fifo_level >= pc->limit - POLL_CONTROL_MARGIN_MIN) {
+        pc->limit_hits++;
+        ratio = POLL_CONTROL_CUT_MAX;
+    } else {
+        ratio = target / fmax(pc->level_mean, 1);
+        ratio = fmin(fmax(ratio, POLL_CONTROL_CUT_MAX), POLL_CONTROL_GROW_MAX);
+    }
+
+    period = fmin(fmax(pc->period_ns * ratio, pc->min_period_ns), pc->max_period_ns);
+    if (fabs(period - pc->period_ns) < pc->period_ns * POLL_CONTROL_HYSTERESIS) return 0;
+
+    /* Mean follows the new interval, otherwise stale mean keeps pushing
+     * the interval further on next polls */
+    pc->level_mean *= period / pc->period_ns;
+    pc->period_ns   = period;
+    pc->changes++;
+
+    return 1;
+}
+
+uint64_t poll_control_period_ns(const struct poll_control *pc) {
+    return (uint64_t)llround(pc->period_ns);
+}
+
+void poll_control_report(const struct poll_control *pc) {
+    int i;
+
+    if (!pc->polls) return;
+
+    log_info("%s: %llu polls, interval %.2f ms (%.1f wakeups/s), %u changes, limit %d reached %u times\n",
+             __func__, (unsigned long long)pc->polls, pc->period_ns / 1e6, 1e9 / pc->period_ns,
+             pc->changes, pc->limit, pc->limit_hits);
+    log_info("%s: FIFO fill at poll:\n", __func__);
+    for (i = 0; i <= MAX86150_FIFO_DEPTH; i++) {
+        if (!pc->histogram[i]) continue;
+        log_info("%s: %2d %10u (%5.1f%%)\n", __func__, i, pc->histogram[i],
+                 pc->histogram[i] * 100.0 / pc->polls);
+    }
+}
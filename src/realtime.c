@@ -0,0 +1,85 @@
+/*
+ * filename: realtime.c
+ */
+
+#define _GNU_SOURCE /* pthread_setaffinity_np() */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <filework.h>
+#include <realtime.h>
+
+static void prefault_stack(void);
+
+
+/* Called from acquisition thread, after the threads that must stay at
+ * normal priority have been started. Returns -1 only on invalid setup,
+ * missing privileges are logged and skipped */
+int enter_realtime(struct max86150_configuration *max86150) {
+    struct sched_param param = {0};
+    cpu_set_t cpus;
+    long online = sysconf(_SC_NPROCESSORS_ONLN);
+    int cpu = max86150->rt_cpu;
+    int ret;
+
+    if (cpu < 0) cpu = (online > 1) ? online - 1 : 0;
+    if ((online > 0) && (cpu >= online)) {
+        log_error("%s: CPU %d is not online, %ld CPUs\n", __func__, cpu, online);
+        return -1;
+    }
+
+    /* Current pages are faulted in and locked, future ones on first touch */
+    if (mlockall(MCL_CURRENT | MCL_FUTURE)) {
+        log_error("%s: memory is not locked - %s\n", __func__, strerror(errno));
+    } else {
+        log_info("%s: memory locked\n", __func__);
+    }
+    prefault_stack();
+
+    CPU_ZERO(&cpus);
+    CPU_SET(cpu, &cpus);
+    ret = pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+    if (ret) {
+        log_error("%s: not pinned to CPU %d - %s\n", __func__, cpu, strerror(ret));
+    } else {
+        log_info("%s: pinned to CPU %d\n", __func__, cpu);
+    }
+
+    param.sched_priority = max86150->rt_priority;
+    ret = pthread_setschedparam(pthread_self(), SCHED_FIFO, &param);
+    if (ret) {
+        log_error("%s: SCHED_FIFO %d is not set - %s\n", __func__, param.sched_priority, strerror(ret));
+    } else {
+        log_info("%s: SCHED_FIFO priority %d\n", __func__, param.sched_priority);
+    }
+
+    return 0;
+}
+
+/* One write per page makes it resident, so first real use does not fault */
+void prefault_buffer(void *buf, size_t size) {
+    volatile uint8_t *p = buf;
+    long page = sysconf(_SC_PAGESIZE);
+    size_t i;
+
+    if (!p || !size) return;
+    if (page <= 0) page = 4096;
+
+    for (i = 0; i < size; i += page) p[i] = p[i];
+    p[size - 1] = p[size - 1];
+}
+
+
+/* Stack grows on demand, so its pages are touched up front */
+static void prefault_stack() {
+    volatile uint8_t stack[REALTIME_STACK_PREFAULT];
+    size_t i;
+
+    for (i = 0; i < sizeof(stack); i += 1024) stack[i] = 0;
+}
@@ -0,0 +1,145 @@
+/*
+ * filename: ringbuffer.c
+ *
+ * Lock-free SPSC ring. Head is written only by producer, tail only by
+ * consumer, each on its own cache line. Semaphore is used only to let the
+ * consumer sleep - sem_post() does not enter kernel while nobody waits.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <filework.h>
+#include <ringbuffer.h>
+
+int spsc_ring_init(struct spsc_ring *ring, uint32_t slots, uint32_t slot_size) {
+    uint32_t capacity = 1;
+    void *mem;
+
+    while (capacity < slots) capacity <<= 1;
+
+    /* Keep every slot on its own cache lines */
+    slot_size = (slot_size + CACHE_LINE_SIZE - 1) & ~(CACHE_LINE_SIZE - 1);
+
+    if (posix_memalign(&mem, CACHE_LINE_SIZE, (size_t)capacity * slot_size)) {
+        log_error("%s: cannot allocate %u slots of %u bytes\n", __func__, capacity, slot_size);
+        return -1;
+    }
+    /* Touch all the pages now, not while recording */
+    memset(mem, 0, (size_t)capacity * slot_size);
+
+    if (sem_init(&ring->items, 0, 0)) {
+        log_error("%s: cannot init semaphore - %s\n", __func__, strerror(errno));
+        free(mem);
+        return -1;
+    }
+
+    atomic_init(&ring->head, 0);
+    atomic_init(&ring->tail, 0);
+    atomic_init(&ring->closed, 0);
+    ring->slots       = mem;
+    ring->mask        = capacity - 1;
+    ring->slot_size   = slot_size;
+    ring->high_water  = 0;
+    ring->full_events = 0;
+    ring->committed   = 0;
+
+    return 0;
+}
+
+void spsc_ring_destroy(struct spsc_ring *ring) {
+    if (!ring->slots) return;
+    sem_destroy(&ring->items);
+    free(ring->slots);
+    ring->slots = NULL;
+}
+
+void *spsc_ring_reserve(struct spsc_ring *ring) {
+    unsigned head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    unsigned tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+
+    if ((head - tail) > ring->mask) {
+        ring->full_events++;
+        return NULL;
+    }
+
+    return ring->slots + (size_t)(head & ring->mask) * ring->slot_size;
+}
+
+void spsc_ring_commit(struct spsc_ring *ring) {
+    unsigned head = atomic_load_explicit(&ring->head, memory_order_relaxed) + 1;
+    unsigned used = head - atomic_load_explicit(&ring->tail, memory_order_relaxed);
+
+    if (used > ring->high_water) ring->high_water = used;
+    ring->committed++;
+
+    atomic_store_explicit(&ring->head, head, memory_order_release);
+    sem_post(&ring->items);
+}
+
+/* Consumer gets NULL from spsc_ring_wait() once everything committed
+ * before this call has been released */
+void spsc_ring_close(struct spsc_ring *ring) {
+    atomic_store_explicit(&ring->closed, 1, memory_order_release);
+    sem_post(&ring->items);
+}
+
+void *spsc_ring_wait(struct spsc_ring *ring) {
+    unsigned tail;
+    unsigned head;
+
+    while (sem_wait(&ring->items)) {
+        if (errno != EINTR) return NULL;
+    }
+
+    tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    head = atomic_load_explicit(&ring->head, memory_order_acquire);
+    if (head == tail) return NULL; /* closed and drained */
+
+    return ring->slots + (size_t)(tail & ring->mask) * ring->slot_size;
+}
+
+/* Same as spsc_ring_wait(), but gives up after timeout_ms.
+ * *timed_out tells timeout apart from closed ring */
+void *spsc_ring_timedwait(struct spsc_ring *ring, uint32_t timeout_ms, int *timed_out) {
+    struct timespec deadline;
+    unsigned tail;
+    unsigned head;
+
+    *timed_out = 0;
+
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec  += timeout_ms / 1000;
+    deadline.tv_nsec += (timeout_ms % 1000) * 1000000;
+    if (deadline.tv_nsec >= 1000000000) {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000;
+    }
+
+    while (sem_timedwait(&ring->items, &deadline)) {
+        if (errno == ETIMEDOUT) {
+            *timed_out = 1;
+            return NULL;
+        }
+        if (errno != EINTR) return NULL;
+    }
+
+    tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    head = atomic_load_explicit(&ring->head, memory_order_acquire);
+    if (head == tail) return NULL; /* closed and drained */
+
+    return ring->slots + (size_t)(tail & ring->mask) * ring->slot_size;
+}
+
+void spsc_ring_release(struct spsc_ring *ring) {
+    unsigned tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    atomic_store_explicit(&ring->tail, tail + 1, memory_order_release);
+}
+
+void spsc_ring_get_stats(struct spsc_ring *ring, struct spsc_ring_stats *stats) {
+    stats->capacity    = ring->mask + 1;
+    stats->high_water  = ring->high_water;
+    stats->full_events = ring->full_events;
+    stats->committed   = ring->committed;
+}
@@ -1,5 +1,9 @@
 /*
  * filename: signalwork.c
+ *
+ * Acquisition loop waits in a single epoll set. Timer, SIGINT/SIGTERM and
+ * GPIO edges all arrive as file descriptors, so no signal handler runs and
+ * no syscall of the loop is interrupted by EINTR.
  */
 
 #include <stdio.h>
@@ -8,146 +12,374 @@
 #include <signal.h>
 #include <time.h>
 #include <errno.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
+#include <sys/timerfd.h>
 #include <filework.h>
 #include <peripheral.h>
 #include <signalwork.h>
+#include <gpio_event.h>
+#include <latency.h>
 
 #define UNUSED(x) ((void)x)
 
-static void set_timer_specs(struct sigevent *s_event,
-                            struct sigaction *s_action,
-                            struct itimerspec *its,
-                            uint32_t period_ns);
+#define EVENT_FDS_MAX     (8)
+#define EVENTS_PER_WAIT   (EVENT_FDS_MAX)
+
+struct event_fd_entry {
+    int fd;
+    max86150_fd_handler handler;
+    void *arg;
+};
+
+static int event_loop_open(void);
+static int timer_arm(uint64_t start_ns, uint64_t period_ns);
 static uint32_t sampling_freq_2_period_ns(uint32_t samp_freq);
-static void max86150_timer_action(int sig, siginfo_t *si, void *uc);
-static void sigint_handler(int sig);
+static int timer_event(int fd, uint32_t events, void *arg);
+static int signal_event(int fd, uint32_t events, void *arg);
+static int timer_source_start(struct max86150_configuration *max86150);
+static int timer_source_stop(void);
 
-static timer_t read_periodic_timer;
+static int event_loop_fd = -1;
+static struct event_fd_entry event_fds[EVENT_FDS_MAX];
+static uint64_t event_loop_syscalls; /* epoll_wait and handler reads */
 
+static int timer_fd = -1;
+static uint64_t timer_period_ns;
+static uint64_t timer_start_ns;       /* first deadline of current period */
+static uint64_t timer_expirations;    /* since timer_start_ns */
+static uint64_t timer_wakeups;
+static uint64_t timer_overruns;
+static uint64_t timer_latency_sum_ns;  /* wakeup time past deadline */
+static uint64_t timer_latency_max_ns;
+
+static int signal_fd = -1;
+static int sigint_status = 0;
+static void (*snapshot_handler)(void);
 
-int start_max86150_timer(uint32_t samp_freq) {
-    struct sigevent   s_event  = {0};
-    struct sigaction  s_action = {0};
-    struct itimerspec its      = {0};
+static const struct max86150_event_source timer_event_source = {
+    .name  = "timer",
+    .start = timer_source_start,
+    .stop  = timer_source_stop,
+};
 
-    set_timer_specs(&s_event, &s_action, &its, sampling_freq_2_period_ns(samp_freq));
+static const struct max86150_event_source *event_sources[EVENT_SOURCES_NUM] = {
+    [EVENT_SOURCE_TIMER] = &timer_event_source,
+    [EVENT_SOURCE_GPIO]  = &gpio_event_source,
+};
+static const struct max86150_event_source *active_event_source;
 
-    if (timer_create(CLOCK_REALTIME, &s_event, &read_periodic_timer)) {
-        d_print("%s: cannot create timer - %s\n", __func__, strerror(errno));
+
+/* Timer fires once per samples_per_wakeup sampling periods. Deadlines are
+ * absolute on CLOCK_MONOTONIC, so late wakeups do not shift following ones */
+int start_max86150_timer(uint32_t samp_freq, uint32_t samples_per_wakeup) {
+    struct timespec now;
+    uint64_t period_ns = (uint64_t)sampling_freq_2_period_ns(samp_freq) * samples_per_wakeup;
+
+    if (!period_ns) {
+        log_error("%s: no timer period for %u Hz\n", __func__, samp_freq);
         return -1;
     }
 
-    sigemptyset(&s_action.sa_mask);
-
-    if (sigaction(SIGRTMIN, &s_action, NULL)) {
-        d_print("%s: cannot register sigaction - %s\n", __func__, strerror(errno));
+    timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (timer_fd < 0) {
+        log_error("%s: cannot create timer - %s\n", __func__, strerror(errno));
         return -1;
     }
 
-    if (timer_settime(read_periodic_timer, 0, &its, NULL)) {
-        d_print("%s: cannot start timer - %s\n", __func__, strerror(errno));
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    if (timer_arm((uint64_t)now.tv_sec * 1000000000 + now.tv_nsec + period_ns, period_ns) ||
+        add_max86150_event_fd(timer_fd, EPOLLIN, timer_event, NULL)) {
+        close(timer_fd);
+        timer_fd = -1;
         return -1;
     }
+    timer_wakeups        = 0;
+    timer_overruns       = 0;
+    timer_latency_sum_ns = 0;
+    timer_latency_max_ns = 0;
 
-    d_print("%s: timer set timerid = %d\n", __func__, read_periodic_timer);
+    log_debug("%s: timer fd = %d, period %llu ns\n", __func__, timer_fd, (unsigned long long)period_ns);
 
     return 0;
 }
 
+/* New period starts from the last deadline, so wakeups keep their phase */
+int set_max86150_timer_period(uint64_t period_ns) {
+    if ((timer_fd < 0) || !period_ns) return -1;
+    if (period_ns == timer_period_ns) return 0;
+
+    /* Deadline before timer_start_ns is one old period earlier */
+    return timer_arm(timer_start_ns + timer_expirations * timer_period_ns - timer_period_ns + period_ns, period_ns);
+}
+
 int stop_max86150_timer() {
-    return timer_delete(read_periodic_timer);
+    if (timer_fd < 0) return 0;
+
+    log_info("%s: %llu wakeups, %llu missed periods, wakeup latency mean %llu us, max %llu us\n", __func__,
+             (unsigned long long)timer_wakeups, (unsigned long long)timer_overruns,
+             (unsigned long long)(timer_wakeups ? timer_latency_sum_ns / timer_wakeups / 1000 : 0),
+             (unsigned long long)(timer_latency_max_ns / 1000));
+    remove_max86150_event_fd(timer_fd);
+    close(timer_fd);
+    timer_fd = -1;
+
+    return 0;
 }
 
 
-static void set_timer_specs(struct sigevent *s_event,
-                            struct sigaction *s_action,
-                            struct itimerspec *its,
-                            uint32_t period_ns)
-{
-    its->it_value.tv_sec     = 0;
-    its->it_value.tv_nsec    = period_ns << 3; /* Timer must be called every 8 sampling periods */
-    its->it_interval.tv_sec  = 0;
-    its->it_interval.tv_nsec = period_ns << 3;
+/* handler is called from wait_max86150_event() when fd is ready */
+int add_max86150_event_fd(int fd, uint32_t events, max86150_fd_handler handler, void *arg) {
+    struct epoll_event ev = {0};
+    int i;
 
-    s_event->sigev_notify = SIGEV_SIGNAL;
-    s_event->sigev_signo = SIGRTMIN;
-    s_event->sigev_value.sival_ptr = NULL;
+    if (event_loop_open()) return -1;
 
-    s_action->sa_flags = SA_SIGINFO;
-    s_action->sa_sigaction = max86150_timer_action;
+    for (i = 0; i < EVENT_FDS_MAX; i++) {
+        if (!event_fds[i].handler) break;
+    }
+    if (i == EVENT_FDS_MAX) {
+        log_error("%s: no room for fd %d\n", __func__, fd);
+        return -1;
+    }
+
+    ev.events   = events;
+    ev.data.ptr = &event_fds[i];
+    if (epoll_ctl(event_loop_fd, EPOLL_CTL_ADD, fd, &ev)) {
+        log_error("%s: cannot add fd %d - %s\n", __func__, fd, strerror(errno));
+        return -1;
+    }
+    event_fds[i].fd      = fd;
+    event_fds[i].handler = handler;
+    event_fds[i].arg     = arg;
+
+    return 0;
 }
 
+int remove_max86150_event_fd(int fd) {
+    int i;
 
-static uint32_t sampling_freq_2_period_ns(uint32_t samp_freq) {
-    switch (samp_freq) {
-        case 10:
-            return 100000000;
-            break;
-        case 20:
-            return 50000000;
-            break;
-        case 50:
-            return 20000000;
-            break;
-        case 84:
-            return 11904762;
-            break;
-        case 100:
-            return 10000000;
-            break;
-        case 200:
-            return 5000000;
-            break;
-        case 400:
-            return 2500000;
-            break;
-        case 800:
-            return 1250000;
-            break;
-        case 1000:
-            return 1000000;
-            break;
-        case 1600:
-            return 625000;
-            break;
-        case 3200:
-            return 312500;
-            break;
-        default:
-            return 0;
-    }
-}
-
-
-static void max86150_timer_action(int sig, siginfo_t *si, void *uc) {
-    UNUSED(sig);
-    UNUSED(si);
-    UNUSED(uc);
-    /* This timer just breaks "sleep" in main().
-     * All the necessary stuff is being made there */
+    for (i = 0; i < EVENT_FDS_MAX; i++) {
+        if (event_fds[i].handler && (event_fds[i].fd == fd)) break;
+    }
+    if (i == EVENT_FDS_MAX) return -1;
+
+    epoll_ctl(event_loop_fd, EPOLL_CTL_DEL, fd, NULL);
+    memset(&event_fds[i], 0, sizeof(event_fds[i]));
+
+    return 0;
 }
 
-int register_term_signal() {
-    struct sigaction s_action = {0};
 
-    sigemptyset(&s_action.sa_mask);
-    s_action.sa_flags = 0;
-    s_action.sa_handler = sigint_handler;
+/* Replaces wakeup source implementation, e.g. with a simulated one */
+int register_max86150_event_source(event_source_type type, const struct max86150_event_source *source) {
+    if ((type >= EVENT_SOURCES_NUM) || !source || !source->start || !source->stop) {
+        log_error("%s: invalid event source %d\n", __func__, type);
+        return -1;
+    }
+    event_sources[type] = source;
+    return 0;
+}
 
-    if (sigaction(SIGINT, &s_action, NULL) == -1) {
-        d_print("%s: cannot register signal %d\n", __func__, SIGINT);
+int start_max86150_events(struct max86150_configuration *max86150) {
+    if (max86150->event_source >= EVENT_SOURCES_NUM) {
+        log_error("%s: unknown event source %d\n", __func__, max86150->event_source);
         return -1;
     }
 
+    active_event_source = event_sources[max86150->event_source];
+    log_info("%s: waking up on \"%s\" events\n", __func__, active_event_source->name);
+    if (active_event_source->start(max86150)) {
+        active_event_source = NULL;
+        return -1;
+    }
     return 0;
 }
 
-static int sigint_status = 0;
-static void sigint_handler(int sig) {
-    printf("%d received\n", sig);
-    sigint_status = sig;
+/* Dispatches ready fds until one of them asks for FIFO poll or stop.
+ * Returns 0 when FIFO should be polled, 1 on stop signal, -1 on error */
+int wait_max86150_event() {
+    struct epoll_event ev[EVENTS_PER_WAIT];
+    int poll_fifo = 0;
+    int n, i;
+
+    if (!active_event_source) return -1;
+
+    while (!poll_fifo) {
+        n = epoll_wait(event_loop_fd, ev, EVENTS_PER_WAIT, -1);
+        event_loop_syscalls++;
+        if (n < 0) {
+            if (errno == EINTR) continue; /* e.g. SIGSTOP/SIGCONT */
+            log_error("%s: epoll_wait failed - %s\n", __func__, strerror(errno));
+            return -1;
+        }
+
+        for (i = 0; i < n; i++) {
+            struct event_fd_entry *entry = ev[i].data.ptr;
+            int ret;
+
+            /* Entry was removed by a handler called earlier in this batch */
+            if (!entry->handler) continue;
+
+            ret = entry->handler(entry->fd, ev[i].events, entry->arg);
+            event_loop_syscalls++;
+            if (ret < 0) return -1;
+            if (ret == MAX86150_EVENT_STOP) return 1;
+            if (ret == MAX86150_EVENT_POLL) poll_fifo = 1;
+        }
+    }
+
+    return 0;
+}
+
+uint64_t get_event_loop_syscalls() {
+    return event_loop_syscalls;
+}
+
+int stop_max86150_events() {
+    int retval;
+
+    if (!active_event_source) return 0;
+    retval = active_event_source->stop();
+    active_event_source = NULL;
+    return retval;
+}
+
+
+/* SIGINT, SIGTERM (stop) and SIGUSR1 (snapshot) are blocked and read from
+ * signalfd instead. Must be called before any thread is started, so every
+ * thread inherits the mask */
+int register_term_signal() {
+    sigset_t term_signals;
+
+    sigemptyset(&term_signals);
+    sigaddset(&term_signals, SIGINT);
+    sigaddset(&term_signals, SIGTERM);
+    sigaddset(&term_signals, SIGUSR1);
+
+    if (sigprocmask(SIG_BLOCK, &term_signals, NULL)) {
+        log_error("%s: cannot block signals - %s\n", __func__, strerror(errno));
+        return -1;
+    }
+
+    signal_fd = signalfd(-1, &term_signals, SFD_NONBLOCK | SFD_CLOEXEC);
+    if (signal_fd < 0) {
+        log_error("%s: cannot create signalfd - %s\n", __func__, strerror(errno));
+        return -1;
+    }
+
+    if (add_max86150_event_fd(signal_fd, EPOLLIN, signal_event, NULL)) {
+        close(signal_fd);
+        signal_fd = -1;
+        return -1;
+    }
+
+    return 0;
 }
 
 int get_sigint_status() {
     return sigint_status;
 }
+
+/* Called from the acquisition loop on SIGUSR1, recording goes on */
+void register_snapshot_handler(void (*handler)(void)) {
+    snapshot_handler = handler;
+}
+
+
+static int timer_arm(uint64_t start_ns, uint64_t period_ns) {
+    struct itimerspec its;
+
+    its.it_value.tv_sec     = start_ns / 1000000000;
+    its.it_value.tv_nsec    = start_ns % 1000000000;
+    its.it_interval.tv_sec  = period_ns / 1000000000;
+    its.it_interval.tv_nsec = period_ns % 1000000000;
+
+    if (timerfd_settime(timer_fd, TFD_TIMER_ABSTIME, &its, NULL)) {
+        log_error("%s: cannot arm timer - %s\n", __func__, strerror(errno));
+        return -1;
+    }
+    timer_start_ns    = start_ns;
+    timer_period_ns   = period_ns;
+    timer_expirations = 0;
+
+    return 0;
+}
+
+static int event_loop_open() {
+    if (event_loop_fd >= 0) return 0;
+
+    event_loop_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (event_loop_fd < 0) {
+        log_error("%s: cannot create epoll - %s\n", __func__, strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+static int timer_event(int fd, uint32_t events, void *arg) {
+    struct timespec now;
+    uint64_t expirations;
+    uint64_t deadline_ns, now_ns;
+
+    UNUSED(events);
+    UNUSED(arg);
+
+    if (read(fd, &expirations, sizeof(expirations)) != sizeof(expirations)) {
+        if (errno == EAGAIN) return MAX86150_EVENT_NONE;
+        log_error("%s: cannot read timer - %s\n", __func__, strerror(errno));
+        return -1;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    timer_expirations += expirations;
+    timer_wakeups++;
+    timer_overruns += expirations - 1;
+
+    /* Scheduling latency: time since the latest deadline passed */
+    now_ns      = (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+    deadline_ns = timer_start_ns + (timer_expirations - 1) * timer_period_ns;
+    if (now_ns > deadline_ns) {
+        timer_latency_sum_ns += now_ns - deadline_ns;
+        if (now_ns - deadline_ns > timer_latency_max_ns) timer_latency_max_ns = now_ns - deadline_ns;
+        latency_record(LATENCY_WAKEUP, now_ns - deadline_ns);
+    }
+
+    return MAX86150_EVENT_POLL;
+}
+
+static int signal_event(int fd, uint32_t events, void *arg) {
+    struct signalfd_siginfo si;
+
+    UNUSED(events);
+    UNUSED(arg);
+
+    if (read(fd, &si, sizeof(si)) != sizeof(si)) {
+        if (errno == EAGAIN) return MAX86150_EVENT_NONE;
+        log_error("%s: cannot read signalfd - %s\n", __func__, strerror(errno));
+        return -1;
+    }
+    if (si.ssi_signo == SIGUSR1) {
+        if (snapshot_handler) snapshot_handler();
+        return MAX86150_EVENT_NONE;
+    }
+
+    printf("%u received\n", si.ssi_signo);
+    sigint_status = si.ssi_signo;
+
+    return MAX86150_EVENT_STOP;
+}
+
+static int timer_source_start(struct max86150_configuration *max86150) {
+    return start_max86150_timer(max86150->sampling_frequency, max86150->fifo_read_unit);
+}
+
+static int timer_source_stop() {
+    return stop_max86150_timer();
+}
+
+
+static uint32_t sampling_freq_2_period_ns(uint32_t samp_freq) {
+    if (!samp_freq) return 0;
+    return (1000000000 + samp_freq / 2) / samp_freq;
+}
@@ -0,0 +1,459 @@
+/*
+ * filename: sim_device.c
+ *
+ * Simulated MAX86150 behind the transport interface. Register map, register
+ * pointer auto-increment (except FIFO_DATA), FIFO with WP/OVC/RP and
+ * rollover, A_FULL/PPG_RDY/ECG_RDY status and reset behave as on the chip.
+ * Reset takes SIM_RESET_US: RESET bit reads back set and writes are lost.
+ * Samples are produced in real time at the rate set in PPG_CFG1 (or
+ * ECG_CFG1 without PPG), off by sim_clock_ppm like a real oscillator.
+ * PPG is a pulse wave scaled by LED current, ECG a PQRST complex scaled by
+ * PGA/IA gains, both at 72 bpm, or replayed from max86150_dump raw files.
+ * Every transfer takes the time its bytes need at I2C0_BAUD_RATE plus
+ * sim_bus_latency_us, and fails with EREMOTEIO at sim_bus_error_ppm rate,
+ * like a NAK: messages before the failing one have already taken effect.
+ * With sim_speed above 1 sample clock and bus run that many times faster.
+ * INT pin is not simulated.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <errno.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <pthread.h>
+#include <filework.h>
+#include <peripheral.h>
+#include <latency.h>
+#include <transport.h>
+
+#define SIM_REGS           (256)
+#define SIM_SAMPLE_BYTES   (MAX_SIGNALS_ALLOWED * BYTES_PER_FIFO_READ)
+#define SIM_HEART_RATE_HZ  (1.2)
+#define SIM_PPG_MAX        (0x7FFFF)  /* 19 bit unsigned */
+#define SIM_ECG_MAX        (0x1FFFF)  /* 18 bit two's complement */
+#define SIM_LOCKS          (4)
+#define SIM_REPLAY_CHANNELS (3) /* ppg1, ppg2, ecg */
+#define SIM_RESET_US       (1000) /* datasheet gives no figure */
+
+static int sim_open(struct max86150_configuration *max86150);
+static int sim_transfer(struct i2c_msg *msgs, int count);
+static void sim_close(void);
+static int sim_load_replay(const char *prefix);
+static void sim_reset(void);
+static void sim_write(uint8_t reg, uint8_t value, uint64_t now_ns);
+static uint8_t sim_read(uint8_t reg);
+static void sim_produce(uint64_t now_ns);
+static void sim_push_sample(void);
+static void sim_update_rate(uint64_t now_ns);
+static uint32_t sim_sample_bytes(void);
+static int32_t sim_signal(dcr_slot slot, uint64_t sample);
+
+static const uint16_t ppg_rates[16] = { 10, 20, 50, 84, 100, 200, 400, 800, 1000, 1600, 3200,
+                                        10, 20, 50, 84, 100 };
+static const uint16_t ecg_rates[8]  = { 1600, 800, 400, 200, 3200, 1600, 800, 400 };
+static const double pga_gains[4]    = { 1, 2, 4, 8 };
+static const double ia_gains[4]     = { 5, 9.5, 20, 50 };
+
+static uint8_t regs[SIM_REGS];
+static uint8_t fifo[MAX86150_FIFO_DEPTH][SIM_SAMPLE_BYTES];
+static uint32_t fifo_count;     /* samples in FIFO, pointers alone cannot tell empty from full */
+static uint32_t fifo_byte;      /* bytes of sample at RP already clocked out */
+static uint8_t reg_pointer;
+
+static int converting;
+static double rate_hz;
+static uint64_t base_ns;        /* produced counts from here at rate_hz */
+static uint64_t base_samples;
+static uint64_t produced;
+static uint64_t reset_done_ns;  /* 0 - not in reset */
+
+static int bus_latency_us;
+static int bus_error_ppm;
+static double clock_ppm;
+static int speed;
+static const char *replay_names[SIM_REPLAY_CHANNELS] = { "ppg1", "ppg2", "ecg" };
+static int32_t *replay[SIM_REPLAY_CHANNELS]; /* NULL - synthetic */
+static uint64_t replay_len[SIM_REPLAY_CHANNELS];
+static unsigned rand_state;
+static uint64_t transfers;
+static uint64_t errors;
+
+static pthread_mutex_t sim_locks[SIM_LOCKS] = {
+    PTHREAD_MUTEX_INITIALIZER, PTHREAD_MUTEX_INITIALIZER,
+    PTHREAD_MUTEX_INITIALIZER, PTHREAD_MUTEX_INITIALIZER
+};
+
+const struct max86150_transport sim_transport = {
+    .name     = "sim",
+    .open     = sim_open,
+    .transfer = sim_transfer,
+    .close    = sim_close,
+};
+
+
+void piLock(int key) {
+    pthread_mutex_lock(&sim_locks[key & (SIM_LOCKS - 1)]);
+}
+
+void piUnlock(int key) {
+    pthread_mutex_unlock(&sim_locks[key & (SIM_LOCKS - 1)]);
+}
+
+
+static int sim_open(struct max86150_configuration *max86150) {
+    bus_latency_us = max86150->sim_bus_latency_us;
+    bus_error_ppm  = max86150->sim_bus_error_ppm;
+    clock_ppm      = max86150->sim_clock_ppm;
+    speed          = max86150->sim_speed;
+    rand_state     = 1;
+    transfers      = 0;
+    errors         = 0;
+    sim_reset();
+
+    if (max86150->sim_replay[0] && sim_load_replay(max86150->sim_replay)) return -1;
+
+    log_info("%s: bus latency %d us, %d errors per million transfers, clock error %.1f ppm, %dx real time\n",
+             __func__, bus_latency_us, bus_error_ppm, clock_ppm, speed);
+    return 0;
+}
+
+static void sim_close() {
+    int c;
+
+    for (c = 0; c < SIM_REPLAY_CHANNELS; c++) {
+        free(replay[c]);
+        replay[c] = NULL;
+    }
+    if (!transfers) return;
+    log_info("%s: %llu transfers, %llu failed, %llu samples produced\n", __func__,
+             (unsigned long long)transfers, (unsigned long long)errors, (unsigned long long)produced);
+    transfers = 0;
+}
+
+/* Device state is taken at transfer start, bus time is spent after it */
+static int sim_transfer(struct i2c_msg *msgs, int count) {
+    uint64_t now_ns = latency_now_ns();
+    uint64_t bus_ns;
+    uint32_t bytes = 0;
+    struct timespec busy;
+    int failed = count;
+    int i, j;
+
+    transfers++;
+    for (i = 0; i < count; i++) bytes += 1 + msgs[i].len; /* address byte each */
+    bus_ns = ((uint64_t)bytes * 9 * 1000000000ULL / I2C0_BAUD_RATE + (uint64_t)bus_latency_us * 1000) / speed;
+    busy.tv_sec  = bus_ns / 1000000000;
+    busy.tv_nsec = bus_ns % 1000000000;
+
+    if (bus_error_ppm && ((uint32_t)rand_r(&rand_state) % 1000000 < (uint32_t)bus_error_ppm)) {
+        failed = (uint32_t)rand_r(&rand_state) % count;
+    }
+
+    if (reset_done_ns && (now_ns >= reset_done_ns)) {
+        regs[MAX86150_REG_SYS_CTL] &= ~MAX86150_BIT_RESET;
+        reset_done_ns = 0;
+    }
+    sim_produce(now_ns);
+
+    for (i = 0; i < failed; i++) {
+        if (msgs[i].addr != MAX86150_DEV_ID) {
+            errno = ENXIO;
+            return -1;
+        }
+        if (msgs[i].flags & I2C_M_RD) {
+            for (j = 0; j < msgs[i].len; j++) msgs[i].buf[j] = sim_read(reg_pointer);
+        } else if (msgs[i].len) {
+            reg_pointer = msgs[i].buf[0];
+            for (j = 1; j < msgs[i].len; j++) {
+                sim_write(reg_pointer, msgs[i].buf[j], now_ns);
+                if (reg_pointer != MAX86150_REG_FIFO_DR) reg_pointer++;
+            }
+        }
+    }
+
+    nanosleep(&busy, NULL);
+    if (failed < count) {
+        errors++;
+        errno = EREMOTEIO;
+        return -1;
+    }
+    return 0;
+}
+
+/* Channels of max86150_dump -f raw output, int32 each. Missing files
+ * leave their channel synthetic, replay loops at the end of file */
+static int sim_load_replay(const char *prefix) {
+    char path[MAX_FILENAME_LENGTH + 16];
+    struct stat st;
+    int loaded = 0;
+    int c, fd;
+
+    for (c = 0; c < SIM_REPLAY_CHANNELS; c++) {
+        snprintf(path, sizeof(path), "%s_%s.raw", prefix, replay_names[c]);
+        fd = open(path, O_RDONLY);
+        if (fd < 0) continue;
+
+        if (fstat(fd, &st) || (st.st_size < (off_t)sizeof(int32_t)) ||
+            !(replay[c] = malloc(st.st_size)) || (read(fd, replay[c], st.st_size) != st.st_size)) {
+            log_error("%s: cannot read %s\n", __func__, path);
+            close(fd);
+            return -1;
+        }
+        close(fd);
+        replay_len[c] = st.st_size / sizeof(int32_t);
+        loaded++;
+        log_info("%s: %s, %llu samples\n", __func__, path, (unsigned long long)replay_len[c]);
+    }
+
+    if (!loaded) {
+        log_error("%s: no %s_{ppg1,ppg2,ecg}.raw found\n", __func__, prefix);
+        return -1;
+    }
+    return 0;
+}
+
+static void sim_reset() {
+    memset(regs, 0, sizeof(regs));
+    regs[MAX86150_REG_IS1]     = MAX86150_BIT_PWR_RDY;
+    regs[MAX86150_REG_PART_ID] = MAX86150_PART_ID;
+    fifo_count    = 0;
+    fifo_byte     = 0;
+    reg_pointer   = 0;
+    converting    = 0;
+    rate_hz       = 0;
+    reset_done_ns = 0;
+}
+
+static void sim_write(uint8_t reg, uint8_t value, uint64_t now_ns) {
+    if (reset_done_ns) return;
+
+    switch (reg) {
+    case MAX86150_REG_IS1:
+    case MAX86150_REG_IS2:
+    case MAX86150_REG_FIFO_DR:
+    case MAX86150_REG_PART_ID:
+        return; /* read only */
+    case MAX86150_REG_SYS_CTL:
+        if (value & MAX86150_BIT_RESET) {
+            sim_reset();
+            regs[reg]     = MAX86150_BIT_RESET;
+            reset_done_ns = now_ns + (uint64_t)SIM_RESET_US * 1000 / speed;
+            return;
+        }
+        regs[reg] = value;
+        sim_update_rate(now_ns);
+        return;
+    case MAX86150_REG_FIFO_WP:
+    case MAX86150_REG_FIFO_RP:
+        regs[reg] = value & MAX86150_BIT_FIFO_WP_PTR;
+        fifo_byte = 0;
+        fifo_count = (regs[MAX86150_REG_FIFO_WP] - regs[MAX86150_REG_FIFO_RP]) & (MAX86150_FIFO_DEPTH - 1);
+        return;
+    case MAX86150_REG_FIFO_OVC:
+        regs[reg] = value & MAX86150_BIT_OVF_COUNTER;
+        return;
+    case MAX86150_REG_PPG_CFG1:
+    case MAX86150_REG_ECG_CFG1:
+    case MAX86150_REG_FIFO_DCR1:
+    case MAX86150_REG_FIFO_DCR2:
+        regs[reg] = value;
+        sim_update_rate(now_ns);
+        return;
+    default:
+        regs[reg] = value;
+        return;
+    }
+}
+
+static uint8_t sim_read(uint8_t reg) {
+    uint8_t value;
+
+    if (reg != MAX86150_REG_FIFO_DR) {
+        value = regs[reg];
+        reg_pointer++;
+        /* Status is cleared by reading it */
+        if ((reg == MAX86150_REG_IS1) || (reg == MAX86150_REG_IS2)) regs[reg] = 0;
+        return value;
+    }
+
+    /* Reading past the last sample clocks out stale data and still moves
+     * RP, as host does in a speculative read before rewinding RP */
+    value = fifo[regs[MAX86150_REG_FIFO_RP]][fifo_byte++];
+    if (fifo_byte >= sim_sample_bytes()) {
+        fifo_byte = 0;
+        regs[MAX86150_REG_FIFO_RP] = (regs[MAX86150_REG_FIFO_RP] + 1) & MAX86150_BIT_FIFO_RD_PTR;
+        if (fifo_count) fifo_count--;
+        regs[MAX86150_REG_FIFO_OVC] = 0;
+        if (regs[MAX86150_REG_FIFO_CONF] & MAX86150_BIT_A_FULL_CLR) regs[MAX86150_REG_IS1] &= ~MAX86150_BIT_A_FULL;
+    }
+    return value;
+}
+
+/* Brings FIFO up to now_ns. Samples found no room in full FIFO are only
+ * counted, with rollover only the last FIFO depth of them is generated */
+static void sim_produce(uint64_t now_ns) {
+    uint64_t target, n, skip;
+
+    if (!converting || (now_ns <= base_ns)) return;
+
+    target = base_samples + (uint64_t)((now_ns - base_ns) * 1e-9 * rate_hz * speed * (1 + clock_ppm * 1e-6));
+    if (target <= produced) return;
+    n = target - produced;
+
+    while (n && (fifo_count < MAX86150_FIFO_DEPTH)) {
+        sim_push_sample();
+        n--;
+    }
+    if (!n) return;
+
+    if (!(regs[MAX86150_REG_FIFO_CONF] & MAX86150_BIT_FIFO_ROLLS_ON_FULL)) {
+        skip = n;
+    } else {
+        skip = (n > MAX86150_FIFO_DEPTH) ? n - MAX86150_FIFO_DEPTH : 0;
+    }
+    regs[MAX86150_REG_FIFO_OVC] = (regs[MAX86150_REG_FIFO_OVC] + skip > MAX86150_BIT_OVF_COUNTER) ?
+                                  MAX86150_BIT_OVF_COUNTER : regs[MAX86150_REG_FIFO_OVC] + skip;
+    produced += skip;
+    n -= skip;
+
+    /* Rollover: newest sample replaces the oldest one */
+    while (n--) {
+        regs[MAX86150_REG_FIFO_RP] = (regs[MAX86150_REG_FIFO_RP] + 1) & MAX86150_BIT_FIFO_RD_PTR;
+        fifo_count--;
+        fifo_byte = 0;
+        if (regs[MAX86150_REG_FIFO_OVC] < MAX86150_BIT_OVF_COUNTER) regs[MAX86150_REG_FIFO_OVC]++;
+        sim_push_sample();
+    }
+}
+
+static void sim_push_sample() {
+    uint8_t *p = fifo[regs[MAX86150_REG_FIFO_WP]];
+    uint8_t dcr[MAX_SIGNALS_ALLOWED];
+    uint8_t a_full;
+    int i;
+
+    dcr[0] = regs[MAX86150_REG_FIFO_DCR1] & 0x0F;
+    dcr[1] = regs[MAX86150_REG_FIFO_DCR1] >> 4;
+    dcr[2] = regs[MAX86150_REG_FIFO_DCR2] & 0x0F;
+    dcr[3] = regs[MAX86150_REG_FIFO_DCR2] >> 4;
+
+    for (i = 0; (i < MAX_SIGNALS_ALLOWED) && dcr[i]; i++) {
+        uint32_t word = (uint32_t)sim_signal(dcr[i], produced) & 0xFFFFFF;
+
+        *p++ = word >> 16;
+        *p++ = word >> 8;
+        *p++ = word;
+        if (dcr[i] == ECG) {
+            regs[MAX86150_REG_IS2] |= MAX86150_BIT_ECG_RDY;
+        } else {
+            regs[MAX86150_REG_IS1] |= MAX86150_BIT_PPG_RDY;
+        }
+    }
+
+    regs[MAX86150_REG_FIFO_WP] = (regs[MAX86150_REG_FIFO_WP] + 1) & MAX86150_BIT_FIFO_WP_PTR;
+    fifo_count++;
+    produced++;
+
+    a_full = MAX86150_FIFO_DEPTH - (regs[MAX86150_REG_FIFO_CONF] & MAX86150_BIT_FIFO_A_FULL);
+    if (fifo_count >= a_full) regs[MAX86150_REG_IS1] |= MAX86150_BIT_A_FULL;
+}
+
+/* Conversions run with FIFO_EN set, SHDN clear and at least one slot.
+ * Any change of rate starts counting anew from the current sample */
+static void sim_update_rate(uint64_t now_ns) {
+    uint8_t sys_ctl = regs[MAX86150_REG_SYS_CTL];
+    int ppg = 0, ecg = 0;
+    int i;
+
+    sim_produce(now_ns);
+
+    for (i = 0; i < 4; i++) {
+        uint8_t slot = (((i < 2) ? regs[MAX86150_REG_FIFO_DCR1] : regs[MAX86150_REG_FIFO_DCR2]) >> (4 * (i & 1))) & 0x0F;
+
+        if ((slot == PPG_LED1) || (slot == PPG_LED2)) ppg = 1;
+        if (slot == ECG) ecg = 1;
+    }
+
+    if (ppg) {
+        rate_hz = ppg_rates[(regs[MAX86150_REG_PPG_CFG1] & MAX86150_BIT_PPG_SR) >> MAX86150_SHIFT_PPG_SR];
+    } else if (ecg) {
+        rate_hz = ecg_rates[regs[MAX86150_REG_ECG_CFG1] & MAX86150_MASK_ECG_ADC_CLK];
+    } else {
+        rate_hz = 0;
+    }
+
+    converting   = (sys_ctl & MAX86150_BIT_FIFO_EN) && !(sys_ctl & MAX86150_BIT_SHDN) && (rate_hz > 0);
+    base_ns      = now_ns;
+    base_samples = produced;
+}
+
+static uint32_t sim_sample_bytes() {
+    uint32_t bytes = 0;
+
+    if (regs[MAX86150_REG_FIFO_DCR1] & 0x0F) bytes += BYTES_PER_FIFO_READ;
+    if (regs[MAX86150_REG_FIFO_DCR1] & 0xF0) bytes += BYTES_PER_FIFO_READ;
+    if (regs[MAX86150_REG_FIFO_DCR2] & 0x0F) bytes += BYTES_PER_FIFO_READ;
+    if (regs[MAX86150_REG_FIFO_DCR2] & 0xF0) bytes += BYTES_PER_FIFO_READ;
+
+    return bytes ? bytes : BYTES_PER_FIFO_READ;
+}
+
+/* Sum of gaussian waves placed along a beat, phase and width in beats */
+static double beat_wave(double phase, const double (*waves)[3], int count) {
+    double v = 0;
+    int i;
+
+    for (i = 0; i < count; i++) {
+        double d = (phase - waves[i][1]) / waves[i][2];
+        v += waves[i][0] * exp(-d * d);
+    }
+    return v;
+}
+
+static int32_t sim_signal(dcr_slot slot, uint64_t sample) {
+    /* amplitude, position, width */
+    static const double ppg_waves[][3] = { { 1.0, 0.20, 0.08 }, { 0.35, 0.50, 0.10 } };
+    static const double ecg_waves[][3] = { { 0.15, 0.20, 0.040 }, { -0.10, 0.33, 0.010 },
+                                           { 1.00, 0.35, 0.012 }, { -0.25, 0.38, 0.012 },
+                                           { 0.30, 0.62, 0.060 } };
+    double t = sample / (rate_hz ? rate_hz : 1);
+    double phase = fmod(t * SIM_HEART_RATE_HZ, 1.0);
+    double noise = ((int)(rand_r(&rand_state) % 201) - 100) / 100.0;
+    double v;
+    int c = (slot == PPG_LED1) ? 0 : (slot == PPG_LED2) ? 1 : 2;
+
+    if (((slot == PPG_LED1) || (slot == PPG_LED2) || (slot == ECG)) && replay[c]) {
+        return replay[c][sample % replay_len[c]] & ((slot == ECG) ? 0x3FFFF : SIM_PPG_MAX);
+    }
+
+    switch (slot) {
+    case PPG_LED1:
+    case PPG_LED2: {
+        uint8_t pa = regs[(slot == PPG_LED1) ? MAX86150_REG_LED1_PA : MAX86150_REG_LED2_PA];
+
+        /* Light absorbed by blood pulse lowers the reading a few percent */
+        v = pa * 1500.0 * (1 - 0.03 * beat_wave(phase, ppg_waves, 2)) + 20 * noise;
+        if (v < 0) v = 0;
+        if (v > SIM_PPG_MAX) v = SIM_PPG_MAX;
+        return (int32_t)v;
+    }
+    case ECG: {
+        uint8_t cfg3 = regs[MAX86150_REG_ECG_CFG3];
+        double gain = pga_gains[(cfg3 >> MAX86150_SHIFT_PGA_GAIN) & MAX86150_MASK_PGA_IA_GAIN] *
+                      ia_gains[(cfg3 >> MAX86150_SHIFT_IA_GAIN) & MAX86150_MASK_PGA_IA_GAIN];
+
+        /* 1 mV R wave */
+        v = (beat_wave(phase, ecg_waves, 5) + 0.01 * noise) * gain * 200;
+        if (v > SIM_ECG_MAX) v = SIM_ECG_MAX;
+        if (v < -SIM_ECG_MAX - 1) v = -SIM_ECG_MAX - 1;
+        return (int32_t)v & 0x3FFFF;
+    }
+    default:
+        return 0;
+    }
+}
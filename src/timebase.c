@@ -0,0 +1,153 @@
+/*
+ * filename: timebase.c
+ *
+ * State is time of ref_sample and period. For the first TIMEBASE_FIT_S
+ * period is the slope of least-squares line through all points so far
+ * (nominal until the slope is known well enough) and ref is that line at
+ * ref_sample. After a gap, where samples may have been lost without being
+ * counted, or at a point far off the line, a new run of the line starts
+ * with the same slope.
+ *
+ * Then the loop takes over. For every update with n samples since
+ * ref_sample, error e = measured - (ref + n * period) and
+ *   ref    += n * period + b * e
+ *   period += c * e / n
+ * with w = 2 * pi * bandwidth * update interval, b = sqrt(2) * w, c = w^2,
+ * i.e. critically damped loop (F. Adriaensen, "Using a DLL to filter time").
+ */
+
+#include <math.h>
+#include <string.h>
+#include <timebase.h>
+
+#define TIMEBASE_JITTER_WEIGHT (1.0 / 64)
+#define TIMEBASE_CLAMP_SIGMAS  (8.0)   /* errors beyond it are preemption, not clock */
+#define TIMEBASE_CLAMP_UPDATES (64)
+
+static void timebase_fit_add(struct timebase *tb, double n, double t, int new_run);
+static void timebase_fit_apply(struct timebase *tb);
+static void timebase_jitter_add(struct timebase *tb, double e);
+
+void timebase_init(struct timebase *tb, uint32_t nominal_hz) {
+    memset(tb, 0, sizeof(*tb));
+    tb->nominal_period_ns = 1e9 / nominal_hz;
+    tb->period_ns         = tb->nominal_period_ns;
+    tb->bandwidth_hz      = TIMEBASE_BANDWIDTH_HZ;
+}
+
+/* "samples" is number of samples sensor has produced by host time now_ns,
+ * lost ones included */
+void timebase_update(struct timebase *tb, uint64_t samples, uint64_t now_ns) {
+    double n, t, interval_s, w, e, limit;
+    int outlier;
+
+    if (!tb->updates++) {
+        tb->base_ns     = now_ns;
+        tb->base_sample = samples;
+        tb->ref_sample  = samples;
+        tb->ref_ns      = 0;
+        timebase_fit_add(tb, 0, 0, 1);
+        return;
+    }
+    if (samples <= tb->ref_sample) return;
+
+    n = (double)(samples - tb->ref_sample);
+    t = (double)(int64_t)(now_ns - tb->base_ns);
+    e = t - (tb->ref_ns + n * tb->period_ns);
+
+    /* Thread preempted between timestamp and FIFO pointers read */
+    limit = TIMEBASE_CLAMP_SIGMAS * tb->jitter_ns + tb->period_ns;
+    outlier = (tb->updates > TIMEBASE_CLAMP_UPDATES) && (fabs(e) > limit);
+    tb->ref_sample = samples;
+
+    /* Start of a new run says nothing about jitter */
+    if (t < TIMEBASE_FIT_S * 1e9) {
+        if (!outlier && !tb->fit_gap) timebase_jitter_add(tb, e);
+        timebase_fit_add(tb, (double)(samples - tb->base_sample), t, outlier || tb->fit_gap);
+        timebase_fit_apply(tb);
+        tb->fit_gap = 0;
+        return;
+    }
+
+    if (outlier) e = (e > 0) ? limit : -limit;
+    timebase_jitter_add(tb, e);
+
+    interval_s = n * tb->period_ns * 1e-9;
+    w = 2 * M_PI * tb->bandwidth_hz * interval_s;
+    if (w > 0.5) w = 0.5;
+
+    tb->ref_ns    += n * tb->period_ns + sqrt(2) * w * e;
+    tb->period_ns += w * w * e / n;
+}
+
+/* Samples were lost, count of the next update may be short of them */
+void timebase_gap(struct timebase *tb) {
+    tb->fit_gap = 1;
+}
+
+/* Host time when sample number "sample" (0 based) was produced */
+uint64_t timebase_sample_ns(const struct timebase *tb, uint64_t sample) {
+    double offset = ((double)sample + 1 - (double)tb->ref_sample) * tb->period_ns;
+
+    return tb->base_ns + (int64_t)llround(tb->ref_ns + offset);
+}
+
+/* Number of samples produced by host time now_ns, inverse of the above */
+double timebase_samples_at(const struct timebase *tb, uint64_t now_ns) {
+    return (double)tb->ref_sample + ((double)(int64_t)(now_ns - tb->base_ns) - tb->ref_ns) / tb->period_ns;
+}
+
+uint64_t timebase_period_fs(const struct timebase *tb) {
+    return (uint64_t)llround(tb->period_ns * 1e6);
+}
+
+double timebase_rate_hz(const struct timebase *tb) {
+    return 1e9 / tb->period_ns;
+}
+
+/* Sensor clock error, positive if it runs faster than nominal */
+double timebase_drift_ppm(const struct timebase *tb) {
+    return (tb->nominal_period_ns / tb->period_ns - 1) * 1e6;
+}
+
+
+/* Running means and deviation products, stable for any number of points.
+ * First point of a run is its mean, so it adds nothing to the products */
+static void timebase_fit_add(struct timebase *tb, double n, double t, int new_run) {
+    double dn, dt;
+
+    if (new_run) {
+        tb->fit_run_points = 0;
+        tb->fit_runs++;
+    }
+    dn = n - tb->fit_mean_n;
+    dt = t - tb->fit_mean_t;
+
+    tb->fit_points++;
+    tb->fit_run_points++;
+    tb->fit_mean_n += dn / tb->fit_run_points;
+    tb->fit_mean_t += dt / tb->fit_run_points;
+    tb->fit_nn += dn * (n - tb->fit_mean_n);
+    tb->fit_nt += dn * (t - tb->fit_mean_t);
+    tb->fit_tt += dt * (t - tb->fit_mean_t);
+}
+
+/* Early on a few drains close together give a slope far worse than
+ * nominal period, so it is taken only once its standard error is small.
+ * Every run takes one degree of freedom for its offset, slope another */
+static void timebase_fit_apply(struct timebase *tb) {
+    if ((tb->fit_points > tb->fit_runs + 1) && (tb->fit_nn > 0)) {
+        double slope = tb->fit_nt / tb->fit_nn;
+        double residual = fmax(tb->fit_tt - slope * tb->fit_nt, 0) / (tb->fit_points - tb->fit_runs - 1);
+
+        if (sqrt(residual / tb->fit_nn) < tb->nominal_period_ns * TIMEBASE_FIT_MAX_PPM * 1e-6) {
+            tb->period_ns = slope;
+        }
+    }
+    tb->ref_ns = tb->fit_mean_t + ((double)(tb->ref_sample - tb->base_sample) - tb->fit_mean_n) * tb->period_ns;
+}
+
+static void timebase_jitter_add(struct timebase *tb, double e) {
+    tb->jitter_ns = sqrt(tb->jitter_ns * tb->jitter_ns * (1 - TIMEBASE_JITTER_WEIGHT) +
+                         e * e * TIMEBASE_JITTER_WEIGHT);
+}
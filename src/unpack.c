@@ -0,0 +1,299 @@
+/*
+ * filename: unpack.c
+ *
+ * Word value is ((b0 << 16 | b1 << 8 | b2) & mask ^ sign_bit) - sign_bit,
+ * which masks tag bits of every channel and sign extends signed ones with
+ * the same lane operations. Every path is instantiated for each pipeline
+ * variant, so masks are constant vectors and strides are fixed.
+ *
+ * x86 paths are built with target attributes and picked by CPUID, so the
+ * binary still runs on plain SSE2 hosts. NEON path is opt-in (make NEON=1,
+ * -mfpu=neon-vfpv4 on H3), as it has not been run on the board yet.
+ */
+
+#include <string.h>
+#include <pipeline.h>
+#include <unpack.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define UNPACK_HAVE_X86
+#include <immintrin.h>
+#endif
+
+#if defined(UNPACK_ENABLE_NEON) && (defined(__ARM_NEON) || defined(__ARM_NEON__))
+#define UNPACK_HAVE_NEON
+#include <arm_neon.h>
+#endif
+
+#define UNPACK_INLINE static inline __attribute__((always_inline))
+
+/* Words per iteration: lcm of channels and vector lanes, so lane constants
+ * are the same in every iteration */
+#define UNPACK_PERIOD(channels, lanes) (((channels) == 3) ? 3 * (lanes) : (lanes))
+
+#define UNPACK_LANE_MASK(j, channels, ecg) PIPELINE_MASK((j) % (channels), channels, ecg)
+#define UNPACK_LANE_SIGN(j, channels, ecg) (PIPELINE_IS_ECG((j) % (channels), channels, ecg) ? 0x20000 : 0)
+
+typedef void (*unpack_fn)(const uint8_t *src, uint32_t samples, int32_t *dst);
+
+static const char *path_names[UNPACK_PATHS_NUM] = { "scalar", "ssse3", "avx2", "neon" };
+static const unpack_fn *path_variants[UNPACK_PATHS_NUM];
+static unpack_path selected_path;
+
+
+/* Whole samples from word i on */
+UNPACK_INLINE void unpack_scalar_tmpl(const uint8_t *src, uint32_t i, uint32_t words, int32_t *dst,
+                                      const uint32_t channels, const int ecg) {
+    uint32_t c;
+
+    for (src += i * BYTES_PER_FIFO_READ; i < words; i += channels) {
+#pragma GCC unroll 4
+        for (c = 0; c < channels; c++) {
+            const uint8_t *p = src + c * BYTES_PER_FIFO_READ;
+            uint32_t w = (p[0] << 16) | (p[1] << 8) | p[2];
+
+            dst[i + c] = (int32_t)(((w & PIPELINE_MASK(c, channels, ecg)) ^ UNPACK_LANE_SIGN(c, channels, ecg)) -
+                                   UNPACK_LANE_SIGN(c, channels, ecg));
+        }
+        src += channels * BYTES_PER_FIFO_READ;
+    }
+}
+
+#ifdef UNPACK_HAVE_X86
+/* 4 words out of every 16 bytes load. Returns first word not converted */
+__attribute__((target("ssse3")))
+UNPACK_INLINE uint32_t unpack_ssse3_tmpl(const uint8_t *src, uint32_t i, uint32_t words, int32_t *dst,
+                                         const uint32_t channels, const int ecg) {
+    const uint32_t period = UNPACK_PERIOD(channels, 4);
+    const __m128i shuffle = _mm_setr_epi8(2, 1, 0, -1, 5, 4, 3, -1, 8, 7, 6, -1, 11, 10, 9, -1);
+    uint32_t v;
+
+    for (; i + period <= words; i += period) {
+#pragma GCC unroll 3
+        for (v = 0; v < period / 4; v++) {
+            const uint32_t j = 4 * v;
+            const __m128i mask = _mm_setr_epi32(UNPACK_LANE_MASK(j, channels, ecg),
+                                                UNPACK_LANE_MASK(j + 1, channels, ecg),
+                                                UNPACK_LANE_MASK(j + 2, channels, ecg),
+                                                UNPACK_LANE_MASK(j + 3, channels, ecg));
+            const __m128i sign = _mm_setr_epi32(UNPACK_LANE_SIGN(j, channels, ecg),
+                                                UNPACK_LANE_SIGN(j + 1, channels, ecg),
+                                                UNPACK_LANE_SIGN(j + 2, channels, ecg),
+                                                UNPACK_LANE_SIGN(j + 3, channels, ecg));
+            __m128i w = _mm_loadu_si128((const __m128i *)(src + (i + j) * BYTES_PER_FIFO_READ));
+
+            w = _mm_shuffle_epi8(w, shuffle);
+            w = _mm_sub_epi32(_mm_xor_si128(_mm_and_si128(w, mask), sign), sign);
+            _mm_storeu_si128((__m128i *)&dst[i + j], w);
+        }
+    }
+
+    return i;
+}
+
+/* 8 words out of two 16 bytes loads 12 bytes apart */
+__attribute__((target("avx2")))
+UNPACK_INLINE uint32_t unpack_avx2_tmpl(const uint8_t *src, uint32_t i, uint32_t words, int32_t *dst,
+                                        const uint32_t channels, const int ecg) {
+    const uint32_t period = UNPACK_PERIOD(channels, 8);
+    const __m256i shuffle = _mm256_setr_epi8(2, 1, 0, -1, 5, 4, 3, -1, 8, 7, 6, -1, 11, 10, 9, -1,
+                                             2, 1, 0, -1, 5, 4, 3, -1, 8, 7, 6, -1, 11, 10, 9, -1);
+    uint32_t v;
+
+    for (; i + period <= words; i += period) {
+#pragma GCC unroll 3
+        for (v = 0; v < period / 8; v++) {
+            const uint32_t j = 8 * v;
+            const uint8_t *p = src + (i + j) * BYTES_PER_FIFO_READ;
+            const __m256i mask = _mm256_setr_epi32(UNPACK_LANE_MASK(j, channels, ecg),
+                                                   UNPACK_LANE_MASK(j + 1, channels, ecg),
+                                                   UNPACK_LANE_MASK(j + 2, channels, ecg),
+                                                   UNPACK_LANE_MASK(j + 3, channels, ecg),
+                                                   UNPACK_LANE_MASK(j + 4, channels, ecg),
+                                                   UNPACK_LANE_MASK(j + 5, channels, ecg),
+                                                   UNPACK_LANE_MASK(j + 6, channels, ecg),
+                                                   UNPACK_LANE_MASK(j + 7, channels, ecg));
+            const __m256i sign = _mm256_setr_epi32(UNPACK_LANE_SIGN(j, channels, ecg),
+                                                   UNPACK_LANE_SIGN(j + 1, channels, ecg),
+                                                   UNPACK_LANE_SIGN(j + 2, channels, ecg),
+                                                   UNPACK_LANE_SIGN(j + 3, channels, ecg),
+                                                   UNPACK_LANE_SIGN(j + 4, channels, ecg),
+                                                   UNPACK_LANE_SIGN(j + 5, channels, ecg),
+                                                   UNPACK_LANE_SIGN(j + 6, channels, ecg),
+                                                   UNPACK_LANE_SIGN(j + 7, channels, ecg));
+            __m256i w = _mm256_loadu2_m128i((const __m128i *)(p + 12), (const __m128i *)p);
+
+            w = _mm256_shuffle_epi8(w, shuffle);
+            w = _mm256_sub_epi32(_mm256_xor_si256(_mm256_and_si256(w, mask), sign), sign);
+            _mm256_storeu_si256((__m256i *)&dst[i + j], w);
+        }
+    }
+
+    return i;
+}
+#endif /* UNPACK_HAVE_X86 */
+
+#ifdef UNPACK_HAVE_NEON
+/* vld3 splits 16 words into MSB, middle and LSB byte planes */
+UNPACK_INLINE uint32_t unpack_neon_tmpl(const uint8_t *src, uint32_t i, uint32_t words, int32_t *dst,
+                                        const uint32_t channels, const int ecg) {
+    const uint32_t period = UNPACK_PERIOD(channels, 16);
+    uint32_t v;
+    uint32_t k;
+
+    for (; i + period <= words; i += period) {
+#pragma GCC unroll 3
+        for (v = 0; v < period / 16; v++) {
+            uint8x16x3_t b = vld3q_u8(src + (i + 16 * v) * BYTES_PER_FIFO_READ);
+            uint16x8_t hi_lo = vmovl_u8(vget_low_u8(b.val[0]));
+            uint16x8_t hi_hi = vmovl_u8(vget_high_u8(b.val[0]));
+            uint16x8_t lo_lo = vorrq_u16(vshll_n_u8(vget_low_u8(b.val[1]), 8), vmovl_u8(vget_low_u8(b.val[2])));
+            uint16x8_t lo_hi = vorrq_u16(vshll_n_u8(vget_high_u8(b.val[1]), 8), vmovl_u8(vget_high_u8(b.val[2])));
+            uint32x4_t w[4];
+
+            w[0] = vorrq_u32(vshll_n_u16(vget_low_u16(hi_lo), 16),  vmovl_u16(vget_low_u16(lo_lo)));
+            w[1] = vorrq_u32(vshll_n_u16(vget_high_u16(hi_lo), 16), vmovl_u16(vget_high_u16(lo_lo)));
+            w[2] = vorrq_u32(vshll_n_u16(vget_low_u16(hi_hi), 16),  vmovl_u16(vget_low_u16(lo_hi)));
+            w[3] = vorrq_u32(vshll_n_u16(vget_high_u16(hi_hi), 16), vmovl_u16(vget_high_u16(lo_hi)));
+
+#pragma GCC unroll 4
+            for (k = 0; k < 4; k++) {
+                const uint32_t j = 16 * v + 4 * k;
+                const uint32x4_t mask = { UNPACK_LANE_MASK(j, channels, ecg),
+                                          UNPACK_LANE_MASK(j + 1, channels, ecg),
+                                          UNPACK_LANE_MASK(j + 2, channels, ecg),
+                                          UNPACK_LANE_MASK(j + 3, channels, ecg) };
+                const uint32x4_t sign = { UNPACK_LANE_SIGN(j, channels, ecg),
+                                          UNPACK_LANE_SIGN(j + 1, channels, ecg),
+                                          UNPACK_LANE_SIGN(j + 2, channels, ecg),
+                                          UNPACK_LANE_SIGN(j + 3, channels, ecg) };
+
+                w[k] = vsubq_u32(veorq_u32(vandq_u32(w[k], mask), sign), sign);
+                vst1q_s32(&dst[i + j], vreinterpretq_s32_u32(w[k]));
+            }
+        }
+    }
+
+    return i;
+}
+#endif /* UNPACK_HAVE_NEON */
+
+/* Every path for every variant */
+#define UNPACK_SCALAR_VARIANT(id, channels, ecg) \
+    static void unpack_scalar_##id(const uint8_t *src, uint32_t samples, int32_t *dst) { \
+        unpack_scalar_tmpl(src, 0, samples * channels, dst, channels, ecg); \
+    }
+#define UNPACK_SCALAR_ENTRY(id, channels, ecg) unpack_scalar_##id,
+
+PIPELINE_FOR_EACH_VARIANT(UNPACK_SCALAR_VARIANT)
+static const unpack_fn scalar_variants[PIPELINE_VARIANTS] = { PIPELINE_FOR_EACH_VARIANT(UNPACK_SCALAR_ENTRY) };
+
+#ifdef UNPACK_HAVE_X86
+#define UNPACK_X86_VARIANT(id, channels, ecg) \
+    __attribute__((target("ssse3"))) \
+    static void unpack_ssse3_##id(const uint8_t *src, uint32_t samples, int32_t *dst) { \
+        uint32_t i = unpack_ssse3_tmpl(src, 0, samples * channels, dst, channels, ecg); \
+        unpack_scalar_tmpl(src, i, samples * channels, dst, channels, ecg); \
+    } \
+    __attribute__((target("avx2"))) \
+    static void unpack_avx2_##id(const uint8_t *src, uint32_t samples, int32_t *dst) { \
+        uint32_t i = unpack_avx2_tmpl(src, 0, samples * channels, dst, channels, ecg); \
+        i = unpack_ssse3_tmpl(src, i, samples * channels, dst, channels, ecg); \
+        unpack_scalar_tmpl(src, i, samples * channels, dst, channels, ecg); \
+    }
+#define UNPACK_SSSE3_ENTRY(id, channels, ecg) unpack_ssse3_##id,
+#define UNPACK_AVX2_ENTRY(id, channels, ecg)  unpack_avx2_##id,
+
+PIPELINE_FOR_EACH_VARIANT(UNPACK_X86_VARIANT)
+static const unpack_fn ssse3_variants[PIPELINE_VARIANTS] = { PIPELINE_FOR_EACH_VARIANT(UNPACK_SSSE3_ENTRY) };
+static const unpack_fn avx2_variants[PIPELINE_VARIANTS]  = { PIPELINE_FOR_EACH_VARIANT(UNPACK_AVX2_ENTRY) };
+#endif /* UNPACK_HAVE_X86 */
+
+#ifdef UNPACK_HAVE_NEON
+#define UNPACK_NEON_VARIANT(id, channels, ecg) \
+    static void unpack_neon_##id(const uint8_t *src, uint32_t samples, int32_t *dst) { \
+        uint32_t i = unpack_neon_tmpl(src, 0, samples * channels, dst, channels, ecg); \
+        unpack_scalar_tmpl(src, i, samples * channels, dst, channels, ecg); \
+    }
+#define UNPACK_NEON_ENTRY(id, channels, ecg) unpack_neon_##id,
+
+PIPELINE_FOR_EACH_VARIANT(UNPACK_NEON_VARIANT)
+static const unpack_fn neon_variants[PIPELINE_VARIANTS] = { PIPELINE_FOR_EACH_VARIANT(UNPACK_NEON_ENTRY) };
+#endif /* UNPACK_HAVE_NEON */
+
+
+int unpack_layout_init(struct unpack_layout *layout, const uint8_t *slots, uint32_t channels) {
+    memset(layout, 0, sizeof(*layout));
+
+    layout->variant = pipeline_variant(slots, channels);
+    if (layout->variant == PIPELINE_VARIANT_ANY) return -1;
+    layout->channels = channels;
+
+    return 0;
+}
+
+/* Fastest path supported by this CPU */
+void unpack_init() {
+    int i;
+
+    path_variants[UNPACK_SCALAR] = scalar_variants;
+#ifdef UNPACK_HAVE_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("ssse3")) path_variants[UNPACK_SSSE3] = ssse3_variants;
+    if (__builtin_cpu_supports("avx2"))  path_variants[UNPACK_AVX2]  = avx2_variants;
+#endif
+#ifdef UNPACK_HAVE_NEON
+    path_variants[UNPACK_NEON] = neon_variants;
+#endif
+
+    for (i = UNPACK_PATHS_NUM - 1; i >= 0; i--) {
+        if (!unpack_select(i)) break;
+    }
+}
+
+int unpack_path_supported(unpack_path path) {
+    return (path < UNPACK_PATHS_NUM) && path_variants[path];
+}
+
+int unpack_select(unpack_path path) {
+    if (!unpack_path_supported(path)) return -1;
+
+    selected_path = path;
+    return 0;
+}
+
+unpack_path unpack_selected() {
+    return selected_path;
+}
+
+const char *unpack_path_name(unpack_path path) {
+    return (path < UNPACK_PATHS_NUM) ? path_names[path] : "unknown";
+}
+
+void unpack_fifo(const uint8_t *src, uint32_t samples, const struct unpack_layout *layout, int32_t *dst) {
+    path_variants[selected_path][layout->variant](src, samples, dst);
+}
+
+/* Burst is converted in FIFO sized pieces, which stay in L1, then split */
+void unpack_fifo_channels(const uint8_t *src, uint32_t samples, const struct unpack_layout *layout,
+                          int32_t *const *dst) {
+    int32_t tmp[MAX86150_FIFO_DEPTH * MAX_SIGNALS_ALLOWED];
+    uint32_t channels = layout->channels;
+    uint32_t done = 0;
+
+    while (done < samples) {
+        uint32_t n = samples - done;
+        uint32_t i;
+        uint32_t c;
+
+        if (n > MAX86150_FIFO_DEPTH) n = MAX86150_FIFO_DEPTH;
+        unpack_fifo(src + done * channels * BYTES_PER_FIFO_READ, n, layout, tmp);
+
+        for (c = 0; c < channels; c++) {
+            int32_t *out = dst[c] + done;
+
+            for (i = 0; i < n; i++) out[i] = tmp[i * channels + c];
+        }
+        done += n;
+    }
+}
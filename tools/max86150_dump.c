@@ -0,0 +1,684 @@
+/*
+ * filename: max86150_dump.c
+ *
+ * Offline converter of capture files. File is mapped read-only and its
+ * chunks are split into ranges, which a pool of threads checks and decodes
+ * in parallel. Values are int32: PPG and pilots masked to 19 bits, ECG sign
+ * extended from 18 bits, whatever encoding file was written with.
+ *
+ *   csv - <prefix>.csv, "sample,time_ns,<channel>,..." rows, ranges written
+ *         in order
+ *   npy - <prefix>_<channel>.npy, one NumPy int32 array per channel, and
+ *         <prefix>_time_ns.npy with int64 sample times
+ *   raw - same as npy, little-endian int32/int64 without header
+ *
+ * Sample times are CLOCK_MONOTONIC_RAW of the recording host, from sample
+ * clock estimate stored in chunk headers.
+ *
+ *   max86150_dump [-f csv|npy|raw] [-j threads] [-o prefix] capture_file
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <capture_format.h>
+#include <latency.h>
+
+#define DUMP_RANGE_CHUNKS (64)
+#define DUMP_THREADS_MAX  (64)
+#define DUMP_NPY_HEADER   (128)  /* bytes before array data, multiple of 64 */
+#define DUMP_CSV_ROW_MAX  (2 * 21 + MAX_SIGNALS_ALLOWED * 12)
+
+typedef enum {
+    DUMP_CSV = 0,
+    DUMP_NPY = 1,
+    DUMP_RAW = 2
+}dump_format;
+
+struct dump_worker;
+
+struct dump_job {
+    const uint8_t *map;
+    size_t         map_size;
+    struct capture_file_header header;
+    struct bitpack_layout layout;
+    uint32_t       mask[MAX_SIGNALS_ALLOWED];
+    uint32_t       sign[MAX_SIGNALS_ALLOWED];
+    uint64_t       chunks;
+    uint32_t      *chunk_samples;   /* 0 for unused or damaged chunks */
+    uint64_t      *chunk_offset;    /* index of first sample in output */
+    uint64_t       total_samples;
+    atomic_uint_fast64_t bad_chunks;
+    atomic_uint_fast64_t gaps;
+    atomic_uint_fast64_t lost_samples; /* as recorded in gap chunks */
+    atomic_uint_fast64_t config_changes;
+    struct capture_trailer_record trailer;
+    atomic_int     has_trailer;
+
+    dump_format    format;
+    int            fd[MAX_SIGNALS_ALLOWED]; /* csv uses fd[0] only */
+    int            time_fd;
+    off_t          data_offset;
+
+    void         (*pass)(struct dump_worker *w, uint64_t range);
+    uint64_t       ranges;
+    atomic_uint_fast64_t next_range;
+    atomic_int     failed;
+
+    /* csv ranges are written out in turn */
+    pthread_mutex_t turn_lock;
+    pthread_cond_t  turn_cond;
+    uint64_t        turn;
+};
+
+/* Per thread buffers, grown as needed */
+struct dump_worker {
+    struct dump_job *job;
+    uint8_t  *chunk;        /* copy of last chunk with decoder slack */
+    uint32_t *words;
+    int32_t  *values;
+    uint64_t *times;
+    char     *text;
+    size_t    words_size;
+    size_t    times_size;
+    size_t    text_size;
+};
+
+static const char *format_names[] = { "csv", "npy", "raw" };
+
+static int run_pool(struct dump_job *job, uint32_t threads, void (*pass)(struct dump_worker *, uint64_t));
+static void *pool_thread(void *arg);
+static void scan_range(struct dump_worker *w, uint64_t range);
+static void convert_range(struct dump_worker *w, uint64_t range);
+static int chunk_sample_count(struct dump_job *job, const uint8_t *chunk);
+static const uint8_t *chunk_data(struct dump_worker *w, uint64_t i);
+static int decode_chunk(struct dump_worker *w, const uint8_t *chunk, int32_t *dst, uint64_t *times);
+static int write_all(int fd, const void *buf, size_t len, off_t offset);
+static char *format_int(char *p, int64_t v);
+static int open_outputs(struct dump_job *job, const char *prefix);
+static int open_output(struct dump_job *job, const char *prefix, const char *name, const char *descr, size_t size);
+static void close_outputs(struct dump_job *job);
+static const char *slot_name(uint8_t slot);
+static void print_usage(char **argv);
+
+
+int main(int argc, char **argv) {
+    struct dump_job job;
+    const char *input = NULL;
+    const char *prefix = NULL;
+    long threads = sysconf(_SC_NPROCESSORS_ONLN);
+    struct stat st;
+    uint64_t t0, t_scan, t_convert;
+    uint64_t i;
+    uint32_t c;
+    int a;
+    int fd;
+    int retval = -1;
+
+    memset(&job, 0, sizeof(job));
+    for (c = 0; c < MAX_SIGNALS_ALLOWED; c++) job.fd[c] = -1;
+    job.time_fd = -1;
+    pthread_mutex_init(&job.turn_lock, NULL);
+    pthread_cond_init(&job.turn_cond, NULL);
+
+    for (a = 1; a < argc; a++) {
+        if (argv[a][0] != '-') {
+            input = argv[a];
+            continue;
+        }
+        if ((0 == strcmp(argv[a], "-f")) && (a + 1 < argc)) {
+            a++;
+            for (c = 0; c < sizeof(format_names) / sizeof(format_names[0]); c++) {
+                if (0 == strcmp(argv[a], format_names[c])) break;
+            }
+            if (c == sizeof(format_names) / sizeof(format_names[0])) {
+                printf("%s: unknown format %s\n", __func__, argv[a]);
+                return -1;
+            }
+            job.format = c;
+            continue;
+        }
+        if ((0 == strcmp(argv[a], "-j")) && (a + 1 < argc)) {
+            threads = atoi(argv[++a]);
+            continue;
+        }
+        if ((0 == strcmp(argv[a], "-o")) && (a + 1 < argc)) {
+            prefix = argv[++a];
+            continue;
+        }
+        print_usage(argv);
+        return -1;
+    }
+    if (!input) {
+        print_usage(argv);
+        return -1;
+    }
+    if (threads < 1) threads = 1;
+    if (threads > DUMP_THREADS_MAX) threads = DUMP_THREADS_MAX;
+    if (!prefix) prefix = input;
+
+    fd = open(input, O_RDONLY);
+    if ((fd == -1) || fstat(fd, &st)) {
+        printf("%s: cannot open %s - %s\n", __func__, input, strerror(errno));
+        return -1;
+    }
+    if ((size_t)st.st_size < sizeof(job.header)) {
+        printf("%s: %s is not a capture file\n", __func__, input);
+        close(fd);
+        return -1;
+    }
+    job.map_size = st.st_size;
+    job.map = mmap(NULL, job.map_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (job.map == MAP_FAILED) {
+        printf("%s: cannot map %s - %s\n", __func__, input, strerror(errno));
+        return -1;
+    }
+    madvise((void *)job.map, job.map_size, MADV_SEQUENTIAL);
+
+    memcpy(&job.header, job.map, sizeof(job.header));
+    /* Version 1 chunk headers had no sample clock fields */
+    if (!memcmp(job.header.magic, CAPTURE_MAGIC, sizeof(job.header.magic)) &&
+        (job.header.version != CAPTURE_VERSION)) {
+        printf("%s: %s is capture format version %u, only version %u can be read\n", __func__, input,
+               job.header.version, CAPTURE_VERSION);
+        goto done;
+    }
+    if (capture_check_header(&job.header)) {
+        printf("%s: %s is not a capture file or its header is damaged\n", __func__, input);
+        goto done;
+    }
+    if ((job.header.encoding != CAPTURE_ENCODING_U32) &&
+        bitpack_layout_init(&job.layout, job.header.bits, job.header.channels)) {
+        printf("%s: unsupported channel widths\n", __func__);
+        goto done;
+    }
+    for (c = 0; c < job.header.channels; c++) {
+        job.mask[c] = (job.header.slots[c] == ECG) ? 0x3FFFF : 0x7FFFF;
+        job.sign[c] = (job.header.slots[c] == ECG) ? 0x20000 : 0;
+    }
+
+    /* Trailing part of a chunk, e.g. after power loss, is ignored */
+    job.chunks        = (job.map_size - job.header.header_size) / job.header.chunk_size;
+    job.ranges        = (job.chunks + DUMP_RANGE_CHUNKS - 1) / DUMP_RANGE_CHUNKS;
+    job.chunk_samples = calloc(job.chunks + 1, sizeof(uint32_t));
+    job.chunk_offset  = calloc(job.chunks + 1, sizeof(uint64_t));
+    if (!job.chunk_samples || !job.chunk_offset) {
+        printf("%s: cannot allocate chunk index\n", __func__);
+        goto done;
+    }
+
+    /* Pass 1: CRC of every chunk and output position of its samples */
+    t0 = latency_now_ns();
+    if (run_pool(&job, threads, scan_range)) goto done;
+    for (i = 0; i < job.chunks; i++) {
+        job.chunk_offset[i] = job.total_samples;
+        job.total_samples  += job.chunk_samples[i];
+    }
+    t_scan = latency_now_ns() - t0;
+
+    if (open_outputs(&job, prefix)) goto done;
+
+    /* Pass 2: decode and write */
+    t0 = latency_now_ns();
+    if (run_pool(&job, threads, convert_range)) goto done;
+    t_convert = latency_now_ns() - t0;
+
+    printf("%s: %s, %u channels (", input,
+           (job.header.encoding == CAPTURE_ENCODING_RICE)   ? "compressed" :
+           (job.header.encoding == CAPTURE_ENCODING_PACKED) ? "packed" : "u32",
+           job.header.channels);
+    for (c = 0; c < job.header.channels; c++) {
+        printf("%s%s", c ? "," : "", slot_name(job.header.slots[c]));
+    }
+    printf("), %d Hz\n", job.header.sampling_frequency);
+    printf("chunks %llu, damaged %llu, samples %llu, gaps %llu (%llu samples lost), %llu settings changes\n",
+           (unsigned long long)job.chunks, (unsigned long long)atomic_load(&job.bad_chunks),
+           (unsigned long long)job.total_samples, (unsigned long long)atomic_load(&job.gaps),
+           (unsigned long long)atomic_load(&job.lost_samples), (unsigned long long)atomic_load(&job.config_changes));
+    if (atomic_load(&job.has_trailer)) {
+        printf("stopped %s, %llu samples, %llu lost, %.6f Hz estimated sample rate\n",
+               job.trailer.stop_signal ? "by signal" : "on error", (unsigned long long)job.trailer.samples,
+               (unsigned long long)job.trailer.lost_samples,
+               job.trailer.sample_period_fs ? 1e15 / job.trailer.sample_period_fs : 0.0);
+    } else {
+        printf("no trailer, recording was cut\n");
+    }
+    printf("%s written in %.3f s (scan %.3f s), %ld threads, %.1f MB/s of capture file\n",
+           format_names[job.format], (double)(t_scan + t_convert) / 1e9, (double)t_scan / 1e9, threads,
+           (double)job.map_size * 1000 / (t_scan + t_convert + 1));
+    retval = 0;
+
+done:
+    close_outputs(&job);
+    munmap((void *)job.map, job.map_size);
+    free(job.chunk_samples);
+    free(job.chunk_offset);
+    return retval;
+}
+
+
+static int run_pool(struct dump_job *job, uint32_t threads, void (*pass)(struct dump_worker *, uint64_t)) {
+    pthread_t tid[DUMP_THREADS_MAX];
+    uint32_t started;
+    uint32_t i;
+
+    job->pass = pass;
+    job->turn = 0;
+    atomic_store(&job->next_range, 0);
+
+    for (started = 0; started < threads; started++) {
+        if (pthread_create(&tid[started], NULL, pool_thread, job)) break;
+    }
+    if (!started) {
+        printf("%s: cannot start threads\n", __func__);
+        return -1;
+    }
+    for (i = 0; i < started; i++) pthread_join(tid[i], NULL);
+
+    return atomic_load(&job->failed) ? -1 : 0;
+}
+
+/* Ranges are handed out in increasing order, so csv writer turn always
+ * belongs to a range that is already being converted */
+static void *pool_thread(void *arg) {
+    struct dump_job *job = arg;
+    struct dump_worker w;
+    uint64_t range;
+
+    memset(&w, 0, sizeof(w));
+    w.job = job;
+    w.chunk = malloc(job->header.chunk_size + BITPACK_SLACK_BYTES);
+    if (!w.chunk) atomic_store(&job->failed, 1);
+
+    while ((range = atomic_fetch_add(&job->next_range, 1)) < job->ranges) {
+        job->pass(&w, range);
+    }
+
+    free(w.chunk);
+    free(w.words);
+    free(w.values);
+    free(w.times);
+    free(w.text);
+    return NULL;
+}
+
+static void scan_range(struct dump_worker *w, uint64_t range) {
+    struct dump_job *job = w->job;
+    uint64_t end = (range + 1) * DUMP_RANGE_CHUNKS;
+    uint64_t i;
+
+    if (end > job->chunks) end = job->chunks;
+
+    for (i = range * DUMP_RANGE_CHUNKS; i < end; i++) {
+        const uint8_t *chunk = job->map + job->header.header_size + i * job->header.chunk_size;
+        int count = chunk_sample_count(job, chunk);
+
+        if (count < 0) {
+            atomic_fetch_add(&job->bad_chunks, 1);
+            count = 0;
+        } else if (!count) {
+            struct capture_chunk_header header;
+            struct capture_gap_record gap;
+
+            memcpy(&header, chunk, sizeof(header));
+            if ((header.magic == CAPTURE_CHUNK_MAGIC) && (header.flags & CAPTURE_CHUNK_FLAG_GAP) &&
+                (header.payload_bytes >= sizeof(gap))) {
+                memcpy(&gap, chunk + sizeof(header), sizeof(gap));
+                atomic_fetch_add(&job->gaps, 1);
+                atomic_fetch_add(&job->lost_samples, gap.lost_samples);
+            }
+            if ((header.magic == CAPTURE_CHUNK_MAGIC) && (header.flags & CAPTURE_CHUNK_FLAG_CONFIG)) {
+                atomic_fetch_add(&job->config_changes, 1);
+            }
+            /* Only one chunk may hold it, the last written one */
+            if ((header.magic == CAPTURE_CHUNK_MAGIC) && (header.flags & CAPTURE_CHUNK_FLAG_TRAILER) &&
+                (header.payload_bytes >= sizeof(job->trailer))) {
+                memcpy(&job->trailer, chunk + sizeof(header), sizeof(job->trailer));
+                atomic_store(&job->has_trailer, 1);
+            }
+        }
+        job->chunk_samples[i] = count;
+    }
+}
+
+static void convert_range(struct dump_worker *w, uint64_t range) {
+    struct dump_job *job = w->job;
+    uint32_t channels = job->header.channels;
+    uint64_t first = range * DUMP_RANGE_CHUNKS;
+    uint64_t end = first + DUMP_RANGE_CHUNKS;
+    uint64_t samples;
+    size_t words;
+    size_t text_len = 0;
+    int failed = atomic_load(&job->failed);
+    uint64_t i;
+    uint32_t c;
+
+    if (end > job->chunks) end = job->chunks;
+    samples = job->chunk_offset[end - 1] + job->chunk_samples[end - 1] - job->chunk_offset[first];
+    words = samples * channels;
+
+    if (!failed && (words > w->words_size)) {
+        free(w->values);
+        free(w->words);
+        w->values = malloc(words * sizeof(int32_t));
+        w->words  = malloc(words * sizeof(uint32_t) + BITPACK_SLACK_BYTES);
+        w->words_size = (w->values && w->words) ? words : 0;
+        if (!w->words_size) failed = 1;
+    }
+    if (!failed && (samples > w->times_size)) {
+        free(w->times);
+        w->times = malloc(samples * sizeof(uint64_t));
+        w->times_size = w->times ? samples : 0;
+        if (!w->times) failed = 1;
+    }
+
+    /* Samples of the whole range, interleaved */
+    for (i = first; !failed && (i < end); i++) {
+        uint64_t offset = job->chunk_offset[i] - job->chunk_offset[first];
+
+        if (!job->chunk_samples[i]) continue;
+        if (decode_chunk(w, chunk_data(w, i), w->values + offset * channels, w->times + offset)) failed = 1;
+    }
+
+    if (!failed && (job->format != DUMP_CSV)) {
+        /* Channels go to separate files, at known offsets */
+        int32_t *plane = (int32_t *)w->words;
+
+        for (c = 0; !failed && (c < channels); c++) {
+            for (i = 0; i < samples; i++) {
+                uint32_t v = w->values[i * channels + c];
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+                v = __builtin_bswap32(v);
+#endif
+                plane[i] = v;
+            }
+            if (write_all(job->fd[c], plane, samples * sizeof(int32_t),
+                          job->data_offset + job->chunk_offset[first] * sizeof(int32_t))) {
+                failed = 1;
+            }
+        }
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+        for (i = 0; i < samples; i++) w->times[i] = __builtin_bswap64(w->times[i]);
+#endif
+        if (!failed && write_all(job->time_fd, w->times, samples * sizeof(uint64_t),
+                                 job->data_offset + job->chunk_offset[first] * sizeof(uint64_t))) {
+            failed = 1;
+        }
+    } else if (!failed) {
+        if (samples * DUMP_CSV_ROW_MAX > w->text_size) {
+            free(w->text);
+            w->text = malloc(samples * DUMP_CSV_ROW_MAX);
+            w->text_size = w->text ? samples * DUMP_CSV_ROW_MAX : 0;
+            if (!w->text) failed = 1;
+        }
+        for (i = first; !failed && (i < end); i++) {
+            const int32_t *v = w->values + (job->chunk_offset[i] - job->chunk_offset[first]) * channels;
+            const uint64_t *t = w->times + (job->chunk_offset[i] - job->chunk_offset[first]);
+            char *p = w->text + text_len;
+            struct capture_chunk_header ch;
+            uint32_t n;
+
+            /* Sample numbers come from chunk, so lost chunks show as gaps */
+            memcpy(&ch, job->map + job->header.header_size + i * job->header.chunk_size, sizeof(ch));
+            for (n = 0; n < job->chunk_samples[i]; n++) {
+                p = format_int(p, ch.first_sample + n);
+                *p++ = ',';
+                p = format_int(p, t[n]);
+                for (c = 0; c < channels; c++) {
+                    *p++ = ',';
+                    p = format_int(p, *v++);
+                }
+                *p++ = '\n';
+            }
+            text_len = p - w->text;
+        }
+    }
+
+    if (job->format == DUMP_CSV) {
+        pthread_mutex_lock(&job->turn_lock);
+        while (job->turn != range) pthread_cond_wait(&job->turn_cond, &job->turn_lock);
+        pthread_mutex_unlock(&job->turn_lock);
+
+        if (!failed && !atomic_load(&job->failed) && write_all(job->fd[0], w->text, text_len, -1)) {
+            failed = 1;
+        }
+
+        pthread_mutex_lock(&job->turn_lock);
+        job->turn++;
+        pthread_cond_broadcast(&job->turn_cond);
+        pthread_mutex_unlock(&job->turn_lock);
+    }
+
+    if (failed) atomic_store(&job->failed, 1);
+}
+
+/* Samples in an intact chunk, 0 for never written one, -1 if damaged */
+static int chunk_sample_count(struct dump_job *job, const uint8_t *chunk) {
+    struct capture_chunk_header header;
+    uint64_t bits;
+
+    memcpy(&header, chunk, sizeof(header));
+    if (header.magic != CAPTURE_CHUNK_MAGIC) {
+        /* Preallocated file ends with zeroes */
+        return (header.magic || header.crc32) ? -1 : 0;
+    }
+    if (capture_check_chunk(chunk, job->header.chunk_size)) return -1;
+
+    bits = (uint64_t)header.payload_bytes * 8;
+    switch (job->header.encoding) {
+        case CAPTURE_ENCODING_PACKED:
+            if ((uint64_t)header.sample_count * job->layout.sample_bits > bits) return -1;
+            break;
+        case CAPTURE_ENCODING_RICE:
+            if ((uint64_t)header.sample_count * job->header.channels > bits) return -1;
+            break;
+        default:
+            if ((uint64_t)header.sample_count * job->header.channels * 32 > bits) return -1;
+            break;
+    }
+    return header.sample_count;
+}
+
+/* Decoders read up to BITPACK_SLACK_BYTES past the payload, which may be
+ * past the end of mapping for the last chunk */
+static const uint8_t *chunk_data(struct dump_worker *w, uint64_t i) {
+    struct dump_job *job = w->job;
+    size_t offset = job->header.header_size + i * job->header.chunk_size;
+
+    if (offset + job->header.chunk_size + BITPACK_SLACK_BYTES <= job->map_size) return job->map + offset;
+
+    memcpy(w->chunk, job->map + offset, job->header.chunk_size);
+    memset(w->chunk + job->header.chunk_size, 0, BITPACK_SLACK_BYTES);
+    return w->chunk;
+}
+
+static int decode_chunk(struct dump_worker *w, const uint8_t *chunk, int32_t *dst, uint64_t *times) {
+    struct dump_job *job = w->job;
+    const struct capture_chunk_header *header = (const struct capture_chunk_header *)chunk;
+    const uint8_t *payload = chunk + sizeof(*header);
+    uint32_t channels = job->header.channels;
+    uint32_t words = header->sample_count * channels;
+    uint32_t *src = w->words;
+    uint64_t period_fs = header->sample_period_fs;
+    uint64_t t0 = header->sample_time_ns;
+    uint32_t i;
+
+    /* Chunks cut before clock estimate existed fall back to nominal rate */
+    if (!period_fs && (job->header.sampling_frequency > 0)) {
+        period_fs = 1000000000000000ull / job->header.sampling_frequency;
+        t0 = header->timestamp_ns;
+    }
+    for (i = 0; i < header->sample_count; i++) {
+        times[i] = t0 + (uint64_t)i * period_fs / 1000000;
+    }
+
+    switch (job->header.encoding) {
+        case CAPTURE_ENCODING_RICE: {
+            struct codec_state codec;
+
+            if (codec_init(&codec, job->header.slots, channels)) return -1;
+            codec_decode(&codec, payload, 0, header->sample_count, src);
+            break;
+        }
+        case CAPTURE_ENCODING_PACKED:
+            bitpack_unpack(payload, 0, header->sample_count, &job->layout, src);
+            break;
+        default:
+            memcpy(src, payload, words * sizeof(uint32_t));
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+            for (i = 0; i < words; i++) src[i] = __builtin_bswap32(src[i]);
+#endif
+            break;
+    }
+
+    /* Packed and compressed values are raw ADC fields. u32 ones are
+     * already masked and sign extended, this leaves them as they are */
+    for (i = 0; i < words; i++) {
+        uint32_t c = i % channels;
+
+        dst[i] = (int32_t)(((src[i] & job->mask[c]) ^ job->sign[c]) - job->sign[c]);
+    }
+    return 0;
+}
+
+/* pwrite() at offset, or write() for offset -1 */
+static int write_all(int fd, const void *buf, size_t len, off_t offset) {
+    const uint8_t *p = buf;
+
+    while (len) {
+        ssize_t n = (offset < 0) ? write(fd, p, len) : pwrite(fd, p, len, offset);
+
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            printf("%s: write failed - %s\n", __func__, strerror(errno));
+            return -1;
+        }
+        p   += n;
+        len -= n;
+        if (offset >= 0) offset += n;
+    }
+    return 0;
+}
+
+static char *format_int(char *p, int64_t v) {
+    char tmp[24];
+    uint64_t u = (v < 0) ? -(uint64_t)v : (uint64_t)v;
+    int n = 0;
+
+    if (v < 0) *p++ = '-';
+    do {
+        tmp[n++] = '0' + u % 10;
+        u /= 10;
+    } while (u);
+    while (n) *p++ = tmp[--n];
+    return p;
+}
+
+static int open_outputs(struct dump_job *job, const char *prefix) {
+    char name[4096];
+    uint32_t c;
+
+    if (job->format == DUMP_CSV) {
+        char head[DUMP_CSV_ROW_MAX * 2] = "sample,time_ns";
+
+        snprintf(name, sizeof(name), "%s.csv", prefix);
+        job->fd[0] = open(name, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (job->fd[0] == -1) goto fail;
+
+        for (c = 0; c < job->header.channels; c++) {
+            strcat(head, ",");
+            strcat(head, slot_name(job->header.slots[c]));
+        }
+        strcat(head, "\n");
+        return write_all(job->fd[0], head, strlen(head), -1);
+    }
+
+    if (job->format == DUMP_NPY) job->data_offset = DUMP_NPY_HEADER;
+
+    for (c = 0; c < job->header.channels; c++) {
+        job->fd[c] = open_output(job, prefix, slot_name(job->header.slots[c]), "<i4", sizeof(int32_t));
+        if (job->fd[c] == -1) return -1;
+    }
+    job->time_fd = open_output(job, prefix, "time_ns", "<i8", sizeof(uint64_t));
+    return (job->time_fd == -1) ? -1 : 0;
+
+fail:
+    printf("%s: cannot create %s - %s\n", __func__, name, strerror(errno));
+    return -1;
+}
+
+/* Per channel file sized for all samples. NPY 1.0 header is magic,
+ * version, header length and dict padded with spaces */
+static int open_output(struct dump_job *job, const char *prefix, const char *name, const char *descr, size_t size) {
+    char path[4096];
+    char npy[DUMP_NPY_HEADER];
+    int fd;
+
+    snprintf(path, sizeof(path), "%s_%s.%s", prefix, name, format_names[job->format]);
+    fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if ((fd == -1) || ftruncate(fd, job->data_offset + job->total_samples * size)) {
+        printf("%s: cannot create %s - %s\n", __func__, path, strerror(errno));
+        if (fd != -1) close(fd);
+        return -1;
+    }
+
+    if (job->format == DUMP_NPY) {
+        int len;
+
+        memset(npy, ' ', sizeof(npy));
+        memcpy(npy, "\x93NUMPY\x01\x00", 8);
+        npy[8] = (DUMP_NPY_HEADER - 10) & 0xFF;
+        npy[9] = (DUMP_NPY_HEADER - 10) >> 8;
+        len = snprintf(npy + 10, sizeof(npy) - 10, "{'descr': '%s', 'fortran_order': False, 'shape': (%llu,), }",
+                       descr, (unsigned long long)job->total_samples);
+        npy[10 + len] = ' ';
+        npy[DUMP_NPY_HEADER - 1] = '\n';
+        if (write_all(fd, npy, sizeof(npy), 0)) {
+            close(fd);
+            return -1;
+        }
+    }
+    return fd;
+}
+
+static void close_outputs(struct dump_job *job) {
+    uint32_t c;
+
+    for (c = 0; c < MAX_SIGNALS_ALLOWED; c++) {
+        if (job->fd[c] != -1) close(job->fd[c]);
+    }
+    if (job->time_fd != -1) close(job->time_fd);
+}
+
+static const char *slot_name(uint8_t slot) {
+    switch (slot) {
+        case PPG_LED1:
+            return "ppg1";
+        case PPG_LED2:
+            return "ppg2";
+        case PILOT_LED1:
+            return "pilot1";
+        case PILOT_LED2:
+            return "pilot2";
+        case ECG:
+            return "ecg";
+        default:
+            return "unknown";
+    }
+}
+
+static void print_usage(char **argv) {
+    printf("%s usage:\n", argv[0]);
+    printf("\t%s [-f csv|npy|raw] [-j threads] [-o prefix] capture_file\n", argv[0]);
+    printf("\t-f\t-\toutput format, csv(default), npy or raw (little-endian int32)\n");
+    printf("\t-j\t-\tconverter threads. Default is number of CPUs\n");
+    printf("\t-o\t-\toutput name prefix. Default is capture file name\n");
+}